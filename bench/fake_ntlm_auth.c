@@ -0,0 +1,314 @@
+/* A stand-in for Samba's ntlm_auth, so the module can be benchmarked
+   without winbindd or a domain controller.  Speaks the three helper
+   protocols the module uses:
+
+     --helper-protocol=squid-2.5-ntlmssp   YR/KK -> TT/AF/NA/BH
+     --helper-protocol=gss-spnego          YR/KK -> TT/AF/NA/BH, 3 fields
+     --helper-protocol=squid-2.5-basic     "user pass" -> OK/ERR
+
+   NTLMSSP is played straight: a Type-1 gets a Type-2 with a fixed
+   challenge, and a Type-3 is accepted for whatever user it names,
+   unless the name starts with "bad".  Basic accepts any user whose
+   password is --password.  Nothing is verified.
+
+   Options, to shape the benchmark:
+
+     --latency-ms=N     sleep this long before every answer
+     --jitter-ms=N      plus up to this much more, at random
+     --fail-rate=F      answer NA/ERR to this fraction of logins
+     --bh-rate=F        answer BH to this fraction of requests
+     --hang-rate=F      never answer this fraction of requests
+     --die-after=N      exit after answering N requests
+     --password=PW      the Basic password (default "secret")
+     --concurrent       squid channel IDs on every line (Basic only),
+                        answered in parallel
+
+     cc -O2 -pthread -o fake_ntlm_auth fake_ntlm_auth.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#define LINE_MAX_LEN ( 1024 * 1024 )
+
+enum { NTLMSSP, SPNEGO, BASIC };
+
+static int protocol = -1;
+static int latency_ms = 0, jitter_ms = 0, die_after = 0, concurrent = 0;
+static double fail_rate = 0, bh_rate = 0, hang_rate = 0;
+static const char *password = "secret";
+static unsigned int seed;
+static pthread_mutex_t out_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char b64chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static char *b64_encode( const unsigned char *in, size_t len ) {
+    char *out = malloc( ( len + 2 ) / 3 * 4 + 1 ), *p = out;
+    size_t i;
+
+    for ( i = 0; i + 2 < len; i += 3 ) {
+        *p++ = b64chars[in[i] >> 2];
+        *p++ = b64chars[(( in[i] & 3 ) << 4 ) | ( in[i + 1] >> 4 )];
+        *p++ = b64chars[(( in[i + 1] & 15 ) << 2 ) | ( in[i + 2] >> 6 )];
+        *p++ = b64chars[in[i + 2] & 63];
+    }
+    if ( i < len ) {
+        *p++ = b64chars[in[i] >> 2];
+        if ( i + 1 < len ) {
+            *p++ = b64chars[(( in[i] & 3 ) << 4 ) | ( in[i + 1] >> 4 )];
+            *p++ = b64chars[( in[i + 1] & 15 ) << 2];
+        } else {
+            *p++ = b64chars[( in[i] & 3 ) << 4];
+            *p++ = '=';
+        }
+        *p++ = '=';
+    }
+    *p = '\0';
+    return out;
+}
+
+static size_t b64_decode( const char *in, unsigned char *out ) {
+    unsigned int acc = 0;
+    int bits = 0;
+    size_t n = 0;
+    const char *c;
+
+    for ( ; *in && *in != '='; in++ ) {
+        if (( c = strchr( b64chars, *in )) == NULL ) {
+            break;
+        }
+        acc = ( acc << 6 ) | ( c - b64chars );
+        if (( bits += 6 ) >= 8 ) {
+            bits -= 8;
+            out[n++] = ( acc >> bits ) & 0xff;
+        }
+    }
+    return n;
+}
+
+static unsigned int get16( const unsigned char *p ) {
+    return p[0] | ( p[1] << 8 );
+}
+
+static unsigned int get32( const unsigned char *p ) {
+    return p[0] | ( p[1] << 8 ) | ( p[2] << 16 ) | ((unsigned int) p[3] << 24 );
+}
+
+static void put32( unsigned char *p, unsigned int v ) {
+    p[0] = v & 0xff;
+    p[1] = ( v >> 8 ) & 0xff;
+    p[2] = ( v >> 16 ) & 0xff;
+    p[3] = ( v >> 24 ) & 0xff;
+}
+
+/* Pull a string out of a Type-3 security buffer, UTF-16LE or OEM */
+static void ntlmssp_string( const unsigned char *msg, size_t len, size_t at,
+                            int unicode, char *out, size_t size ) {
+    size_t l, off, i, o = 0;
+
+    out[0] = '\0';
+    if ( at + 8 > len ) {
+        return;
+    }
+    l = get16( msg + at );
+    off = get32( msg + at + 4 );
+    if ( off > len || l > len - off ) {
+        return;
+    }
+    for ( i = 0; i < l && o + 1 < size; i += unicode ? 2 : 1 ) {
+        out[o++] = msg[off + i];
+    }
+    out[o] = '\0';
+}
+
+static char *type2( void ) {
+    unsigned char msg[48];
+
+    memset( msg, 0, sizeof( msg ));
+    memcpy( msg, "NTLMSSP", 8 );
+    put32( msg + 8, 2 );
+    put32( msg + 16, 48 );                  /* empty target name */
+    put32( msg + 20, 0x00028201 );          /* unicode, NTLM, target type domain */
+    memcpy( msg + 24, "\x01\x23\x45\x67\x89\xab\xcd\xef", 8 );
+    put32( msg + 44, 48 );                  /* empty target info */
+    return b64_encode( msg, sizeof( msg ));
+}
+
+static int chance( double rate ) {
+    return rate > 0 && rand_r( &seed ) < rate * RAND_MAX;
+}
+
+static void delay( void ) {
+    int ms = latency_ms + ( jitter_ms ? rand_r( &seed ) % ( jitter_ms + 1 ) : 0 );
+    struct timespec ts;
+
+    if ( ms > 0 ) {
+        ts.tv_sec = ms / 1000;
+        ts.tv_nsec = ( ms % 1000 ) * 1000000L;
+        nanosleep( &ts, NULL );
+    }
+}
+
+/* Work out the reply to one request line, without the channel ID */
+static void answer( char *line, char *reply, size_t size ) {
+    if ( chance( bh_rate )) {
+        snprintf( reply, size, "BH injected failure" );
+        return;
+    }
+
+    if ( protocol == BASIC ) {
+        char *pass = strchr( line, ' ' );
+
+        if ( pass == NULL || strcmp( pass + 1, password ) != 0 || chance( fail_rate )) {
+            snprintf( reply, size, "ERR" );
+        } else {
+            snprintf( reply, size, "OK" );
+        }
+        return;
+    }
+
+    if ( strncmp( line, "YR", 2 ) == 0 ) {
+        /* a bare YR is the module's warm-up probe */
+        char *challenge = type2();
+
+        snprintf( reply, size, protocol == SPNEGO ? "TT %s *" : "TT %s", challenge );
+        free( challenge );
+    } else if ( strncmp( line, "KK ", 3 ) == 0 ) {
+        unsigned char *msg = malloc( strlen( line ));
+        size_t len = b64_decode( line + 3, msg );
+        char user[256], domain[256];
+        int unicode;
+
+        if ( len < 64 || memcmp( msg, "NTLMSSP", 8 ) != 0 || get32( msg + 8 ) != 3 ) {
+            snprintf( reply, size, "BH not an NTLMSSP authenticate message" );
+            free( msg );
+            return;
+        }
+        unicode = get32( msg + 60 ) & 1;
+        ntlmssp_string( msg, len, 28, unicode, domain, sizeof( domain ));
+        ntlmssp_string( msg, len, 36, unicode, user, sizeof( user ));
+        free( msg );
+
+        if ( strncmp( user, "bad", 3 ) == 0 || chance( fail_rate )) {
+            snprintf( reply, size, protocol == SPNEGO ? "NA * NT_STATUS_LOGON_FAILURE"
+                      : "NA NT_STATUS_LOGON_FAILURE" );
+        } else {
+            snprintf( reply, size, protocol == SPNEGO ? "AF * %s\\%s" : "AF %s\\%s",
+                      domain[0] ? domain : "BENCH", user );
+        }
+    } else {
+        snprintf( reply, size, "BH unknown request" );
+    }
+}
+
+static void respond( const char *id, char *line ) {
+    static char reply[4096];
+    char *buf = concurrent ? malloc( sizeof( reply )) : reply;
+
+    if ( chance( hang_rate )) {
+        if ( concurrent ) {
+            free( buf );
+        }
+        return;
+    }
+    delay();
+    answer( line, buf, sizeof( reply ));
+
+    pthread_mutex_lock( &out_mutex );
+    if ( id != NULL ) {
+        printf( "%s %s\n", id, buf );
+    } else {
+        printf( "%s\n", buf );
+    }
+    fflush( stdout );
+    pthread_mutex_unlock( &out_mutex );
+    if ( concurrent ) {
+        free( buf );
+    }
+}
+
+static void *channel_thread( void *arg ) {
+    char *line = arg, *sp = strchr( line, ' ' );
+
+    if ( sp == NULL ) {
+        respond( line, sp = "" );
+    } else {
+        *sp = '\0';
+        respond( line, sp + 1 );
+    }
+    free( line );
+    return NULL;
+}
+
+int main( int argc, char **argv ) {
+    static char line[LINE_MAX_LEN];
+    unsigned long answered = 0;
+    int i;
+
+    for ( i = 1; i < argc; i++ ) {
+        const char *a = argv[i];
+
+        if ( strcmp( a, "--helper-protocol=squid-2.5-ntlmssp" ) == 0 ) {
+            protocol = NTLMSSP;
+        } else if ( strcmp( a, "--helper-protocol=gss-spnego" ) == 0 ) {
+            protocol = SPNEGO;
+        } else if ( strcmp( a, "--helper-protocol=squid-2.5-basic" ) == 0 ) {
+            protocol = BASIC;
+        } else if ( strncmp( a, "--latency-ms=", 13 ) == 0 ) {
+            latency_ms = atoi( a + 13 );
+        } else if ( strncmp( a, "--jitter-ms=", 12 ) == 0 ) {
+            jitter_ms = atoi( a + 12 );
+        } else if ( strncmp( a, "--fail-rate=", 12 ) == 0 ) {
+            fail_rate = atof( a + 12 );
+        } else if ( strncmp( a, "--bh-rate=", 10 ) == 0 ) {
+            bh_rate = atof( a + 10 );
+        } else if ( strncmp( a, "--hang-rate=", 12 ) == 0 ) {
+            hang_rate = atof( a + 12 );
+        } else if ( strncmp( a, "--die-after=", 12 ) == 0 ) {
+            die_after = atoi( a + 12 );
+        } else if ( strncmp( a, "--password=", 11 ) == 0 ) {
+            password = a + 11;
+        } else if ( strcmp( a, "--concurrent" ) == 0 ) {
+            concurrent = 1;
+        } else {
+            /* real ntlm_auth options such as --require-membership-of
+               are accepted and ignored */
+        }
+    }
+    if ( protocol < 0 ) {
+        fprintf( stderr, "%s: --helper-protocol= squid-2.5-ntlmssp, gss-spnego "
+                 "or squid-2.5-basic is required\n", argv[0] );
+        return 1;
+    }
+    if ( concurrent && protocol != BASIC ) {
+        fprintf( stderr, "%s: --concurrent only works with squid-2.5-basic\n", argv[0] );
+        return 1;
+    }
+    seed = getpid() ^ time( NULL );
+
+    while ( fgets( line, sizeof( line ), stdin ) != NULL ) {
+        line[strcspn( line, "\r\n" )] = '\0';
+
+        if ( concurrent ) {
+            pthread_t t;
+
+            pthread_create( &t, NULL, channel_thread, strdup( line ));
+            pthread_detach( t );
+        } else {
+            respond( NULL, line );
+        }
+        if ( die_after && ++answered >= (unsigned long) die_after ) {
+            break;
+        }
+    }
+
+    if ( concurrent ) {
+        /* let the answers still in flight finish */
+        pthread_exit( NULL );
+    }
+    return 0;
+}
@@ -0,0 +1,129 @@
+/* Times the helper line protocol code: parsing representative ntlm_auth
+   replies, and building requests, as the module does for every leg.
+
+     cc -O2 -I.. -o helper_proto_bench helper_proto_bench.c ../ntlm_helper_proto.c
+     ./helper_proto_bench [millions-of-lines]
+
+   Replies are parsed in place, so each is first copied into a scratch
+   line; the copy is timed on its own too, to be subtracted. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ntlm_helper_proto.h"
+
+static double now( void ) {
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* A base64 string of len characters */
+static char *blob( size_t len ) {
+    static const char b64[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char *s = malloc( len + 1 );
+    size_t i;
+
+    for ( i = 0; i < len; i++ ) {
+        s[i] = b64[( i * 7 ) % 64];
+    }
+    s[len] = '\0';
+    return s;
+}
+
+struct sample {
+    const char *name;
+    int fields;
+    char *line;
+};
+
+int main( int argc, char **argv ) {
+    long n = ( argc > 1 ? atol( argv[1] ) : 10 ) * 1000000L, i;
+    char *type2 = blob( 300 ), *ticket = blob( 4000 ), *type3 = blob( 600 );
+    struct sample samples[] = {
+        { "ntlmssp TT", HELPER_FIELDS_NTLMSSP, NULL },
+        { "ntlmssp AF", HELPER_FIELDS_NTLMSSP, "AF EXAMPLE\\someuser" },
+        { "ntlmssp NA", HELPER_FIELDS_NTLMSSP, "NA NT_STATUS_WRONG_PASSWORD" },
+        { "spnego TT", HELPER_FIELDS_SPNEGO, NULL },
+        { "spnego AF", HELPER_FIELDS_SPNEGO, NULL },
+        { "basic OK", HELPER_FIELDS_BASIC, "OK" },
+        { "basic ERR", HELPER_FIELDS_BASIC, "ERR" },
+        { "channel OK", 0, "17 OK" },
+    };
+    int nsamples = sizeof( samples ) / sizeof( samples[0] ), s;
+    struct iovec vec[HELPER_REQUEST_VECS];
+    char id_buf[HELPER_CHANNEL_ID_SIZE];
+    struct helper_reply reply;
+    const char *rest;
+    size_t sink = 0, max = 0;
+    double t0, copy, parse;
+    char *scratch;
+    long id;
+
+    if ( n <= 0 ) {
+        fprintf( stderr, "usage: %s [millions-of-lines]\n", argv[0] );
+        return 1;
+    }
+    samples[0].line = malloc( strlen( type2 ) + 4 );
+    sprintf( samples[0].line, "TT %s", type2 );
+    samples[3].line = malloc( strlen( type2 ) + 6 );
+    sprintf( samples[3].line, "TT %s *", type2 );
+    samples[4].line = malloc( strlen( ticket ) + 32 );
+    sprintf( samples[4].line, "AF %s EXAMPLE\\someuser", ticket );
+    for ( s = 0; s < nsamples; s++ ) {
+        if ( strlen( samples[s].line ) > max ) {
+            max = strlen( samples[s].line );
+        }
+    }
+    scratch = malloc( max + 1 );
+
+    printf( "%ld lines of each\n", n );
+    for ( s = 0; s < nsamples; s++ ) {
+        size_t len = strlen( samples[s].line ) + 1;
+
+        t0 = now();
+        for ( i = 0; i < n; i++ ) {
+            memcpy( scratch, samples[s].line, len );
+            sink += scratch[i % len];
+        }
+        copy = now() - t0;
+
+        t0 = now();
+        for ( i = 0; i < n; i++ ) {
+            memcpy( scratch, samples[s].line, len );
+            if ( samples[s].fields == 0 ) {
+                helper_channel_parse( scratch, &id, &rest );
+                helper_reply_parse( (char *) rest, HELPER_FIELDS_BASIC, &reply );
+            } else {
+                helper_reply_parse( scratch, samples[s].fields, &reply );
+            }
+            sink += reply.code + reply.arg[0];
+        }
+        parse = now() - t0;
+
+        printf( "  %-11s %5lu bytes %8.1f ns/line (%.1f ns copying)\n", samples[s].name,
+                (unsigned long)( len - 1 ), parse * 1e9 / n, copy * 1e9 / n );
+    }
+
+    t0 = now();
+    for ( i = 0; i < n; i++ ) {
+        sink += helper_request_token( vec, "KK", type3 ) + vec[2].iov_len;
+    }
+    printf( "  %-11s %5lu bytes %8.1f ns/request\n", "request KK",
+            (unsigned long) strlen( type3 ), ( now() - t0 ) * 1e9 / n );
+
+    t0 = now();
+    for ( i = 0; i < n; i++ ) {
+        sink += helper_request_plaintext( vec, id_buf, i & 63, "someuser", "correct horse" )
+            + vec[0].iov_len;
+    }
+    printf( "  %-11s %5s       %8.1f ns/request\n", "request OK", "",
+            ( now() - t0 ) * 1e9 / n );
+
+    /* keep the work from being optimised away */
+    return sink == 0;
+}
@@ -0,0 +1,90 @@
+/* libFuzzer target for ntlm_helper_proto.c.  Feeds each input to the
+   reply and channel parsers under every layout, and to the request
+   builders, checking that a request is always exactly one line.
+
+     clang -g -O1 -fsanitize=fuzzer,address,undefined -I.. \
+         -o helper_proto_fuzz helper_proto_fuzz.c ../ntlm_helper_proto.c
+     ./helper_proto_fuzz -max_len=4096 corpus/ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ntlm_helper_proto.h"
+
+/* Every part of a parsed reply must lie inside the line */
+static void check_within( const char *part, const char *line, size_t len ) {
+    if ( part != NULL && part[0] != '\0' && ( part < line || part > line + len )) {
+        abort();
+    }
+}
+
+/* A request must end in its only line break */
+static void check_request( const struct iovec *vec, int nvec ) {
+    size_t breaks = 0, i;
+    const char *last = NULL;
+    int v;
+
+    if ( nvec < 0 ) {
+        return;
+    }
+    if ( nvec == 0 || nvec > HELPER_REQUEST_VECS ) {
+        abort();
+    }
+    for ( v = 0; v < nvec; v++ ) {
+        const char *b = vec[v].iov_base;
+
+        for ( i = 0; i < vec[v].iov_len; i++ ) {
+            if ( b[i] == '\n' || b[i] == '\r' ) {
+                breaks++;
+            }
+            last = b + i;
+        }
+    }
+    if ( breaks != 1 || last == NULL || *last != '\n' ) {
+        abort();
+    }
+}
+
+int LLVMFuzzerTestOneInput( const uint8_t *data, size_t size ) {
+    static const int layouts[] = { HELPER_FIELDS_BASIC, HELPER_FIELDS_NTLMSSP, HELPER_FIELDS_SPNEGO };
+    struct iovec vec[HELPER_REQUEST_VECS];
+    char id_buf[HELPER_CHANNEL_ID_SIZE];
+    struct helper_reply reply;
+    const char *rest, *user, *pass;
+    char *line = malloc( size + 1 );
+    size_t i, len;
+    long id;
+
+    for ( i = 0; i < sizeof( layouts ) / sizeof( layouts[0] ); i++ ) {
+        memcpy( line, data, size );
+        line[size] = '\0';
+        len = strlen( line );
+        if ( helper_reply_parse( line, layouts[i], &reply ) == 0 ) {
+            check_within( reply.blob, line, len );
+            check_within( reply.arg, line, len );
+            if ( reply.blob != NULL && layouts[i] != HELPER_FIELDS_SPNEGO ) {
+                abort();
+            }
+        }
+    }
+
+    memcpy( line, data, size );
+    line[size] = '\0';
+    if ( helper_channel_parse( line, &id, &rest ) == 0 ) {
+        if ( id < 0 || rest <= line || rest > line + strlen( line )) {
+            abort();
+        }
+    }
+
+    /* the input up to the first NUL is a token or user, the rest a password */
+    user = line;
+    len = strlen( line );
+    pass = len < size ? (const char *) line + len + 1 : "";
+    check_request( vec, helper_request_token( vec, "KK", user ));
+    check_request( vec, helper_request_plaintext( vec, id_buf, -1, user, pass ));
+    check_request( vec, helper_request_plaintext( vec, id_buf, size & 0xffff, user, pass ));
+
+    free( line );
+    return 0;
+}
@@ -0,0 +1,418 @@
+/* Drives complete NTLM, Negotiate or Basic handshakes against a local
+   httpd and reports handshakes per second and latency percentiles.
+
+     cc -O2 -pthread -o ntlm_load ntlm_load.c
+     ./ntlm_load [-h host] [-p port] [-u path] [-s ntlm|negotiate|basic]
+                 [-c connections] [-d seconds | -n handshakes]
+                 [-k] [-U users] [-P password] [-l label]
+
+   Each of the -c threads runs handshakes back to back.  By default every
+   handshake gets a fresh connection, as a browser opening a new socket
+   would; with -k a thread keeps its connection and starts the next
+   handshake on it, which makes the module re-authenticate a connection
+   it already knows.  A handshake is timed from the first request to the
+   final 200, so NTLM and Negotiate times cover both legs.
+
+   The Type-3 names user<N> for N below -U, so the throttle and any
+   per-user caching see a realistic spread.  Names starting with "bad"
+   are refused by fake_ntlm_auth; nothing else is checked, so the
+   responses in the Type-3 are zeros.
+
+   The last line of output is "RESULT key=value ...", for scripts. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define BUFSIZE 65536
+
+enum { NTLM, NEGOTIATE, BASIC };
+
+static const char *host = "127.0.0.1", *port = "8080", *path = "/";
+static const char *password = "secret", *label = "";
+static int scheme = NTLM, threads = 8, duration = 10, keepalive = 0, users = 100;
+static long limit = 0;
+
+static struct addrinfo *addr;
+static volatile int stop;
+static long issued;
+static pthread_mutex_t issue_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct worker {
+    pthread_t thread;
+    unsigned int seed;
+    double *lat;            /* milliseconds, one per completed handshake */
+    long nlat, maxlat;
+    long failed, denied, connects;
+};
+
+static const char b64chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static void b64_encode( const unsigned char *in, size_t len, char *out ) {
+    size_t i;
+
+    for ( i = 0; i + 2 < len; i += 3 ) {
+        *out++ = b64chars[in[i] >> 2];
+        *out++ = b64chars[(( in[i] & 3 ) << 4 ) | ( in[i + 1] >> 4 )];
+        *out++ = b64chars[(( in[i + 1] & 15 ) << 2 ) | ( in[i + 2] >> 6 )];
+        *out++ = b64chars[in[i + 2] & 63];
+    }
+    if ( i < len ) {
+        *out++ = b64chars[in[i] >> 2];
+        if ( i + 1 < len ) {
+            *out++ = b64chars[(( in[i] & 3 ) << 4 ) | ( in[i + 1] >> 4 )];
+            *out++ = b64chars[( in[i + 1] & 15 ) << 2];
+        } else {
+            *out++ = b64chars[( in[i] & 3 ) << 4];
+            *out++ = '=';
+        }
+        *out++ = '=';
+    }
+    *out = '\0';
+}
+
+static void put16( unsigned char *p, unsigned int v ) {
+    p[0] = v & 0xff;
+    p[1] = ( v >> 8 ) & 0xff;
+}
+
+static void put32( unsigned char *p, unsigned int v ) {
+    put16( p, v & 0xffff );
+    put16( p + 2, v >> 16 );
+}
+
+static void type1( char *out ) {
+    unsigned char msg[32];
+
+    memset( msg, 0, sizeof( msg ));
+    memcpy( msg, "NTLMSSP", 8 );
+    put32( msg + 8, 1 );
+    put32( msg + 12, 0x00088207 );      /* unicode, OEM, request target, NTLM */
+    b64_encode( msg, sizeof( msg ), out );
+}
+
+static void secbuf( unsigned char *msg, size_t at, size_t *off, const void *data, size_t len ) {
+    put16( msg + at, len );
+    put16( msg + at + 2, len );
+    put32( msg + at + 4, *off );
+    if ( data != NULL ) {
+        memcpy( msg + *off, data, len );
+    } else {
+        memset( msg + *off, 0, len );
+    }
+    *off += len;
+}
+
+/* An OEM Type-3 for user with all-zero responses */
+static void type3( const char *user, char *out ) {
+    unsigned char msg[512];
+    size_t off = 64;
+
+    memset( msg, 0, 64 );
+    memcpy( msg, "NTLMSSP", 8 );
+    put32( msg + 8, 3 );
+    secbuf( msg, 12, &off, NULL, 24 );                  /* LM response */
+    secbuf( msg, 20, &off, NULL, 24 );                  /* NT response */
+    secbuf( msg, 28, &off, "BENCH", 5 );
+    secbuf( msg, 36, &off, user, strlen( user ));
+    secbuf( msg, 44, &off, "LOADGEN", 7 );
+    secbuf( msg, 52, &off, NULL, 0 );                   /* session key */
+    put32( msg + 60, 0x00000202 );                      /* OEM, NTLM */
+    b64_encode( msg, off, out );
+}
+
+static double now_ms( void ) {
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int connect_server( struct worker *w ) {
+    int fd = socket( addr->ai_family, addr->ai_socktype, addr->ai_protocol );
+    int one = 1;
+
+    if ( fd < 0 ) {
+        return -1;
+    }
+    setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ));
+    if ( connect( fd, addr->ai_addr, addr->ai_addrlen ) != 0 ) {
+        close( fd );
+        return -1;
+    }
+    w->connects++;
+    return fd;
+}
+
+/* Send one GET and read the whole response.  Returns the status, or -1
+   if the connection failed.  *challenge gets the token from a
+   WWW-Authenticate header of the scheme in use, *closing is set if the
+   server will close the connection. */
+static int exchange( int fd, const char *auth, char *challenge, size_t size, int *closing ) {
+    static const char *names[] = { "NTLM", "Negotiate", "Basic" };
+    char req[BUFSIZE], buf[BUFSIZE];
+    char *hdr_end, *line, *next;
+    size_t len = 0, want;
+    long clen = 0;
+    int status = -1, n;
+    ssize_t r;
+
+    n = snprintf( req, sizeof( req ),
+                  "GET %s HTTP/1.1\r\nHost: %s\r\nAuthorization: %s\r\n"
+                  "User-Agent: ntlm_load\r\n\r\n", path, host, auth );
+    if ( write( fd, req, n ) != n ) {
+        return -1;
+    }
+
+    challenge[0] = '\0';
+    *closing = 0;
+    for (;;) {
+        if ( len == sizeof( buf ) - 1 ) {
+            return -1;
+        }
+        if (( r = read( fd, buf + len, sizeof( buf ) - 1 - len )) <= 0 ) {
+            return -1;
+        }
+        len += r;
+        buf[len] = '\0';
+        if (( hdr_end = strstr( buf, "\r\n\r\n" )) != NULL ) {
+            break;
+        }
+    }
+    *hdr_end = '\0';
+
+    if ( sscanf( buf, "HTTP/%*d.%*d %d", &status ) != 1 ) {
+        return -1;
+    }
+    for ( line = strstr( buf, "\r\n" ); line != NULL; line = next ) {
+        line += 2;
+        next = strstr( line, "\r\n" );
+        if ( next != NULL ) {
+            *next = '\0';
+        }
+        if ( strncasecmp( line, "Content-Length:", 15 ) == 0 ) {
+            clen = atol( line + 15 );
+        } else if ( strncasecmp( line, "Connection:", 11 ) == 0 && strstr( line, "close" )) {
+            *closing = 1;
+        } else if ( strncasecmp( line, "WWW-Authenticate:", 17 ) == 0 ) {
+            const char *v = line + 17 + strspn( line + 17, " " );
+            size_t nl = strlen( names[scheme] );
+
+            if ( strncasecmp( v, names[scheme], nl ) == 0 && v[nl] == ' ' ) {
+                snprintf( challenge, size, "%s", v + nl + 1 );
+            }
+        }
+    }
+
+    /* discard the body */
+    want = hdr_end + 4 - buf + clen;
+    while ( len < want ) {
+        size_t chunk = want - len < sizeof( buf ) ? want - len : sizeof( buf );
+
+        if (( r = read( fd, buf, chunk )) <= 0 ) {
+            return -1;
+        }
+        len += r;
+    }
+    return status;
+}
+
+/* One complete handshake on *fd, opening it if need be.  Returns 0 when
+   it ends in a 2xx, 1 when the server refused, -1 on a broken connection. */
+static int handshake( struct worker *w, int *fd ) {
+    char auth[4096], challenge[4096], token[2048], user[64];
+    int status, closing;
+
+    if ( *fd < 0 && ( *fd = connect_server( w )) < 0 ) {
+        return -1;
+    }
+    snprintf( user, sizeof( user ), "user%d", users > 1 ? rand_r( &w->seed ) % users : 0 );
+
+    if ( scheme == BASIC ) {
+        char creds[256];
+
+        snprintf( creds, sizeof( creds ), "%s:%s", user, password );
+        b64_encode((unsigned char *) creds, strlen( creds ), token );
+        snprintf( auth, sizeof( auth ), "Basic %s", token );
+        status = exchange( *fd, auth, challenge, sizeof( challenge ), &closing );
+    } else {
+        const char *name = scheme == NTLM ? "NTLM" : "Negotiate";
+
+        type1( token );
+        snprintf( auth, sizeof( auth ), "%s %s", name, token );
+        status = exchange( *fd, auth, challenge, sizeof( challenge ), &closing );
+        if ( status == 401 && challenge[0] != '\0' && !closing ) {
+            type3( user, token );
+            snprintf( auth, sizeof( auth ), "%s %s", name, token );
+            status = exchange( *fd, auth, challenge, sizeof( challenge ), &closing );
+        }
+    }
+
+    if ( status < 0 || closing || !keepalive ) {
+        close( *fd );
+        *fd = -1;
+    }
+    if ( status < 0 ) {
+        return -1;
+    }
+    return status >= 200 && status < 300 ? 0 : 1;
+}
+
+static int next_handshake( void ) {
+    int go;
+
+    if ( stop ) {
+        return 0;
+    }
+    if ( limit == 0 ) {
+        return 1;
+    }
+    pthread_mutex_lock( &issue_mutex );
+    go = issued < limit;
+    issued++;
+    pthread_mutex_unlock( &issue_mutex );
+    return go;
+}
+
+static void *run_worker( void *arg ) {
+    struct worker *w = arg;
+    int fd = -1, rc;
+    double start;
+
+    while ( next_handshake()) {
+        start = now_ms();
+        rc = handshake( w, &fd );
+        if ( rc == 0 ) {
+            if ( w->nlat == w->maxlat ) {
+                w->maxlat = w->maxlat ? w->maxlat * 2 : 4096;
+                w->lat = realloc( w->lat, w->maxlat * sizeof( double ));
+            }
+            w->lat[w->nlat++] = now_ms() - start;
+        } else if ( rc > 0 ) {
+            w->denied++;
+        } else {
+            w->failed++;
+        }
+    }
+    if ( fd >= 0 ) {
+        close( fd );
+    }
+    return NULL;
+}
+
+static int cmp_double( const void *a, const void *b ) {
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile( const double *v, long n, double p ) {
+    long i;
+
+    if ( n == 0 ) {
+        return 0;
+    }
+    i = (long)( p * n );
+    return v[i < n ? i : n - 1];
+}
+
+static void usage( const char *prog ) {
+    fprintf( stderr, "usage: %s [-h host] [-p port] [-u path] [-s ntlm|negotiate|basic]\n"
+             "       [-c connections] [-d seconds | -n handshakes] [-k] [-U users]\n"
+             "       [-P password] [-l label]\n", prog );
+    exit( 1 );
+}
+
+int main( int argc, char **argv ) {
+    static const char *names[] = { "ntlm", "negotiate", "basic" };
+    struct addrinfo hints;
+    struct worker *w;
+    double start, secs, *all;
+    long total = 0, failed = 0, denied = 0, connects = 0, i, j;
+    int opt, rc;
+
+    while (( opt = getopt( argc, argv, "h:p:u:s:c:d:n:kU:P:l:" )) != -1 ) {
+        switch ( opt ) {
+        case 'h': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 'u': path = optarg; break;
+        case 's':
+            for ( scheme = 0; scheme < 3 && strcasecmp( optarg, names[scheme] ) != 0; scheme++ )
+                ;
+            if ( scheme == 3 ) {
+                usage( argv[0] );
+            }
+            break;
+        case 'c': threads = atoi( optarg ); break;
+        case 'd': duration = atoi( optarg ); break;
+        case 'n': limit = atol( optarg ); break;
+        case 'k': keepalive = 1; break;
+        case 'U': users = atoi( optarg ); break;
+        case 'P': password = optarg; break;
+        case 'l': label = optarg; break;
+        default: usage( argv[0] );
+        }
+    }
+    if ( threads < 1 || ( duration < 1 && limit < 1 )) {
+        usage( argv[0] );
+    }
+
+    memset( &hints, 0, sizeof( hints ));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (( rc = getaddrinfo( host, port, &hints, &addr )) != 0 ) {
+        fprintf( stderr, "%s: %s:%s: %s\n", argv[0], host, port, gai_strerror( rc ));
+        return 1;
+    }
+
+    w = calloc( threads, sizeof( *w ));
+    start = now_ms();
+    for ( i = 0; i < threads; i++ ) {
+        w[i].seed = getpid() + i;
+        pthread_create( &w[i].thread, NULL, run_worker, &w[i] );
+    }
+    if ( limit == 0 ) {
+        sleep( duration );
+        stop = 1;
+    }
+    for ( i = 0; i < threads; i++ ) {
+        pthread_join( w[i].thread, NULL );
+        total += w[i].nlat;
+        failed += w[i].failed;
+        denied += w[i].denied;
+        connects += w[i].connects;
+    }
+    secs = ( now_ms() - start ) / 1e3;
+
+    all = malloc(( total ? total : 1 ) * sizeof( double ));
+    for ( i = 0, j = 0; i < threads; i++ ) {
+        memcpy( all + j, w[i].lat, w[i].nlat * sizeof( double ));
+        j += w[i].nlat;
+    }
+    qsort( all, total, sizeof( double ), cmp_double );
+
+    printf( "%s%s%s, %d connections, %s, %.1fs\n", label, label[0] ? " " : "", names[scheme], threads,
+            keepalive ? "keep-alive" : "fresh connections", secs );
+    printf( "  %ld handshakes (%.1f/s), %ld refused, %ld broken, %ld connects\n",
+            total, total / secs, denied, failed, connects );
+    printf( "  latency ms: p50 %.2f  p99 %.2f  p99.9 %.2f  max %.2f\n",
+            percentile( all, total, 0.50 ), percentile( all, total, 0.99 ),
+            percentile( all, total, 0.999 ), total ? all[total - 1] : 0.0 );
+    printf( "RESULT label=%s scheme=%s conns=%d keepalive=%d handshakes=%ld rate=%.1f "
+            "refused=%ld broken=%ld p50=%.3f p99=%.3f p999=%.3f max=%.3f\n",
+            label[0] ? label : "-", names[scheme], threads, keepalive, total, total / secs,
+            denied, failed, percentile( all, total, 0.50 ), percentile( all, total, 0.99 ),
+            percentile( all, total, 0.999 ), total ? all[total - 1] : 0.0 );
+
+    return failed > 0 && total == 0;
+}
@@ -0,0 +1,184 @@
+/* Counts the read() calls it takes to collect helper replies from a
+   pipe, reading a byte at a time (what apr_file_gets() does on the
+   module's unbuffered helper pipes) versus the buffered reader the
+   module now uses.
+
+     cc -O2 -o readline_bench readline_bench.c
+     ./readline_bench [reply-bytes] [legs]
+
+   A child process plays ntlm_auth: for every request byte it gets it
+   answers with one "TT <base64>" or "AF <base64>" line, so each leg is
+   a round trip just like a handshake leg.  The default reply is about
+   the size of a Kerberos ticket wrapped in SPNEGO. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define LINE_MAX_LEN 8192          /* HUGE_STRING_LEN */
+#define READ_BUFSIZE ( 2 * LINE_MAX_LEN )
+
+static unsigned long reads;
+
+static ssize_t counted_read( int fd, void *buf, size_t count ) {
+    reads++;
+    return read( fd, buf, count );
+}
+
+static int bytewise_read_line( int fd, char *buf, size_t size ) {
+    size_t used = 0;
+    ssize_t n;
+
+    while ( used + 1 < size ) {
+        n = counted_read( fd, buf + used, 1 );
+        if ( n == 1 ) {
+            if ( buf[used++] == '\n' ) {
+                break;
+            }
+        } else if ( n == 0 ) {
+            if ( used == 0 ) {
+                return -1;
+            }
+            break;
+        } else if ( errno != EINTR ) {
+            return -1;
+        }
+    }
+    buf[used] = '\0';
+    return 0;
+}
+
+/* The buffering helper_read_line() does, minus the poll() and growing
+   the buffer for overlong lines */
+static char rbuf[READ_BUFSIZE];
+static size_t rbuf_pos, rbuf_len;
+
+static int buffered_read_line( int fd, char *buf, size_t size ) {
+    size_t used;
+    char *line, *nl;
+    ssize_t n;
+
+    for (;;) {
+        line = rbuf + rbuf_pos;
+        used = rbuf_len - rbuf_pos;
+        if (( nl = memchr( line, '\n', used )) != NULL ) {
+            used = nl - line + 1;
+            break;
+        }
+        if ( used + 1 >= size ) {
+            break;
+        }
+        if ( rbuf_pos > 0 ) {
+            memmove( rbuf, line, used );
+            rbuf_pos = 0;
+            rbuf_len = used;
+        }
+        if ( rbuf_len == READ_BUFSIZE ) {
+            break;
+        }
+        n = counted_read( fd, rbuf + rbuf_len, READ_BUFSIZE - rbuf_len );
+        if ( n > 0 ) {
+            rbuf_len += n;
+        } else if ( n == 0 ) {
+            if ( used == 0 ) {
+                return -1;
+            }
+            break;
+        } else if ( errno != EINTR ) {
+            return -1;
+        }
+    }
+
+    if ( used + 1 > size ) {
+        used = size - 1;
+    }
+    memcpy( buf, line, used );
+    buf[used] = '\0';
+    rbuf_pos += used;
+    if ( rbuf_pos == rbuf_len ) {
+        rbuf_pos = rbuf_len = 0;
+    }
+    return 0;
+}
+
+/* Answer each request with a reply_len byte line, newline included */
+static void fake_helper( int in, int out, size_t reply_len ) {
+    static const char b64[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char *reply = malloc( reply_len );
+    size_t i, off;
+    ssize_t n;
+    char req;
+    int leg;
+
+    for ( i = 0; i < reply_len - 1; i++ ) {
+        reply[i] = b64[i % 64];
+    }
+    reply[reply_len - 1] = '\n';
+    for ( leg = 0; read( in, &req, 1 ) == 1; leg++ ) {
+        memcpy( reply, leg % 2 ? "AF " : "TT ", 3 );
+        for ( off = 0; off < reply_len; off += n ) {
+            if (( n = write( out, reply + off, reply_len - off )) < 0 ) {
+                _exit( 1 );
+            }
+        }
+    }
+    _exit( 0 );
+}
+
+static void run( const char *name, int ( *read_line )( int, char *, size_t ),
+                 size_t reply_len, int legs ) {
+    static char line[LINE_MAX_LEN];
+    struct timeval start, end;
+    int to_helper[2], from_helper[2], got;
+    pid_t pid;
+    double secs;
+
+    if ( pipe( to_helper ) != 0 || pipe( from_helper ) != 0 ) {
+        perror( "pipe" );
+        exit( 1 );
+    }
+    if (( pid = fork() ) == 0 ) {
+        close( to_helper[1] );
+        close( from_helper[0] );
+        fake_helper( to_helper[0], from_helper[1], reply_len );
+    }
+    close( to_helper[0] );
+    close( from_helper[1] );
+
+    reads = 0;
+    gettimeofday( &start, NULL );
+    for ( got = 0; got < legs; got++ ) {
+        if ( write( to_helper[1], "\n", 1 ) != 1
+             || read_line( from_helper[0], line, sizeof( line )) != 0 ) {
+            break;
+        }
+    }
+    gettimeofday( &end, NULL );
+    close( to_helper[1] );
+    close( from_helper[0] );
+    waitpid( pid, NULL, 0 );
+
+    secs = ( end.tv_sec - start.tv_sec ) + ( end.tv_usec - start.tv_usec ) / 1e6;
+    printf( "%-9s %8d lines %12lu read()s %10.1f read()s/leg %8.3fs\n",
+            name, got, reads, got ? (double)reads / got : 0.0, secs );
+}
+
+int main( int argc, char **argv ) {
+    size_t reply_len = argc > 1 ? strtoul( argv[1], NULL, 10 ) : 4096;
+    int legs = argc > 2 ? atoi( argv[2] ) : 10000;
+
+    if ( reply_len < 4 || reply_len >= LINE_MAX_LEN || legs < 1 ) {
+        fprintf( stderr, "usage: %s [reply-bytes (4..%d)] [legs]\n",
+                 argv[0], LINE_MAX_LEN - 1 );
+        return 1;
+    }
+    printf( "%d legs of %lu byte replies\n", legs, (unsigned long)reply_len );
+    run( "bytewise", bytewise_read_line, reply_len, legs );
+    run( "buffered", buffered_read_line, reply_len, legs );
+    return 0;
+}
@@ -0,0 +1,186 @@
+#!/bin/sh
+
+# End-to-end benchmark: builds the module, fake_ntlm_auth and ntlm_load,
+# then for each MPM starts a private httpd on 127.0.0.1 whose helpers
+# are fake_ntlm_auth, and drives every scheme over fresh and keep-alive
+# connections.  Nothing leaves the machine and nothing is installed.
+#
+#   bench/run.sh
+#
+# Settings come from the environment:
+#   APXS         apxs to build with (default: apxs2, else apxs)
+#   MPMS         MPMs to try (default: "event worker prefork")
+#   SCHEMES      default: "ntlm negotiate basic"
+#   CONNS        concurrent client connections (default: 32)
+#   DURATION     seconds per run (default: 10)
+#   USERS        distinct user names (default: 100)
+#   PORT         default: 8089
+#   HELPER_OPTS  extra fake_ntlm_auth options, e.g.
+#                "--latency-ms=2 --jitter-ms=5 --fail-rate=0.01"
+#   HELPER_MAX   NTLMAuthHelperMax and friends (default: module default)
+#   EXTRA_CONF   file appended to the generated httpd.conf, for
+#                MaxRequestWorkers, throttle or cache settings and so on
+#   KEEP         set to keep the work directory
+
+BENCH=`cd \`dirname "$0"\` && pwd`
+SRC=`dirname "$BENCH"`
+
+APXS=${APXS:-`command -v apxs2 || command -v apxs`}
+MPMS=${MPMS:-"event worker prefork"}
+SCHEMES=${SCHEMES:-"ntlm negotiate basic"}
+CONNS=${CONNS:-32}
+DURATION=${DURATION:-10}
+USERS=${USERS:-100}
+PORT=${PORT:-8089}
+
+if [ -z "$APXS" ]; then
+    echo "$0: no apxs2 or apxs found; set APXS" >&2
+    exit 1
+fi
+HTTPD="`$APXS -q SBINDIR`/`$APXS -q TARGET`"
+LIBEXEC=`$APXS -q LIBEXECDIR`
+CC=`$APXS -q CC 2>/dev/null || echo cc`
+
+WORK=`mktemp -d ${TMPDIR:-/tmp}/ntlm-bench.XXXXXX` || exit 1
+chmod 755 "$WORK"
+if [ -z "$KEEP" ]; then
+    trap 'rm -rf "$WORK"' 0
+fi
+
+# same optional backends as build.sh
+if pkg-config --exists wbclient 2>/dev/null; then
+    WBCLIENT="-DHAVE_WBCLIENT `pkg-config --cflags --libs wbclient`"
+fi
+if pkg-config --exists krb5-gssapi 2>/dev/null; then
+    GSSAPI="-DHAVE_GSSAPI `pkg-config --cflags --libs krb5-gssapi`"
+fi
+
+cp "$SRC/mod_auth_ntlm_winbind.c" "$SRC/ntlm_helper_proto.c" "$SRC/ntlm_helper_proto.h" "$WORK/"
+(cd "$WORK" && $APXS -DAPACHE2 $WBCLIENT $GSSAPI -c mod_auth_ntlm_winbind.c ntlm_helper_proto.c) >"$WORK/build.log" 2>&1 || {
+    cat "$WORK/build.log" >&2
+    exit 1
+}
+$CC -O2 -pthread -o "$WORK/fake_ntlm_auth" "$BENCH/fake_ntlm_auth.c" || exit 1
+$CC -O2 -pthread -o "$WORK/ntlm_load" "$BENCH/ntlm_load.c" || exit 1
+
+for dir in ntlm negotiate basic; do
+    mkdir -p "$WORK/htdocs/$dir"
+    echo "hello" >"$WORK/htdocs/$dir/index.html"
+done
+
+FAKE="$WORK/fake_ntlm_auth $HELPER_OPTS"
+
+load_module() {
+    if [ -f "$LIBEXEC/mod_$2.so" ]; then
+        echo "LoadModule $1 $LIBEXEC/mod_$2.so"
+    fi
+}
+
+write_conf() {
+    {
+        echo "ServerRoot $WORK"
+        echo "ServerName localhost"
+        echo "Listen 127.0.0.1:$PORT"
+        echo "PidFile $WORK/httpd.pid"
+        echo "ErrorLog $WORK/error_log.$1"
+        echo "LogLevel warn"
+        echo "DocumentRoot $WORK/htdocs"
+        echo "KeepAlive on"
+        echo "MaxKeepAliveRequests 0"
+        load_module mpm_$1_module mpm_$1
+        load_module unixd_module unixd
+        load_module authn_core_module authn_core
+        load_module authz_core_module authz_core
+        load_module authz_user_module authz_user
+        load_module status_module status
+        echo "LoadModule auth_ntlm_winbind_module $WORK/.libs/mod_auth_ntlm_winbind.so"
+        if [ "`id -u`" = 0 ]; then
+            echo "User `id -un nobody`"
+            echo "Group `id -gn nobody`"
+        fi
+        if [ -n "$HELPER_MAX" ]; then
+            echo "NTLMAuthHelperMax $HELPER_MAX"
+            echo "NegotiateAuthHelperMax $HELPER_MAX"
+            echo "PlaintextAuthHelperMax $HELPER_MAX"
+        fi
+        cat <<EOF
+<Location /ntlm>
+  AuthName bench
+  NTLMAuth on
+  NTLMAuthHelper "$FAKE --helper-protocol=squid-2.5-ntlmssp"
+  AuthType NTLM
+  require valid-user
+</Location>
+<Location /negotiate>
+  AuthName bench
+  NegotiateAuth on
+  NegotiateAuthHelper "$FAKE --helper-protocol=gss-spnego"
+  AuthType Negotiate
+  require valid-user
+</Location>
+<Location /basic>
+  AuthName bench
+  NTLMBasicAuth on
+  NTLMBasicRealm bench
+  PlaintextAuthHelper "$FAKE --helper-protocol=squid-2.5-basic"
+  AuthType Basic
+  require valid-user
+</Location>
+<Location /server-status>
+  SetHandler server-status
+</Location>
+EOF
+        if [ -n "$EXTRA_CONF" ]; then
+            cat "$EXTRA_CONF"
+        fi
+    } >"$WORK/httpd.$1.conf"
+}
+
+RESULTS="$WORK/results"
+: >"$RESULTS"
+
+for mpm in $MPMS; do
+    if [ ! -f "$LIBEXEC/mod_mpm_$mpm.so" ]; then
+        echo "skipping $mpm: $LIBEXEC/mod_mpm_$mpm.so not found"
+        continue
+    fi
+    write_conf $mpm
+    rm -f "$WORK/httpd.pid"
+    if ! "$HTTPD" -f "$WORK/httpd.$mpm.conf" -k start; then
+        echo "skipping $mpm: httpd would not start" >&2
+        continue
+    fi
+    tries=0
+    while [ ! -f "$WORK/httpd.pid" ] && [ $tries -lt 50 ]; do
+        sleep 0.1
+        tries=`expr $tries + 1`
+    done
+    # let the children start and prespawn their helpers
+    sleep 1
+
+    for scheme in $SCHEMES; do
+        for ka in "" "-k"; do
+            "$WORK/ntlm_load" -p $PORT -u /$scheme/index.html -s $scheme \
+                -c $CONNS -d $DURATION -U $USERS -l $mpm $ka | tee -a "$RESULTS"
+        done
+    done
+
+    "$HTTPD" -f "$WORK/httpd.$mpm.conf" -k stop
+    while [ -f "$WORK/httpd.pid" ]; do
+        sleep 0.1
+    done
+    if grep -q "error\]" "$WORK/error_log.$mpm"; then
+        echo "errors logged under $mpm:"
+        grep "error\]" "$WORK/error_log.$mpm" | sort | uniq -c | sort -rn | head -5
+    fi
+done
+
+echo
+printf "%-8s %-10s %-10s %10s %9s %9s %9s %8s %8s\n" \
+    mpm scheme conn "hs/s" "p50 ms" "p99 ms" "p99.9 ms" refused broken
+grep '^RESULT' "$RESULTS" | sed 's/^RESULT //' | while read line; do
+    eval "$line"
+    if [ "$keepalive" = 1 ]; then conn=keep-alive; else conn=fresh; fi
+    printf "%-8s %-10s %-10s %10s %9s %9s %9s %8s %8s\n" \
+        $label $scheme $conn $rate $p50 $p99 $p999 $refused $broken
+done
@@ -1,3 +1,13 @@
 #!/bin/sh
 
-apxs2 -DAPACHE2 -c -i mod_auth_ntlm_winbind.c
+# use libwbclient for NTLMAuthBackend wbclient if it is installed
+if pkg-config --exists wbclient 2>/dev/null; then
+    WBCLIENT="-DHAVE_WBCLIENT `pkg-config --cflags --libs wbclient`"
+fi
+
+# and GSSAPI for NegotiateKerberosKeytab
+if pkg-config --exists krb5-gssapi 2>/dev/null; then
+    GSSAPI="-DHAVE_GSSAPI `pkg-config --cflags --libs krb5-gssapi`"
+fi
+
+apxs2 -DAPACHE2 $WBCLIENT $GSSAPI -c -i mod_auth_ntlm_winbind.c ntlm_helper_proto.c
@@ -50,16 +50,90 @@
 #include "util_script.h" /* for ap_call_exec */
 #include <assert.h>
 
+#include "ntlm_helper_proto.h"
+
 #ifdef APACHE2
 #include "http_request.h"
 #include "http_connection.h"
 #include "apr_strings.h"
+#include "apr_lib.h"
 #include "apr_pools.h"
 #include "apr_tables.h"
 #include "apr_base64.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
+#include "apr_hash.h"
+#include "apr_sha1.h"
+#include "apr_general.h"
+#include "apr_md5.h"
+#include "apr_atomic.h"
+#include "ap_mpm.h"
+#include <poll.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <signal.h>
+
+#if AP_MODULE_MAGIC_AT_LEAST(20090130, 0)
+/* httpd 2.4 shared object caches, configurable mutexes, and the
+   runtime directory for shared memory that can't be anonymous; the
+   failure throttle and the status counters need the last two.  Also
+   the authn and authz provider registry, for AuthBasicProvider winbind
+   and Require winbind-group. */
+#define NTLM_HAVE_SOCACHE 1
+#define NTLM_HAVE_SHM 1
+#define NTLM_HAVE_THROTTLE 1
+#define NTLM_HAVE_STATUS 1
+#define NTLM_HAVE_AUTHN 1
+#define NTLM_HAVE_AUTHZ 1
+#include "ap_socache.h"
+#include "ap_provider.h"
+#include "util_mutex.h"
+#include "apr_global_mutex.h"
+#include "apr_shm.h"
+#include "apr_optional_hooks.h"
+#include "mod_status.h"
+#include "mod_auth.h"
+
+/* the helper launcher and broker run as User thanks to the
+   drop_privileges hook, and talk to children over Unix sockets */
+#define NTLM_HAVE_LAUNCHER 1
+#include "mpm_common.h"
+#include "unixd.h"
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+
+#if APR_HAS_THREADS
+/* the broker serves each child connection on a thread of its own */
+#define NTLM_HAVE_BROKER 1
+#endif
+#endif
+
+#if AP_MODULE_MAGIC_AT_LEAST(20120211, 52)
+/* conn_rec->master, httpd 2.4.17: mod_http2 runs each stream on a
+   secondary connection of the client's real one */
+#define NTLM_HAVE_CONN_MASTER 1
+#endif
+
+#ifdef HAVE_WBCLIENT
+#include <wbclient.h>
+#if WBCLIENT_MAJOR_VERSION > 0 || WBCLIENT_MINOR_VERSION >= 12
+/* thread-safe wbcContext API, Samba 4.4 and later */
+#define NTLM_WBC_CTX 1
+#endif
+#define NATIVE_MAX_CONTEXTS 64
+#endif
+
+#ifdef HAVE_GSSAPI
+#include <gssapi/gssapi.h>
+#include <gssapi/gssapi_ext.h>
+#endif
 
 #define RDEBUG( x... ) ap_log_rerror( APLOG_MARK, NTLM_DEBUG, APR_SUCCESS, r, x )
 #define RERROR( c, x... ) ap_log_rerror( APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, c, r, x )
+#define SDEBUG( x... ) ap_log_error( APLOG_MARK, NTLM_DEBUG, APR_SUCCESS, s, x )
+#define SERROR( c, x... ) ap_log_error( APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, c, s, x )
 #define CLEANUP(x) NULL
 #else
 
@@ -72,10 +146,19 @@
 #define apr_table_get(x...) ap_table_get(x)
 #define apr_table_setn(x...) ap_table_setn(x)
 #define apr_pcalloc(x...) ap_pcalloc(x)
+#define apr_palloc(x...) ap_palloc(x)
 #define apr_pool_destroy(x...) ap_destroy_pool(x)
+#define apr_pool_cleanup_register(x...) ap_register_cleanup(x)
+#define apr_pool_cleanup_kill(x...) ap_kill_cleanup(x)
+#define apr_pool_cleanup_null ap_null_cleanup
+#define apr_time_t time_t
+#define apr_time_now() time(NULL)
+#define apr_time_from_sec(x) (x)
 
 #define RDEBUG( x... ) ap_log_rerror( APLOG_MARK, LOG_DEBUG, r, x )
 #define RERROR( c, x... ) ap_log_rerror( APLOG_MARK, NTLM_DEBUG|APLOG_NOERRNO, r, x )
+#define SDEBUG( x... ) ap_log_error( APLOG_MARK, LOG_DEBUG, s, x )
+#define SERROR( c, x... ) ap_log_error( APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, s, x )
 #define CLEANUP(x) x
 #endif
 
@@ -85,6 +168,25 @@
 #define NTLM_AUTH_NAME "NTLM"
 #define NEGOTIATE_AUTH_NAME "Negotiate"
 
+/* Schemes, and the helper type that serves each, for statistics */
+#define SCHEME_NTLM 0
+#define SCHEME_NEGOTIATE 1
+#define SCHEME_BASIC 2
+#define SCHEMES 3
+
+/* Seconds a freshly started helper gets to answer its warm-up request */
+#define HELPER_PROBE_TIMEOUT 10
+
+/* Initial size of a helper's stdout buffer; it grows for long replies.
+   Anything read past the end of one reply line waits there for the
+   next helper_read_line(). */
+#define HELPER_READ_BUFSIZE ( 2 * HUGE_STRING_LEN )
+
+/* Default and largest NTLMAuthMaxTokenSize.  Kerberos tickets for users
+   in many groups carry a large PAC and easily exceed 8K once base64'd. */
+#define DEFAULT_MAX_TOKEN_SIZE 65536
+#define MAX_MAX_TOKEN_SIZE ( 16 * 1024 * 1024 )
+
 /* A structure to hold information about the configuration for the
    mod_auth_ntlm_winbind apache module. */
 
@@ -97,21 +199,205 @@ typedef struct _ntlm_config_struct {
     char *ntlm_auth_helper;
     char *negotiate_ntlm_auth_helper;
     char *ntlm_plaintext_helper;
+    int ntlm_auth_helper_max;
+    int negotiate_ntlm_auth_helper_max;
+    int ntlm_plaintext_helper_max;
+    int ntlm_auth_helper_min;
+    int negotiate_ntlm_auth_helper_min;
+    int ntlm_plaintext_helper_min;
+    int helper_idle_timeout;
+    int helper_spawn_wait;
+    int handshake_timeout;
+    int helper_read_timeout;
+    int helper_write_timeout;
+    int helper_max_requests;
+    int helper_max_age;
+    int max_token_size;
+    int basic_cache_size;
+    int basic_cache_ttl;
+    int basic_cache_negative_ttl;
+    int native_backend;
+    char *negotiate_keytab;
+    int negotiate_strip_realm;
+    char *session_cookie;
+    int session_lifetime;
+    int session_secure;
+    int session_httponly;
+    int group_cache_ttl;
+#ifdef APACHE2
+    /* every command line given to *AuthHelper, the first of them also
+       above; see backend_choose() */
+    apr_array_header_t *helper_backends[SCHEMES];
+    apr_hash_t *plaintext_domains;      /* domain, lower-cased, to its Basic backends */
+    apr_array_header_t *offer_rules;    /* NTLMAuthOffer, in order; see offer_schemes() */
+#endif
+    unsigned int set[4];     /* fields set in this section; see CONF_SET */
 } ntlm_config_rec;
 
+/* A section inherits every field it doesn't set itself.  Each field has
+   a bit, numbered by its offset in ints, so the generic slot setters can
+   mark theirs from cmd->info. */
+#ifdef APACHE2
+#define CONF_OFFSET(field) APR_OFFSETOF(ntlm_config_rec, field)
+#else
+#define CONF_OFFSET(field) XtOffsetOf(ntlm_config_rec, field)
+#endif
+#define CONF_BIT(off) ((off) / sizeof(int))
+#define CONF_SET(crec, off) \
+    ((crec)->set[CONF_BIT(off) / 32] |= 1U << (CONF_BIT(off) % 32))
+#define CONF_ISSET(crec, off) \
+    ((crec)->set[CONF_BIT(off) / 32] & (1U << (CONF_BIT(off) % 32)))
+
+/* fails to compile once the fields outgrow set[] */
+typedef char conf_set_fits[CONF_BIT(CONF_OFFSET(set)) < 32 * 4 ? 1 : -1];
+
+#ifdef APACHE2
+/* Per-server configuration: helpers to start before the child takes
+   any requests, and how many requests a Basic helper takes at once. */
+
+typedef struct _ntlm_prespawn_rec {
+    const char *type;        /* "ntlm", "negotiate" or "plaintext" */
+    char *cmd;               /* NULL for the server's own helper */
+    int count;
+} ntlm_prespawn_rec;
+
+/* NTLMAuthOffer: the schemes to offer, in order, to the clients that
+   match all of its conditions */
+typedef struct _ntlm_offer_rule {
+    int schemes[SCHEMES];
+    int nschemes;
+    apr_array_header_t *subnets;    /* apr_ipsubnet_t *, any of them; NULL for any address */
+    ap_regex_t *user_agent;         /* NULL for any User-Agent */
+} ntlm_offer_rule;
+
+typedef struct _ntlm_server_config_struct {
+    apr_array_header_t *prespawn;
+    int plaintext_concurrency;
+} ntlm_server_config_rec;
+#endif
+
 /* A structure to hold per-connection information about authentications
    that are in progress. */
 
+#define HELPER_EMPTY 0       /* no process in this slot */
+#define HELPER_SPAWNING 1    /* a process is being started */
+#define HELPER_READY 2
+
+/* Helper slots live as long as their pool, so a connection holding a
+   stale pointer to one can always check whether its lease is still
+   good; only the process behind the slot comes and goes. */
+
 struct _ntlm_auth_helper {
     int sent_challenge;
     int helper_pid;
 #ifdef APACHE2
     apr_proc_t *proc;
+    struct _ntlm_helper_proc *hproc;
+    apr_uint32_t dead;       /* exited behind our back */
+    char *rbuf;              /* replies read but not yet consumed */
+    apr_size_t rbuf_pos, rbuf_len, rbuf_size;
 #else
     BUFF *out_to_helper, *in_from_helper;
 #endif
+    apr_pool_t *pool;        /* the running process's pipes, NULL if none */
+    struct _ntlm_helper_pool *owner;
+    int state;
+    int leased;              /* checked out by a connection */
+    int in_io;               /* a request is talking to it right now */
+    unsigned long lease;     /* changes every time it is checked out */
+    apr_time_t leased_at;
+    apr_time_t started;
+    apr_time_t idle_since;   /* last handed back with nothing in flight */
+    unsigned long requests;  /* answered by the current process */
+    int failures;            /* processes in a row that died young */
+    apr_time_t respawn_at;   /* backing off until then */
+#if defined(APACHE2) && APR_HAS_THREADS
+    /* a helper speaking the squid concurrent protocol is shared by
+       several requests at once rather than leased to one */
+    struct _ntlm_channel *channels;
+    int outstanding;         /* channels in use */
+    int reading;             /* a waiter is reading replies for everyone */
+    apr_thread_cond_t *chan_cond;
+#endif
+};
+
+#if defined(APACHE2) && APR_HAS_THREADS
+/* One request in flight on a shared helper, named by its index */
+struct _ntlm_channel {
+    int in_use;
+    int done;
+    int status;              /* OK, or the HTTP error for the request */
+    apr_pool_t *pool;        /* where the reply goes; NULL if the request
+                                gave up waiting */
+    char *reply;
+};
+#endif
+
+#ifdef APACHE2
+/* Keeps a helper process registered with apr_proc_other_child_register
+   until it has been reaped, which may be after its slot moved on. */
+
+struct _ntlm_helper_proc {
+    apr_proc_t proc;
+#ifdef NTLM_HAVE_LAUNCHER
+    int launched;                       /* the launcher's child, reaped there */
+#endif
+    struct _ntlm_auth_helper *helper;   /* NULL once the slot let it go */
+    apr_pool_t *pool;                   /* holds the registration */
+    struct _ntlm_helper_proc *next;     /* unreaped list, or free list */
+};
+#endif
+
+/* A per-child pool of interchangeable helpers running the same command
+   line.  A connection leases a helper for the whole of a handshake, so
+   the legs of one NTLMSSP exchange never interleave with another's. */
+
+struct _ntlm_helper_pool {
+    const char *name;        /* helper type, for log messages */
+    char *cmd;               /* as first configured */
+#ifdef APACHE2
+    char **argv;             /* cmd tokenized; what tells pools apart */
+#endif
+    int max;
+    int count;               /* spawned or being spawned */
+    int max_requests;        /* recycle limits, 0 for none */
+    int max_age;
+    int min;                 /* kept running however idle they are */
+    int idle_timeout;        /* seconds before a surplus helper stops, 0 for never */
+    apr_interval_time_t spawn_wait;     /* queued this long before growing */
+    int concurrency;         /* channels per helper, 0 for one at a time */
+    int scheme;              /* SCHEME_* this pool's helpers serve */
+    unsigned long leases;
+    struct _ntlm_auth_helper *helpers;
     apr_pool_t *pool;
+#if defined(APACHE2) && APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+#endif
+    struct _ntlm_helper_pool *next;     /* every pool in the child */
+};
+
+#ifdef APACHE2
+/* One of several command lines configured for a helper type, as this
+   child sees it.  Backends are chosen by how much work the child has
+   going on each, and one that answers BH or not at all is passed over
+   for new work until it has rested. */
+struct _ntlm_backend {
+    const char *cmd;
+    apr_uint32_t active;     /* handshakes and Basic checks in progress */
+    int failures;            /* in a row */
+    apr_time_t down_until;
+};
+
+/* How one spelling of a helper command line was resolved to a pool, so
+   that it is only tokenized once */
+struct _ntlm_helper_pool_alias {
+    const char *name;
+    int max;                 /* as configured, 0 for ThreadsPerChild */
+    struct _ntlm_helper_pool *hp;
+    struct _ntlm_helper_pool_alias *next;
 };
+#endif
 
 struct _connected_user_authenticated {
     char *user;
@@ -126,366 +412,5515 @@ struct _ntlm_child_stuff {
 };
 
 typedef struct _conn_context {
+#ifdef APACHE2
+    conn_rec *conn;                     /* the client's connection, not an h2 stream's */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;          /* serialises handshakes from sibling streams */
+#endif
+#endif
     struct _connected_user_authenticated *connected_user_authenticated;
-} ntlm_connection_context_t;
-
-typedef struct _ntlm_context {
-    struct _ntlm_auth_helper *ntlm_auth_helper;
-    struct _ntlm_auth_helper *negotiate_ntlm_auth_helper;
-    struct _ntlm_auth_helper *ntlm_plaintext_helper;
-} ntlm_context_t;
-
+    struct _ntlm_auth_helper *helper;   /* leased for a handshake */
+    unsigned long helper_lease;
 #ifdef APACHE2
-module AP_MODULE_DECLARE_DATA auth_ntlm_winbind_module;
-#else
-module MODULE_VAR_EXPORT auth_ntlm_winbind_module;
+    struct _ntlm_backend *backend;      /* where the handshake started */
 #endif
+#ifdef NTLM_HAVE_BROKER
+    apr_uint64_t broker_conn;           /* names the connection to the broker */
+    int broker_handshake;               /* the broker holds a helper for it */
+#endif
+#ifdef HAVE_WBCLIENT
+    int native_ntlm;                    /* handshake run by the module */
+    unsigned char ntlm_challenge[8];
+    apr_uint32_t ntlm_flags;
+#endif
+#ifdef HAVE_GSSAPI
+    gss_ctx_id_t gss_ctx;               /* Kerberos exchange in progress */
+#endif
+#if defined(NTLM_HAVE_AUTHZ) && defined(HAVE_WBCLIENT)
+    const char *group_user;             /* whose group SIDs are cached */
+    apr_hash_t *group_sids;             /* SID strings, for Require winbind-group */
+    apr_time_t group_fetched;
+    apr_pool_t *group_pool;
+#endif
+} ntlm_connection_context_t;
 
-#define NTLM_DEBUG (APLOG_DEBUG | APLOG_NOERRNO)
-
-/* If we have already authenticated then allow all subsequence accesses.
-   This appears to be what IE and IIS do when talking to each other.  I
-   don't think there are any security problems with this, unless someone
-   hijacks the connection, but then MS is susceptible to exactly the same
-   problem. */
-
-/* Extra apache configuration directives defined for this module */
-static const command_rec ntlm_winbind_cmds[] = {
 #ifdef APACHE2
-    /* NTLM authentication commands */
-    AP_INIT_FLAG( "NTLMAuth", ap_set_flag_slot,
-                  (void *) APR_OFFSETOF( ntlm_config_rec, ntlm_on ),
-                  OR_AUTHCFG,
-                  "set to 'on' to activate NTLM authentication" ),
+#define BASIC_CACHE_KEY_LEN APR_SHA1_DIGESTSIZE
+#define BASIC_CACHE_SECRET_LEN 32
+
+struct _basic_cache_entry {
+    unsigned char key[BASIC_CACHE_KEY_LEN];       /* HMAC of user:password */
+    unsigned char user_key[BASIC_CACHE_KEY_LEN];  /* HMAC of user */
+    int ok;
+    apr_time_t stored;
+    struct _basic_cache_entry *prev, *next;       /* LRU list, or free list */
+};
 
-    AP_INIT_FLAG( "NegotiateAuth", ap_set_flag_slot,
-                  (void *) APR_OFFSETOF(ntlm_config_rec, negotiate_on),
-                  OR_AUTHCFG,
-                  "set to 'on' to activate Negotiate authentication" ),
+struct _basic_cache {
+    int max;
+    apr_hash_t *index;
+    struct _basic_cache_entry *entries;
+    struct _basic_cache_entry *head, *tail, *free;
+    unsigned char secret[BASIC_CACHE_SECRET_LEN];
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+};
+#endif
 
-    AP_INIT_FLAG( "NTLMBasicAuthoritative", ap_set_flag_slot,
-                  (void *) APR_OFFSETOF(ntlm_config_rec, authoritative),
-                  OR_AUTHCFG,
-                  "set to 'off' to allow access control to be passed along to lower "
-                  "modules if the UserID is not known to this module" ),
-    /* ntlm_auth location */
-    AP_INIT_TAKE1( "NTLMAuthHelper", ap_set_string_slot,
-                   (void *) APR_OFFSETOF(ntlm_config_rec, ntlm_auth_helper),
-                   OR_AUTHCFG,
-                   "location and arguments to the Samba ntlm_auth utility" ),
+#ifdef NTLM_HAVE_SOCACHE
+#define BASIC_SOCACHE_GEN_LEN 8
+#define BASIC_SOCACHE_MUTEX "ntlm-winbind-basic-cache"
 
-    AP_INIT_TAKE1( "NegotiateAuthHelper", ap_set_string_slot,
-                   (void *) APR_OFFSETOF(ntlm_config_rec, negotiate_ntlm_auth_helper),
-                   OR_AUTHCFG,
-                   "location and arguments to the Samba ntlm_auth utility" ),
+/* the shared cache is server-wide, like mod_authn_socache's */
+static const ap_socache_provider_t *basic_socache_provider = NULL;
+static ap_socache_instance_t *basic_socache_instance = NULL;
+static apr_global_mutex_t *basic_socache_mutex = NULL;
+static unsigned char basic_socache_secret[BASIC_CACHE_SECRET_LEN];
+static int basic_socache_secret_set = 0;
+#endif
 
-    AP_INIT_TAKE1( "PlaintextAuthHelper", ap_set_string_slot,
-                   (void *) APR_OFFSETOF(ntlm_config_rec, ntlm_plaintext_helper ),
-                   OR_AUTHCFG,
-                   "location and arguments to the Samba ntlm_auth utility" ),
+#ifdef NTLM_HAVE_THROTTLE
+#define THROTTLE_MUTEX "ntlm-winbind-throttle"
+#define THROTTLE_PROBE 8     /* slots a key may live in */
+#define THROTTLE_IP 'i'
+#define THROTTLE_USER 'u'
+
+/* Recent authentication failures of one user or client address */
+struct _throttle_entry {
+    unsigned char key[APR_SHA1_DIGESTSIZE];
+    apr_uint32_t failures;
+    apr_time_t last_failure;
+    apr_time_t blocked_until;
+};
 
-    /* Basic Authentication transport for non-IE browsers */
-    AP_INIT_FLAG( "NTLMBasicAuth", ap_set_flag_slot,
-                  (void *) APR_OFFSETOF(ntlm_config_rec, ntlm_basic_on),
-                  OR_AUTHCFG,
-                  "set to 'on' to allow Basic authentication too" ),
+/* Lives in shared memory, so every child sees every failure */
+struct _throttle_table {
+    apr_uint32_t size;
+    apr_uint32_t checks;
+    apr_uint32_t rejected_user;
+    apr_uint32_t rejected_ip;
+    apr_uint32_t failures;
+    apr_uint32_t evictions;
+    struct _throttle_entry entries[1];
+};
 
-    AP_INIT_TAKE1( "NTLMBasicRealm", ap_set_string_slot,
-                   (void *) APR_OFFSETOF(ntlm_config_rec, ntlm_basic_realm),
-                   OR_AUTHCFG, "realm to use for Basic authentication" ),
+static int throttle_size = 0;
+static int throttle_user_threshold = 5;
+static int throttle_ip_threshold = 50;
+static int throttle_max_backoff = 300;
+static struct _throttle_table *throttle_table = NULL;
+static apr_global_mutex_t *throttle_mutex = NULL;
+#endif
 
-#else
-    /* NTLM authentication commands */
+#ifdef NTLM_HAVE_SHM
+/* The scheme each client address last authenticated with, so that it
+   can be offered first next time; see offer_learn().  A slot holds
+   whichever address last hashed to it, and is read and written without
+   a lock: a wrong hint costs no more than the round trip it was meant
+   to save. */
+struct _offer_entry {
+    apr_uint32_t key;        /* hash of the address, never 0 */
+    apr_uint32_t learned;    /* seconds since base << 2 | scheme + 1; 0 if none */
+};
 
-    { "NTLMAuth", ap_set_flag_slot,
-      (void *) XtOffsetOf(ntlm_config_rec, ntlm_on),
-      OR_AUTHCFG, FLAG, "set to 'on' to activate NTLM authentication" },
+struct _offer_table {
+    apr_uint32_t size;
+    apr_time_t base;
+    struct _offer_entry entries[1];
+};
 
-    { "NegotiateAuth", ap_set_flag_slot,
-      (void *) XtOffsetOf(ntlm_config_rec, negotiate_on),
-      OR_AUTHCFG, FLAG, "set to 'on' to activate Negotiate authentication" },
+static int offer_memory_size = 0;
+static int offer_memory_ttl = 86400;
+static struct _offer_table *offer_table = NULL;
+#endif
 
-    { "NTLMBasicAuthoritative", ap_set_flag_slot,
-      (void *) XtOffsetOf(ntlm_config_rec, authoritative),
-      OR_AUTHCFG, FLAG,
-      "set to 'off' to allow access control to be passed along to lower "
-      "modules if the UserID is not known to this module" },
+#ifdef NTLM_HAVE_STATUS
+/* Statistics for mod_status.  Each child counts into its own slot of a
+   shared memory segment with atomic adds, so nothing takes a lock; the
+   status page adds the slots up.  A slot outlives its child and is
+   carried on by the next one, so the totals cover every child since
+   the last restart.  Counters are 32 bits and wrap. */
 
-    /* ntlm_auth location */
+#define STATS_BUCKETS 12
 
-    { "NTLMAuthHelper", ap_set_string_slot,
-      (void *) XtOffsetOf(ntlm_config_rec, ntlm_auth_helper), OR_AUTHCFG,
-      TAKE1, "location and arguments to the Samba ntlm_auth utility"},
+static const char *const stats_scheme_names[SCHEMES] = { "NTLM", "Negotiate", "Basic" };
+static const char *const stats_helper_names[SCHEMES] = { "ntlm", "negotiate", "plaintext" };
 
-    { "NegotiateAuthHelper", ap_set_string_slot,
-      (void *) XtOffsetOf(ntlm_config_rec, negotiate_ntlm_auth_helper), OR_AUTHCFG,
-      TAKE1, "location and arguments to the Samba ntlm_auth utility"},
+/* upper bounds of the latency buckets, in milliseconds; the last
+   bucket takes everything slower */
+static const int stats_bucket_ms[STATS_BUCKETS - 1] = {
+    1, 2, 5, 10, 25, 50, 100, 250, 500, 1000, 5000
+};
 
-    { "PlaintextAuthHelper", ap_set_string_slot,
-      (void *) XtOffsetOf(ntlm_config_rec, ntlm_plaintext_helper), OR_AUTHCFG,
-      TAKE1, "location and arguments to the Samba ntlm_auth utility"},
+struct _ntlm_stats {
+    apr_uint32_t pid;                   /* the child counting here */
+    apr_uint32_t started[SCHEMES];      /* handshakes, or Basic checks */
+    apr_uint32_t completed[SCHEMES];
+    apr_uint32_t failed[SCHEMES];
+    apr_uint32_t helper_requests[SCHEMES];
+    apr_uint32_t helper_latency[SCHEMES][STATS_BUCKETS];
+    apr_uint32_t helper_spawns[SCHEMES];
+    apr_uint32_t helper_deaths[SCHEMES];
+    apr_uint32_t helper_bh[SCHEMES];
+    apr_uint32_t helper_timeouts[SCHEMES];
+    apr_uint32_t helper_idle_stops[SCHEMES];    /* surplus helpers let go */
+    apr_uint32_t basic_cache_hits;
+    apr_uint32_t basic_socache_hits;
+    apr_uint32_t session_hits;
+    apr_uint32_t group_lookups;         /* users' groups asked of winbindd */
+    apr_uint32_t group_socache_hits;
+    /* gauges from here on, which stats_sum() doesn't simply add up */
+    apr_uint32_t helpers_running[SCHEMES];
+    apr_uint32_t helpers_peak[SCHEMES]; /* most at once, kept across children */
+    apr_uint32_t helper_rss_kb[SCHEMES];
+};
 
-    /* Basic Authentcation transport for non-IE browsers */
+/* slots are a cache line apart so children don't fight over them */
+#define STATS_STRIDE APR_ALIGN( sizeof( struct _ntlm_stats ), 64 )
 
-    { "NTLMBasicAuth", ap_set_flag_slot,
-      (void *) XtOffsetOf(ntlm_config_rec, ntlm_basic_on),
-      OR_AUTHCFG, FLAG, "set to 'on' to allow Basic authentication too" },
+static char *stats_base = NULL;
+static int stats_slots = 0;
+static struct _ntlm_stats *stats_mine = NULL;
 
-    { "NTLMBasicRealm", ap_set_string_slot,
-      (void *) XtOffsetOf(ntlm_config_rec, ntlm_basic_realm),
-      OR_AUTHCFG, TAKE1, "realm to use for Basic authentication" },
-#endif
+#define STAT_INC( field ) do { \
+        if ( stats_mine ) apr_atomic_inc32( &stats_mine->field ); \
+    } while ( 0 )
 
-    { NULL }
-};
+#define STATS_SLOT( i ) ((struct _ntlm_stats *)( stats_base + ( i ) * STATS_STRIDE ))
 
-/* both apache1 and apache2 use this to maintain per-child context */
-static ntlm_context_t global_ntlm_context;
+/* Take over a slot that is free or whose child has gone */
+static void stats_child_init( void )
+{
+    apr_uint32_t pid = (apr_uint32_t) getpid(), old;
+    int i;
 
-#ifndef APACHE2
-/* apache 1 doesn't seem to have a connection context I can use */
-static ntlm_connection_context_t global_connection_context;
+    if ( stats_base == NULL ) {
+        return;
+    }
+    for ( i = 0; i < stats_slots; i++ ) {
+        old = apr_atomic_read32( &STATS_SLOT( i )->pid );
+        if (( old == 0 || ( kill( (pid_t) old, 0 ) != 0 && errno == ESRCH ))
+            && apr_atomic_cas32( &STATS_SLOT( i )->pid, pid, old ) == old ) {
+            stats_mine = STATS_SLOT( i );
+            /* the last child's helpers went with it */
+            for ( i = 0; i < SCHEMES; i++ ) {
+                apr_atomic_set32( &stats_mine->helpers_running[i], 0 );
+                apr_atomic_set32( &stats_mine->helper_rss_kb[i], 0 );
+            }
+            return;
+        }
+    }
+    /* the counts are atomic, so sharing a slot only costs speed */
+    stats_mine = STATS_SLOT( pid % stats_slots );
+}
 
-static void cleanup_ntlm_auth_helper(void *ntlm_conn_v)
+/* Count one helper round trip that began at start */
+static void stats_helper_latency( int scheme, apr_time_t start )
 {
-    struct _ntlm_auth_helper *ntlm_conn = ntlm_conn_v;
+    apr_interval_time_t ms;
+    int i;
 
-    ap_log_error( APLOG_MARK, NTLM_DEBUG, NULL, "freeing ntlm_helper" );
+    if ( stats_mine == NULL ) {
+        return;
+    }
+    ms = ( apr_time_now() - start ) / 1000;
+    for ( i = 0; i < STATS_BUCKETS - 1 && ms >= stats_bucket_ms[i]; i++ )
+        ;
+    apr_atomic_inc32( &stats_mine->helper_requests[scheme] );
+    apr_atomic_inc32( &stats_mine->helper_latency[scheme][i] );
+}
 
-    ap_bclose(ntlm_conn->out_to_helper);
-    ap_bclose(ntlm_conn->in_from_helper);
+/* A helper process started (delta 1) or went (-1) */
+static void stats_helper_running( int scheme, int delta )
+{
+    apr_uint32_t n, peak;
 
-    global_ntlm_context.ntlm_auth_helper = NULL;
+    if ( stats_mine == NULL ) {
+        return;
+    }
+    if ( delta < 0 ) {
+        apr_atomic_dec32( &stats_mine->helpers_running[scheme] );
+        return;
+    }
+    n = apr_atomic_inc32( &stats_mine->helpers_running[scheme] ) + 1;
+    while (( peak = apr_atomic_read32( &stats_mine->helpers_peak[scheme] )) < n
+           && apr_atomic_cas32( &stats_mine->helpers_peak[scheme], n, peak ) != peak )
+        ;
 }
+#else
+#define STAT_INC( field )
+#define stats_helper_latency( scheme, start ) ((void)( start ))
+#define stats_helper_running( scheme, delta )
+#endif
 
-static void cleanup_negotiate_ntlm_auth_helper(void *ntlm_conn_v)
-{
-    struct _ntlm_auth_helper *ntlm_conn = ntlm_conn_v;
+#ifdef APACHE2
+#define SESSION_KEY_LEN APR_SHA1_DIGESTSIZE
+#define SESSION_MAX_KEYS 8
+
+/* session cookie keys, newest first; server-wide so every child
+   accepts every other child's cookies */
+static unsigned char session_keys[SESSION_MAX_KEYS][SESSION_KEY_LEN];
+static int session_nkeys = 0;
+static int session_keys_set = 0;
+#endif
 
-    ap_log_error( APLOG_MARK, NTLM_DEBUG, NULL, "freeing negotiate_helper" );
+#ifdef NTLM_HAVE_LAUNCHER
+/* The helper launcher.  Forking an httpd child just to exec a helper
+   copies page tables for everything the child has mapped, which grows
+   with every module loaded.  With NTLMAuthHelperLauncher on, a small
+   process forked from the parent before other modules' post_config
+   hooks run does the forking instead.  A child sends it a helper's
+   argv, already tokenized, along with one end of a fresh socketpair,
+   and gets the helper's pid and pipes back on that; the launcher's
+   socket is a datagram socket shared by all children, so requests
+   never interleave. */
+
+#define LAUNCHER_MAX_REQUEST 16384
+#define LAUNCHER_MAX_ARGS 256
+#define LAUNCHER_TIMEOUT 10
+
+struct _launch_request {
+    apr_uint32_t argc;
+    apr_uint32_t len;        /* of the NUL-terminated arguments that follow */
+};
 
-    ap_bclose(ntlm_conn->out_to_helper);
-    ap_bclose(ntlm_conn->in_from_helper);
+struct _launch_reply {
+    apr_int32_t pid;         /* 0 if the helper couldn't be started */
+    apr_int32_t err;         /* errno from pipe, fork or exec */
+};
 
-    global_ntlm_context.negotiate_ntlm_auth_helper = NULL;
-}
+static int launcher_on = 0;
+static int launcher_fd = -1;            /* the children's end */
+static pid_t launcher_parent = 0;
+static apr_uint32_t launcher_lost = 0;  /* children fork helpers themselves */
+#endif
 
-static void cleanup_ntlm_plaintext_helper( void *ntlm_conn_v ) {
-    struct _ntlm_auth_helper *ntlm_conn = ntlm_conn_v;
+#ifdef NTLM_HAVE_BROKER
+/* The helper broker.  With NTLMAuthBroker on, one process forked from
+   the parent at startup runs every helper, and children hand it their
+   helper requests over a Unix socket instead of running helpers of
+   their own; the number of helpers then no longer grows with the
+   number of children, and they live on when a child is recycled.
+
+   A request is a struct _broker_request, then the helper command line,
+   then the request line as the helper is to read it.  The answer is a
+   struct _broker_reply and the helper's reply line.  Every leg of a
+   handshake carries the client connection's ID, so that it reaches the
+   helper holding the handshake's state.  The broker only runs command
+   lines that appear in the server configuration. */
+
+#define BROKER_LEG 1         /* a line for the helper */
+#define BROKER_END 2         /* the connection went away mid-handshake */
+#define BROKER_MAX_CMD 4096
+#define BROKER_DEFAULT_SOCKET "ntlm-broker.sock"
+
+struct _broker_request {
+    apr_uint64_t conn;       /* client connection, 0 for a one-off */
+    apr_uint32_t cmd_len;
+    apr_uint32_t line_len;   /* newline included */
+    unsigned char op;
+    unsigned char scheme;    /* SCHEME_* */
+    unsigned char first;     /* starts a handshake */
+    unsigned char pad[5];
+};
 
-    ap_log_error( APLOG_MARK, NTLM_DEBUG, NULL, "freeing plaintext_helper" );
+struct _broker_reply {
+    apr_uint32_t status;     /* OK, or the HTTP error for the request */
+    apr_uint32_t len;        /* of the reply line, without its newline */
+};
 
-    ap_bclose( ntlm_conn->out_to_helper );
-    ap_bclose( ntlm_conn->in_from_helper );
+/* In the broker: the helper holding a handshake until its next leg */
+struct _broker_lease {
+    apr_uint64_t conn;
+    struct _ntlm_auth_helper *helper;
+    unsigned long lease;
+    apr_time_t kept_at;
+    struct _broker_lease *next;         /* free list, or sweep list */
+};
 
-    global_ntlm_context.ntlm_plaintext_helper = NULL;
-}
+/* In a child: an idle connection to the broker */
+struct _broker_conn {
+    int fd;
+    struct _broker_conn *next;
+};
 
-/* Dispose of a connected user */
+/* server-wide, as the broker is */
+static int broker_on = 0;
+static const char *broker_socket = NULL;
+static int broker_helpers = 8;
+static apr_hash_t *broker_cmds = NULL;  /* command lines it may run */
+
+static const char *broker_path = NULL;  /* broker_socket, resolved */
+static int broker_listen = -1;
+static pid_t broker_parent = 0;         /* the process that started it */
+static apr_pool_t *broker_pconf = NULL;
+static server_rec *broker_server = NULL;
+
+/* in the broker */
+static ntlm_config_rec *broker_crec = NULL;
+static apr_hash_t *broker_leases = NULL;
+static struct _broker_lease *broker_free_leases = NULL;
+
+/* in the children */
+static struct _broker_conn *broker_idle = NULL;
+static struct _broker_conn *broker_spare = NULL;
+static apr_uint32_t broker_conn_seq = 0;
+#endif
 
-static void cleanup_connected_user_authenticated(void *unused)
-{
-    ap_log_error( APLOG_MARK, NTLM_DEBUG, NULL, "freeing user" );
-    global_connection_context.connected_user_authenticated = NULL;
-}
+typedef struct _ntlm_context {
+    struct _ntlm_helper_pool *helper_pools;
+#ifdef APACHE2
+    apr_hash_t *helper_pool_aliases;    /* command lines as configured */
+#endif
+#ifdef APACHE2
+    apr_hash_t *basic_caches;           /* by NTLMBasicCacheSize */
+#endif
+#ifdef HAVE_WBCLIENT
+    const char *native_domain;          /* names for our NTLM challenges */
+    const char *native_computer;
+    const char *native_dns_domain;
+    char native_separator;
+#ifdef NTLM_WBC_CTX
+    struct wbcContext *native_ctx[NATIVE_MAX_CONTEXTS];
+    int native_nctx;
+#elif APR_HAS_THREADS
+    apr_thread_mutex_t *native_mutex;
+#endif
+#ifdef NTLM_HAVE_AUTHZ
+    apr_hash_t *group_names;            /* Require winbind-group names to SIDs */
+#endif
+#endif
+    apr_pool_t *pool;
+#if defined(APACHE2) && APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+#ifdef APACHE2
+    apr_uint32_t helper_timeouts;       /* helpers killed for not answering */
+    struct _ntlm_helper_proc *procs;    /* helper processes not yet reaped */
+    struct _ntlm_helper_proc *free_procs;
+    int plaintext_concurrency;
+    apr_hash_t *backends[SCHEMES];      /* struct _ntlm_backend by command line */
+    unsigned int backend_rotor;         /* spreads ties between backends */
+#endif
+#if defined(APACHE2) && APR_HAS_THREADS
+    apr_thread_t *maintenance_thread;   /* see helper_maintain() */
+    apr_thread_cond_t *maintenance_cond;
+    int maintenance_stop;
+#endif
+#ifdef HAVE_GSSAPI
+    apr_hash_t *gss_creds;              /* acceptor credentials by keytab */
+#endif
+} ntlm_context_t;
+
+#if defined(APACHE2) && APR_HAS_THREADS
+#define POOL_LOCK(m) apr_thread_mutex_lock(m)
+#define POOL_UNLOCK(m) apr_thread_mutex_unlock(m)
+#else
+#define POOL_LOCK(m)
+#define POOL_UNLOCK(m)
 #endif
 
-/* helper function to pull out the context data */
-static ntlm_connection_context_t *get_connection_context( struct conn_rec *connection ) {
-    ntlm_connection_context_t *retval = NULL;
+/* the connection whose pool holds the auth state */
+#ifdef APACHE2
+#define AUTH_CONN(r, ctxt) ((ctxt)->conn)
+#else
+#define AUTH_CONN(r, ctxt) ((r)->connection)
+#endif
 
 #ifdef APACHE2
-    retval = (ntlm_connection_context_t *)ap_get_module_config( connection->conn_config,
-                                                                &auth_ntlm_winbind_module );
+module AP_MODULE_DECLARE_DATA auth_ntlm_winbind_module;
 #else
-    retval = &global_connection_context;
+module MODULE_VAR_EXPORT auth_ntlm_winbind_module;
 #endif
-    return retval;
-}
 
-/* Authorisation has failed - we set some headers so the client can
-   get the hint and prompt for a password from the user. */
+#define NTLM_DEBUG (APLOG_DEBUG | APLOG_NOERRNO)
 
-static int
-note_auth_failure(request_rec * r, const char *negotiate_auth_line)
+/* If we have already authenticated then allow all subsequence accesses.
+   This appears to be what IE and IIS do when talking to each other.  I
+   don't think there are any security problems with this, unless someone
+   hijacks the connection, but then MS is susceptible to exactly the same
+   problem. */
+
+/* ap_set_flag_slot and ap_set_string_slot, noting that the section
+   set the field so that the merge doesn't inherit it */
+static const char *set_flag_slot(cmd_parms *cmd, void *mconfig, int on)
 {
-    ntlm_config_rec *crec
-        = (ntlm_config_rec *) ap_get_module_config(r->per_dir_config,
-                                                   &auth_ntlm_winbind_module);
-    char *line;
-    ntlm_connection_context_t *ctxt = get_connection_context( r->connection );
+    CONF_SET((ntlm_config_rec *)mconfig, (long)cmd->info);
+    return ap_set_flag_slot(cmd, mconfig, on);
+}
 
-    /* MSIE will simply reply to the first, not strongest, protocol listed */
-    if (crec->negotiate_on) {
-        line = apr_pstrcat(r->pool, NEGOTIATE_AUTH_NAME, " ",
-                           negotiate_auth_line, NULL);
-        apr_table_add(r->err_headers_out,
-                      (PROXYREQ_PROXY == r->proxyreq) ? "Proxy-Authenticate" : "WWW-Authenticate",
-                      line);
-    }
+static const char *set_string_slot(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+    CONF_SET((ntlm_config_rec *)mconfig, (long)cmd->info);
+    return ap_set_string_slot(cmd, mconfig, arg);
+}
 
-    /* Set header for NTLM authentication */
+/* Set a non-negative integer field of the per-directory config */
+static const char *set_int_slot(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+    char *end;
+    long val = strtol(arg, &end, 10);
 
-    if (crec->ntlm_on) {
-        apr_table_add(r->err_headers_out,
-                      (PROXYREQ_PROXY == r->proxyreq) ? "Proxy-Authenticate" : "WWW-Authenticate",
-                      NTLM_AUTH_NAME);
+    if (*arg == '\0' || *end != '\0' || val < 0 || val > 1000000) {
+        return apr_pstrcat(cmd->pool, cmd->cmd->name,
+                           " must be a non-negative integer", NULL);
     }
+    *(int *)((char *)mconfig + (long)cmd->info) = (int)val;
+    CONF_SET((ntlm_config_rec *)mconfig, (long)cmd->info);
+    return NULL;
+}
 
-    /* Set header for basic authentication so client can use this if
-       supported. */
+/* NTLMAuthMaxTokenSize: at least what the module always accepted */
+static const char *set_max_token_size(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+    char *end;
+    long val = strtol(arg, &end, 10);
 
-    if (crec->ntlm_basic_on) {
-        line = apr_pstrcat(r->pool,
-                           "Basic realm=\"", crec->ntlm_basic_realm, "\"",
-                           NULL);
-        apr_table_add(r->err_headers_out,
-                      (PROXYREQ_PROXY == r->proxyreq) ? "Proxy-Authenticate" : "WWW-Authenticate",
-                      line);
+    if (*arg == '\0' || *end != '\0' || val < HUGE_STRING_LEN || val > MAX_MAX_TOKEN_SIZE) {
+        return apr_psprintf(cmd->pool, "%s must be between %d and %d bytes",
+                            cmd->cmd->name, HUGE_STRING_LEN, MAX_MAX_TOKEN_SIZE);
     }
+    ((ntlm_config_rec *)mconfig)->max_token_size = (int)val;
+    CONF_SET((ntlm_config_rec *)mconfig, CONF_OFFSET(max_token_size));
+    return NULL;
+}
 
-    if ( ctxt->connected_user_authenticated &&
-         ctxt->connected_user_authenticated->pool ) {
-        apr_pool_destroy( ctxt->connected_user_authenticated->pool );
-	ctxt->connected_user_authenticated = NULL;
+#ifdef APACHE2
+/* NTLMAuthBackend helper|wbclient */
+static const char *set_backend(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+    ntlm_config_rec *crec = mconfig;
+
+    if (strcasecmp(arg, "helper") == 0) {
+        crec->native_backend = 0;
+    } else if (strcasecmp(arg, "wbclient") == 0) {
+#ifdef HAVE_WBCLIENT
+        crec->native_backend = 1;
+#else
+        return "NTLMAuthBackend wbclient: this module was built without libwbclient";
+#endif
+    } else {
+        return "NTLMAuthBackend must be helper or wbclient";
     }
+    CONF_SET(crec, CONF_OFFSET(native_backend));
 
-    return HTTP_UNAUTHORIZED;
+    return NULL;
 }
 
+static const char *set_keytab(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+#ifdef HAVE_GSSAPI
+    ntlm_config_rec *crec = mconfig;
 
-const char *
-get_auth_header(request_rec * r, ntlm_config_rec * crec, const char *auth_scheme)
+    crec->negotiate_keytab = ap_server_root_relative(cmd->pool, arg);
+    CONF_SET(crec, CONF_OFFSET(negotiate_keytab));
+    return NULL;
+#else
+    return "NegotiateKerberosKeytab: this module was built without GSSAPI";
+#endif
+}
+
+#ifdef APACHE2
+/* NTLMAuthSessionKey key [older-key ...] */
+static const char *set_session_key(cmd_parms *cmd, void *mconfig, const char *arg)
 {
-    const char *auth_line = apr_table_get(r->headers_in,
-                                          (PROXYREQ_PROXY == r->proxyreq) ? "Proxy-Authorization"
-                                          : "Authorization");
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_sha1_ctx_t ctx;
 
-    if (!auth_line) {
-        RERROR( APR_EINIT, "no auth line present" );
-        return NULL;
+    if (err != NULL) {
+        return err;
     }
-    if (strcmp(ap_getword_white(r->pool, &auth_line), auth_scheme)) {
-        RERROR( APR_EINIT, "%s auth name not present", auth_scheme );
-        return NULL;
+    if (session_nkeys >= SESSION_MAX_KEYS) {
+        return "NTLMAuthSessionKey: too many keys";
     }
-    return auth_line;
+
+    apr_sha1_init(&ctx);
+    apr_sha1_update(&ctx, arg, strlen(arg));
+    apr_sha1_final(session_keys[session_nkeys++], &ctx);
+    session_keys_set = 1;
+
+    return NULL;
 }
+#endif
 
-#ifndef APACHE2
-static int helper_child(void *child_stuff, child_info *pinfo)
+/* NTLMAuthHelperPrespawn type count [helper command line] */
+static const char *set_prespawn(cmd_parms *cmd, void *mconfig,
+                                const char *type, const char *count,
+                                const char *helper)
 {
-    struct _ntlm_child_stuff *cld = (struct _ntlm_child_stuff *) child_stuff;
-    request_rec *r = cld->r;
-    char *argv0 = cld->argv0;
-    int child_pid;
+    ntlm_server_config_rec *srec =
+        ap_get_module_config(cmd->server->module_config, &auth_ntlm_winbind_module);
+    ntlm_prespawn_rec *pre;
+    char *end;
+    long n;
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err != NULL) {
+        return err;
+    }
 
-    RAISE_SIGSTOP(CGI_CHILD);
+    n = strtol(count, &end, 10);
+    if (*count == '\0' || *end != '\0' || n < 1 || n > 1024) {
+        return "NTLMAuthHelperPrespawn count must be between 1 and 1024";
+    }
 
-    /* Transmute outselves into the helper
-     */
+    pre = (ntlm_prespawn_rec *)apr_array_push(srec->prespawn);
+    pre->count = (int)n;
+    /* without a command line, the server's own helper of this type */
+    pre->cmd = NULL;
+    if (strcasecmp(type, "ntlm") == 0) {
+        pre->type = "ntlm";
+    } else if (strcasecmp(type, "negotiate") == 0) {
+        pre->type = "negotiate";
+    } else if (strcasecmp(type, "plaintext") == 0) {
+        pre->type = "plaintext";
+    } else {
+        return "NTLMAuthHelperPrespawn type must be ntlm, negotiate or plaintext";
+    }
+    if (helper != NULL) {
+        pre->cmd = apr_pstrdup(cmd->pool, helper);
+#ifdef NTLM_HAVE_BROKER
+        apr_hash_set(broker_cmds, pre->cmd, APR_HASH_KEY_STRING, pre->cmd);
+#endif
+    }
 
-    ap_cleanup_for_exec();
+    return NULL;
+}
 
-    child_pid = ap_call_exec(r, pinfo, argv0, NULL, 1);
+static const char *set_plaintext_concurrency(cmd_parms *cmd, void *mconfig,
+                                             const char *arg)
+{
+    ntlm_server_config_rec *srec =
+        ap_get_module_config(cmd->server->module_config, &auth_ntlm_winbind_module);
+    char *end;
+    long n;
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err != NULL) {
+        return err;
+    }
 
-    /* Uh oh.  Still here.  Where's the kaboom?  There was supposed to be an
-     * EARTH-shattering kaboom!
-     *
-     * Oh, well.  Muddle through as best we can...
-     *
-     * Note that only stderr is available at this point, so don't pass in
-     * a server to aplog_error.
-     */
+    n = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || n < 0 || n > 1024) {
+        return "PlaintextAuthHelperConcurrency must be between 0 and 1024";
+    }
+    srec->plaintext_concurrency = (int)n;
 
-    RERROR( errno, "exec of %s failed", r->filename);
-    exit(0);
-    /* NOT REACHED */
-    return (0);
+    return NULL;
 }
 #endif
 
+#ifdef NTLM_HAVE_LAUNCHER
+static const char *set_launcher(cmd_parms *cmd, void *mconfig, int on)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
 
-static int
-send_auth_reply(request_rec * r, const char *auth_scheme, const char *reply)
+    if (err != NULL) {
+        return err;
+    }
+    launcher_on = on;
+
+    return NULL;
+}
+#endif
+
+#ifdef NTLM_HAVE_BROKER
+static const char *set_broker_socket(cmd_parms *cmd, void *mconfig, const char *arg)
 {
-    RDEBUG( "sending back %s", reply );
-    /* Read negotiate from ntlm_auth */
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
 
-    apr_table_setn(r->err_headers_out,
-                  (PROXYREQ_PROXY == r->proxyreq) ? "Proxy-Authenticate" : "WWW-Authenticate",
-                  apr_psprintf(r->pool, "%s %s", auth_scheme, reply));
+    if (err != NULL) {
+        return err;
+    }
+    broker_socket = arg;
 
-    /* This is to make sure that when receiving later messages
-     * that the r->connection is still alive after sending the
-     * nonce to the client.  This code is written, and the problem
-     * was pointed out by Michael Cai.
-     */
-    if(r->connection->keepalives >= r->server->keep_alive_max)
-    {
-        RDEBUG("Decrement the connection request count to keep it alive");
-        r->connection->keepalives -= 1;
+    return NULL;
+}
+
+static const char *set_broker_helpers(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    char *end;
+    long n;
+
+    if (err != NULL) {
+        return err;
     }
 
-    return HTTP_UNAUTHORIZED;
+    n = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || n < 1 || n > 1024) {
+        return "NTLMAuthBrokerHelpers must be between 1 and 1024";
+    }
+    broker_helpers = (int)n;
+
+    return NULL;
+}
+
+static const char *set_broker(cmd_parms *cmd, void *mconfig, int on)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err != NULL) {
+        return err;
+    }
+    broker_on = on;
+
+    return NULL;
 }
+#endif
 
-/* get the current request's auth helper or fork one */
-static struct _ntlm_auth_helper *get_auth_helper( request_rec *r, struct _ntlm_auth_helper *auth_helper, char *cmd, void (*cleanup)(void *)) {
 #ifdef APACHE2
-    apr_procattr_t *attr;
+#define HELPER_MAX_BACKENDS 16
+
+/* Command lines for NTLMAuthHelper and friends, or for one domain's
+   PlaintextAuthHelperDomain, each quoted if it has spaces.  Those given
+   in the server configuration, rather than in .htaccess, may also be
+   run by the broker. */
+static const char *helper_backend_list(cmd_parms *cmd, const char **args,
+                                       apr_array_header_t **cmds)
+{
+    char *w;
+
+    *cmds = apr_array_make(cmd->pool, 2, sizeof(char *));
+    while (*(w = ap_getword_conf(cmd->pool, args)) != '\0') {
+        if ((*cmds)->nelts == HELPER_MAX_BACKENDS) {
+            return apr_psprintf(cmd->pool, "%s takes at most %d helper command lines",
+                                cmd->cmd->name, HELPER_MAX_BACKENDS);
+        }
+        APR_ARRAY_PUSH(*cmds, char *) = w;
+#ifdef NTLM_HAVE_BROKER
+        if (ap_state_query(AP_SQ_MAIN_STATE) != AP_SQ_MS_RUN_MPM) {
+            apr_hash_set(broker_cmds, w, APR_HASH_KEY_STRING, w);
+        }
+#endif
+    }
+    if ((*cmds)->nelts == 0) {
+        return apr_pstrcat(cmd->pool, cmd->cmd->name,
+                           " takes one or more helper command lines", NULL);
+    }
+    return NULL;
+}
+
+static const char *set_helper_backends(cmd_parms *cmd, void *mconfig, const char *args)
+{
+    ntlm_config_rec *crec = mconfig;
+    long off = (long)cmd->info;
+    int scheme = off == CONF_OFFSET(negotiate_ntlm_auth_helper) ? SCHEME_NEGOTIATE
+        : off == CONF_OFFSET(ntlm_plaintext_helper) ? SCHEME_BASIC : SCHEME_NTLM;
+    apr_array_header_t *cmds;
+    const char *err;
+
+    if ((err = helper_backend_list(cmd, &args, &cmds)) != NULL) {
+        return err;
+    }
+    crec->helper_backends[scheme] = cmds;
+    CONF_SET(crec, CONF_OFFSET(helper_backends[0]) + scheme * sizeof(cmds));
+    return set_string_slot(cmd, mconfig, APR_ARRAY_IDX(cmds, 0, char *));
+}
+
+/* PlaintextAuthHelperDomain DOMAIN cmd...: Basic users who give their
+   name as DOMAIN\user go to these helpers instead */
+static const char *set_plaintext_domain(cmd_parms *cmd, void *mconfig, const char *args)
+{
+    ntlm_config_rec *crec = mconfig;
+    char *domain = ap_getword_conf(cmd->pool, &args);
+    apr_array_header_t *cmds;
+    const char *err;
+
+    if (*domain == '\0') {
+        return "PlaintextAuthHelperDomain takes a domain and one or more helper command lines";
+    }
+    if ((err = helper_backend_list(cmd, &args, &cmds)) != NULL) {
+        return err;
+    }
+    if (!CONF_ISSET(crec, CONF_OFFSET(plaintext_domains))) {
+        crec->plaintext_domains = apr_hash_make(cmd->pool);
+        CONF_SET(crec, CONF_OFFSET(plaintext_domains));
+    }
+    ap_str_tolower(domain);
+    apr_hash_set(crec->plaintext_domains, domain, APR_HASH_KEY_STRING, cmds);
+    return NULL;
+}
+
+static const char *const offer_scheme_names[SCHEMES] = {
+    NTLM_AUTH_NAME, NEGOTIATE_AUTH_NAME, "Basic"
+};
+
+/* NTLMAuthOffer Scheme[,Scheme...] [ip=addr[/mask]]... [ua=regex]: the
+   first rule a client matches decides what it is offered.  A section
+   that has rules of its own doesn't inherit any. */
+static const char *set_offer_rule(cmd_parms *cmd, void *mconfig, const char *args)
+{
+    ntlm_config_rec *crec = mconfig;
+    ntlm_offer_rule *rule = apr_pcalloc(cmd->pool, sizeof(*rule));
+    char *list = ap_getword_conf(cmd->pool, &args);
+    char *w, *last;
+    int i, j;
+
+    for (w = apr_strtok(list, ",", &last); w != NULL; w = apr_strtok(NULL, ",", &last)) {
+        for (i = 0; i < SCHEMES && strcasecmp(w, offer_scheme_names[i]) != 0; i++)
+            ;
+        if (i == SCHEMES) {
+            return apr_pstrcat(cmd->pool, "NTLMAuthOffer: unknown scheme '", w,
+                               "'; use Negotiate, NTLM or Basic", NULL);
+        }
+        for (j = 0; j < rule->nschemes; j++) {
+            if (rule->schemes[j] == i) {
+                return apr_pstrcat(cmd->pool, "NTLMAuthOffer: ", w, " is listed twice", NULL);
+            }
+        }
+        rule->schemes[rule->nschemes++] = i;
+    }
+    if (rule->nschemes == 0) {
+        return "NTLMAuthOffer takes a comma-separated list of schemes, then any conditions";
+    }
+
+    while (*(w = ap_getword_conf(cmd->pool, &args)) != '\0') {
+        if (strncasecmp(w, "ip=", 3) == 0) {
+            apr_ipsubnet_t *subnet;
+            char *mask = strchr(w + 3, '/');
+            apr_status_t rv;
+
+            if (mask != NULL) {
+                *mask++ = '\0';
+            }
+            if ((rv = apr_ipsubnet_create(&subnet, w + 3, mask, cmd->pool)) != APR_SUCCESS) {
+                char buf[120];
+
+                return apr_pstrcat(cmd->pool, "NTLMAuthOffer: bad address '", w + 3, "': ",
+                                   apr_strerror(rv, buf, sizeof(buf)), NULL);
+            }
+            if (rule->subnets == NULL) {
+                rule->subnets = apr_array_make(cmd->pool, 2, sizeof(apr_ipsubnet_t *));
+            }
+            APR_ARRAY_PUSH(rule->subnets, apr_ipsubnet_t *) = subnet;
+        } else if (strncasecmp(w, "ua=", 3) == 0) {
+            rule->user_agent = ap_pregcomp(cmd->pool, w + 3,
+                                           AP_REG_EXTENDED | AP_REG_ICASE | AP_REG_NOSUB);
+            if (rule->user_agent == NULL) {
+                return apr_pstrcat(cmd->pool, "NTLMAuthOffer: bad regular expression '",
+                                   w + 3, "'", NULL);
+            }
+        } else {
+            return apr_pstrcat(cmd->pool, "NTLMAuthOffer: unknown condition '", w,
+                               "'; use ip=addr[/mask] or ua=regex", NULL);
+        }
+    }
+
+    if (!CONF_ISSET(crec, CONF_OFFSET(offer_rules))) {
+        crec->offer_rules = apr_array_make(cmd->pool, 4, sizeof(ntlm_offer_rule *));
+        CONF_SET(crec, CONF_OFFSET(offer_rules));
+    }
+    APR_ARRAY_PUSH(crec->offer_rules, ntlm_offer_rule *) = rule;
+    return NULL;
+}
+#endif
+
+#ifdef NTLM_HAVE_SHM
+/* NTLMAuthFailure* and NTLMAuthOfferMemory*: server-wide, as their
+   tables are */
+static const char *set_shm_int(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    char *end;
+    long n;
+
+    if (err != NULL) {
+        return err;
+    }
+
+    n = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || n < 0 || n > 1000000) {
+        return apr_pstrcat(cmd->pool, cmd->cmd->name,
+                           " must be a non-negative integer", NULL);
+    }
+    *(int *)cmd->info = (int)n;
+
+    return NULL;
+}
+#endif
+
+#ifdef NTLM_HAVE_SOCACHE
+/* NTLMBasicSOCache provider[:args] */
+static const char *set_basic_socache(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    const char *sep, *name;
+
+    if (err != NULL) {
+        return err;
+    }
+
+    sep = ap_strchr_c(arg, ':');
+    if (sep) {
+        name = apr_pstrmemdup(cmd->pool, arg, sep - arg);
+        sep++;
+    } else {
+        name = arg;
+    }
+
+    basic_socache_provider = ap_lookup_provider(AP_SOCACHE_PROVIDER_GROUP, name,
+                                                AP_SOCACHE_PROVIDER_VERSION);
+    if (basic_socache_provider == NULL) {
+        return apr_psprintf(cmd->pool, "Unknown socache provider '%s'. Maybe you "
+                            "need to load the appropriate socache module "
+                            "(mod_socache_%s?)", name, name);
+    }
+
+    err = basic_socache_provider->create(&basic_socache_instance, sep,
+                                         cmd->temp_pool, cmd->pool);
+    if (err != NULL) {
+        return apr_pstrcat(cmd->pool, "NTLMBasicSOCache: ", err, NULL);
+    }
+
+    return NULL;
+}
+
+/* NTLMBasicCacheSecret string: lets several hosts share cache entries */
+static const char *set_basic_cache_secret(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_sha1_ctx_t ctx;
+
+    if (err != NULL) {
+        return err;
+    }
+
+    memset(basic_socache_secret, 0, sizeof(basic_socache_secret));
+    apr_sha1_init(&ctx);
+    apr_sha1_update(&ctx, arg, strlen(arg));
+    apr_sha1_final(basic_socache_secret, &ctx);
+    basic_socache_secret_set = 1;
+
+    return NULL;
+}
+#endif
+
+/* Extra apache configuration directives defined for this module */
+static const command_rec ntlm_winbind_cmds[] = {
+#ifdef APACHE2
+    /* NTLM authentication commands */
+    AP_INIT_FLAG( "NTLMAuth", set_flag_slot,
+                  (void *) APR_OFFSETOF( ntlm_config_rec, ntlm_on ),
+                  OR_AUTHCFG,
+                  "set to 'on' to activate NTLM authentication" ),
+
+    AP_INIT_FLAG( "NegotiateAuth", set_flag_slot,
+                  (void *) APR_OFFSETOF(ntlm_config_rec, negotiate_on),
+                  OR_AUTHCFG,
+                  "set to 'on' to activate Negotiate authentication" ),
+
+    AP_INIT_FLAG( "NTLMBasicAuthoritative", set_flag_slot,
+                  (void *) APR_OFFSETOF(ntlm_config_rec, authoritative),
+                  OR_AUTHCFG,
+                  "set to 'off' to allow access control to be passed along to lower "
+                  "modules if the UserID is not known to this module" ),
+    /* ntlm_auth location */
+    AP_INIT_RAW_ARGS( "NTLMAuthHelper", set_helper_backends,
+                      (void *) APR_OFFSETOF(ntlm_config_rec, ntlm_auth_helper),
+                      OR_AUTHCFG,
+                      "location and arguments to the Samba ntlm_auth utility; "
+                      "several quoted command lines to balance between them" ),
+
+    AP_INIT_RAW_ARGS( "NegotiateAuthHelper", set_helper_backends,
+                      (void *) APR_OFFSETOF(ntlm_config_rec, negotiate_ntlm_auth_helper),
+                      OR_AUTHCFG,
+                      "location and arguments to the Samba ntlm_auth utility; "
+                      "several quoted command lines to balance between them" ),
+
+    AP_INIT_RAW_ARGS( "PlaintextAuthHelper", set_helper_backends,
+                      (void *) APR_OFFSETOF(ntlm_config_rec, ntlm_plaintext_helper ),
+                      OR_AUTHCFG,
+                      "location and arguments to the Samba ntlm_auth utility; "
+                      "several quoted command lines to balance between them" ),
+
+    AP_INIT_RAW_ARGS( "PlaintextAuthHelperDomain", set_plaintext_domain, NULL, OR_AUTHCFG,
+                      "a domain, and the Plaintext helper command lines for Basic "
+                      "users who log in as DOMAIN\\user" ),
+
+    AP_INIT_RAW_ARGS( "NTLMAuthOffer", set_offer_rule, NULL, OR_AUTHCFG,
+                      "schemes to offer, in order, as in Negotiate,NTLM, then "
+                      "ip=addr[/mask] and ua=regex conditions the client must meet" ),
+
+    AP_INIT_TAKE1( "NegotiateKerberosKeytab", set_keytab, NULL, OR_AUTHCFG,
+                   "keytab for checking Kerberos Negotiate tokens in the module; "
+                   "NTLM in SPNEGO still goes to the helper" ),
+
+    AP_INIT_FLAG( "NegotiateKerberosStripRealm", set_flag_slot,
+                  (void *) APR_OFFSETOF(ntlm_config_rec, negotiate_strip_realm),
+                  OR_AUTHCFG,
+                  "set to 'on' to drop @REALM from users authenticated with the keytab" ),
+
+    AP_INIT_TAKE1( "NTLMAuthSessionCookie", set_string_slot,
+                   (void *) APR_OFFSETOF(ntlm_config_rec, session_cookie),
+                   OR_AUTHCFG,
+                   "name of a signed cookie that lets new connections skip the "
+                   "NTLM or Negotiate handshake" ),
+
+    AP_INIT_TAKE1( "NTLMAuthSessionLifetime", set_int_slot,
+                   (void *) APR_OFFSETOF(ntlm_config_rec, session_lifetime),
+                   OR_AUTHCFG,
+                   "seconds a session cookie stays valid" ),
+
+    AP_INIT_FLAG( "NTLMAuthSessionCookieSecure", set_flag_slot,
+                  (void *) APR_OFFSETOF(ntlm_config_rec, session_secure),
+                  OR_AUTHCFG,
+                  "set to 'off' to let the session cookie travel over plain HTTP" ),
+
+    AP_INIT_FLAG( "NTLMAuthSessionCookieHttpOnly", set_flag_slot,
+                  (void *) APR_OFFSETOF(ntlm_config_rec, session_httponly),
+                  OR_AUTHCFG,
+                  "set to 'off' to let scripts read the session cookie" ),
+
+    AP_INIT_ITERATE( "NTLMAuthSessionKey", set_session_key, NULL, RSRC_CONF,
+                     "keys for signing session cookies, newest first; older keys "
+                     "are only used to check cookies" ),
+
+    AP_INIT_TAKE1( "NTLMAuthBackend", set_backend, NULL, OR_AUTHCFG,
+                   "'helper' to run NTLM and Basic through ntlm_auth, or 'wbclient' "
+                   "to talk to winbindd directly" ),
+
+#ifdef NTLM_HAVE_AUTHZ
+    AP_INIT_TAKE1( "NTLMGroupCacheTTL", set_int_slot,
+                   (void *) APR_OFFSETOF(ntlm_config_rec, group_cache_ttl),
+                   OR_AUTHCFG,
+                   "seconds a user's groups are remembered for Require winbind-group" ),
+#endif
+
+    /* helper pool sizes */
+    AP_INIT_TAKE1( "NTLMAuthHelperMax", set_int_slot,
+                   (void *) APR_OFFSETOF(ntlm_config_rec, ntlm_auth_helper_max),
+                   OR_AUTHCFG,
+                   "maximum number of NTLM helpers per child (0 = ThreadsPerChild)" ),
+
+    AP_INIT_TAKE1( "NegotiateAuthHelperMax", set_int_slot,
+                   (void *) APR_OFFSETOF(ntlm_config_rec, negotiate_ntlm_auth_helper_max),
+                   OR_AUTHCFG,
+                   "maximum number of Negotiate helpers per child (0 = ThreadsPerChild)" ),
+
+    AP_INIT_TAKE1( "PlaintextAuthHelperMax", set_int_slot,
+                   (void *) APR_OFFSETOF(ntlm_config_rec, ntlm_plaintext_helper_max),
+                   OR_AUTHCFG,
+                   "maximum number of Plaintext helpers per child (0 = ThreadsPerChild)" ),
+
+    AP_INIT_TAKE1( "NTLMAuthHelperMin", set_int_slot,
+                   (void *) APR_OFFSETOF(ntlm_config_rec, ntlm_auth_helper_min),
+                   OR_AUTHCFG,
+                   "NTLM helpers per child kept running however idle they are" ),
+
+    AP_INIT_TAKE1( "NegotiateAuthHelperMin", set_int_slot,
+                   (void *) APR_OFFSETOF(ntlm_config_rec, negotiate_ntlm_auth_helper_min),
+                   OR_AUTHCFG,
+                   "Negotiate helpers per child kept running however idle they are" ),
+
+    AP_INIT_TAKE1( "PlaintextAuthHelperMin", set_int_slot,
+                   (void *) APR_OFFSETOF(ntlm_config_rec, ntlm_plaintext_helper_min),
+                   OR_AUTHCFG,
+                   "Plaintext helpers per child kept running however idle they are" ),
+
+    AP_INIT_TAKE1( "NTLMAuthHelperIdleTimeout", set_int_slot,
+                   (void *) APR_OFFSETOF(ntlm_config_rec, helper_idle_timeout),
+                   OR_AUTHCFG,
+                   "seconds a helper above the minimum may sit unused before it is stopped (0 = never)" ),
+
+    AP_INIT_TAKE1( "NTLMAuthHelperSpawnWait", set_int_slot,
+                   (void *) APR_OFFSETOF(ntlm_config_rec, helper_spawn_wait),
+                   OR_AUTHCFG,
+                   "milliseconds a request waits for a busy helper before another is started (0 = start one at once)" ),
+
+    AP_INIT_TAKE1( "NTLMAuthHandshakeTimeout", set_int_slot,
+                   (void *) APR_OFFSETOF(ntlm_config_rec, handshake_timeout),
+                   OR_AUTHCFG,
+                   "seconds a connection may hold a helper between handshake legs" ),
+
+    AP_INIT_TAKE1( "NTLMAuthHelperReadTimeout", set_int_slot,
+                   (void *) APR_OFFSETOF(ntlm_config_rec, helper_read_timeout),
+                   OR_AUTHCFG,
+                   "seconds to wait for a helper's reply before killing it (0 = forever)" ),
+
+    AP_INIT_TAKE1( "NTLMAuthHelperWriteTimeout", set_int_slot,
+                   (void *) APR_OFFSETOF(ntlm_config_rec, helper_write_timeout),
+                   OR_AUTHCFG,
+                   "seconds to wait for a helper to accept a request before killing it (0 = forever)" ),
+
+    AP_INIT_TAKE1( "NTLMAuthHelperMaxRequests", set_int_slot,
+                   (void *) APR_OFFSETOF(ntlm_config_rec, helper_max_requests),
+                   OR_AUTHCFG,
+                   "requests a helper answers before it is replaced (0 = no limit)" ),
+
+    AP_INIT_TAKE1( "NTLMAuthHelperMaxAge", set_int_slot,
+                   (void *) APR_OFFSETOF(ntlm_config_rec, helper_max_age),
+                   OR_AUTHCFG,
+                   "seconds a helper runs before it is replaced (0 = no limit)" ),
+
+    AP_INIT_TAKE1( "NTLMAuthMaxTokenSize", set_max_token_size, NULL, OR_AUTHCFG,
+                   "largest authentication token, or helper reply, in bytes" ),
+
+    AP_INIT_TAKE23( "NTLMAuthHelperPrespawn", set_prespawn, NULL, RSRC_CONF,
+                    "helper type (ntlm, negotiate or plaintext), number of helpers "
+                    "to start in each child, and optionally the helper command line" ),
+
+    AP_INIT_TAKE1( "PlaintextAuthHelperConcurrency", set_plaintext_concurrency, NULL, RSRC_CONF,
+                   "requests each Plaintext helper takes at once, using squid "
+                   "channel IDs (0 = one at a time, without channel IDs)" ),
+
+    /* Basic Authentication transport for non-IE browsers */
+    AP_INIT_FLAG( "NTLMBasicAuth", set_flag_slot,
+                  (void *) APR_OFFSETOF(ntlm_config_rec, ntlm_basic_on),
+                  OR_AUTHCFG,
+                  "set to 'on' to allow Basic authentication too" ),
+
+    AP_INIT_TAKE1( "NTLMBasicRealm", set_string_slot,
+                   (void *) APR_OFFSETOF(ntlm_config_rec, ntlm_basic_realm),
+                   OR_AUTHCFG, "realm to use for Basic authentication" ),
+
+    /* Basic credential cache */
+    AP_INIT_TAKE1( "NTLMBasicCacheSize", set_int_slot,
+                   (void *) APR_OFFSETOF(ntlm_config_rec, basic_cache_size),
+                   OR_AUTHCFG,
+                   "number of Basic credential checks each child remembers (0 = off)" ),
+
+    AP_INIT_TAKE1( "NTLMBasicCacheTTL", set_int_slot,
+                   (void *) APR_OFFSETOF(ntlm_config_rec, basic_cache_ttl),
+                   OR_AUTHCFG,
+                   "seconds a successful Basic credential check is remembered" ),
+
+    AP_INIT_TAKE1( "NTLMBasicCacheNegativeTTL", set_int_slot,
+                   (void *) APR_OFFSETOF(ntlm_config_rec, basic_cache_negative_ttl),
+                   OR_AUTHCFG,
+                   "seconds a failed Basic credential check is remembered" ),
+
+#ifdef NTLM_HAVE_LAUNCHER
+    AP_INIT_FLAG( "NTLMAuthHelperLauncher", set_launcher, NULL, RSRC_CONF,
+                  "set to 'on' to have helpers forked by a small launcher process "
+                  "rather than by the children" ),
+#endif
+
+#ifdef NTLM_HAVE_BROKER
+    /* helper broker */
+    AP_INIT_FLAG( "NTLMAuthBroker", set_broker, NULL, RSRC_CONF,
+                  "set to 'on' to run helpers in one broker process shared by "
+                  "all children" ),
+
+    AP_INIT_TAKE1( "NTLMAuthBrokerSocket", set_broker_socket, NULL, RSRC_CONF,
+                   "path of the broker's Unix socket, relative to DefaultRuntimeDir" ),
+
+    AP_INIT_TAKE1( "NTLMAuthBrokerHelpers", set_broker_helpers, NULL, RSRC_CONF,
+                   "most helpers the broker runs for each helper command line" ),
+#endif
+
+#ifdef NTLM_HAVE_THROTTLE
+    /* failure throttle */
+    AP_INIT_TAKE1( "NTLMAuthFailureTableSize", set_shm_int, &throttle_size, RSRC_CONF,
+                   "users and client addresses whose failures are tracked across "
+                   "children (0 = no throttling)" ),
+
+    AP_INIT_TAKE1( "NTLMAuthFailureUserThreshold", set_shm_int, &throttle_user_threshold,
+                   RSRC_CONF, "failures in a row after which a user is refused "
+                   "without asking winbind (0 = never)" ),
+
+    AP_INIT_TAKE1( "NTLMAuthFailureIPThreshold", set_shm_int, &throttle_ip_threshold,
+                   RSRC_CONF, "failures in a row after which a client address is refused "
+                   "without asking winbind (0 = never)" ),
+
+    AP_INIT_TAKE1( "NTLMAuthFailureMaxBackoff", set_shm_int, &throttle_max_backoff,
+                   RSRC_CONF, "longest a throttled user or address is refused, in seconds" ),
+#endif
+
+#ifdef NTLM_HAVE_SHM
+    /* learned scheme offer */
+    AP_INIT_TAKE1( "NTLMAuthOfferMemory", set_shm_int, &offer_memory_size, RSRC_CONF,
+                   "client addresses whose last successful scheme is remembered "
+                   "across children and offered first (0 = none)" ),
+
+    AP_INIT_TAKE1( "NTLMAuthOfferMemoryTTL", set_shm_int, &offer_memory_ttl, RSRC_CONF,
+                   "seconds a client's last successful scheme is remembered" ),
+#endif
+
+#ifdef NTLM_HAVE_SOCACHE
+    AP_INIT_TAKE1( "NTLMBasicSOCache", set_basic_socache, NULL, RSRC_CONF,
+                   "socache provider[:args] in which to share Basic credential checks" ),
+
+    AP_INIT_TAKE1( "NTLMBasicCacheSecret", set_basic_cache_secret, NULL, RSRC_CONF,
+                   "key for the shared Basic credential cache; set it to the same "
+                   "value on every host sharing a memcache" ),
+#endif
+
+#else
+    /* NTLM authentication commands */
+
+    { "NTLMAuth", set_flag_slot,
+      (void *) XtOffsetOf(ntlm_config_rec, ntlm_on),
+      OR_AUTHCFG, FLAG, "set to 'on' to activate NTLM authentication" },
+
+    { "NegotiateAuth", set_flag_slot,
+      (void *) XtOffsetOf(ntlm_config_rec, negotiate_on),
+      OR_AUTHCFG, FLAG, "set to 'on' to activate Negotiate authentication" },
+
+    { "NTLMBasicAuthoritative", set_flag_slot,
+      (void *) XtOffsetOf(ntlm_config_rec, authoritative),
+      OR_AUTHCFG, FLAG,
+      "set to 'off' to allow access control to be passed along to lower "
+      "modules if the UserID is not known to this module" },
+
+    /* ntlm_auth location */
+
+    { "NTLMAuthHelper", set_string_slot,
+      (void *) XtOffsetOf(ntlm_config_rec, ntlm_auth_helper), OR_AUTHCFG,
+      TAKE1, "location and arguments to the Samba ntlm_auth utility"},
+
+    { "NegotiateAuthHelper", set_string_slot,
+      (void *) XtOffsetOf(ntlm_config_rec, negotiate_ntlm_auth_helper), OR_AUTHCFG,
+      TAKE1, "location and arguments to the Samba ntlm_auth utility"},
+
+    { "PlaintextAuthHelper", set_string_slot,
+      (void *) XtOffsetOf(ntlm_config_rec, ntlm_plaintext_helper), OR_AUTHCFG,
+      TAKE1, "location and arguments to the Samba ntlm_auth utility"},
+
+    /* helper pool sizes */
+
+    { "NTLMAuthHelperMax", set_int_slot,
+      (void *) XtOffsetOf(ntlm_config_rec, ntlm_auth_helper_max), OR_AUTHCFG,
+      TAKE1, "maximum number of NTLM helpers per child"},
+
+    { "NegotiateAuthHelperMax", set_int_slot,
+      (void *) XtOffsetOf(ntlm_config_rec, negotiate_ntlm_auth_helper_max), OR_AUTHCFG,
+      TAKE1, "maximum number of Negotiate helpers per child"},
+
+    { "PlaintextAuthHelperMax", set_int_slot,
+      (void *) XtOffsetOf(ntlm_config_rec, ntlm_plaintext_helper_max), OR_AUTHCFG,
+      TAKE1, "maximum number of Plaintext helpers per child"},
+
+    { "NTLMAuthHandshakeTimeout", set_int_slot,
+      (void *) XtOffsetOf(ntlm_config_rec, handshake_timeout), OR_AUTHCFG,
+      TAKE1, "seconds a connection may hold a helper between handshake legs"},
+
+    { "NTLMAuthHelperMaxRequests", set_int_slot,
+      (void *) XtOffsetOf(ntlm_config_rec, helper_max_requests), OR_AUTHCFG,
+      TAKE1, "requests a helper answers before it is replaced"},
+
+    { "NTLMAuthHelperMaxAge", set_int_slot,
+      (void *) XtOffsetOf(ntlm_config_rec, helper_max_age), OR_AUTHCFG,
+      TAKE1, "seconds a helper runs before it is replaced"},
+
+    { "NTLMAuthMaxTokenSize", set_max_token_size, NULL, OR_AUTHCFG,
+      TAKE1, "largest authentication token, or helper reply, in bytes"},
+
+    /* Basic Authentcation transport for non-IE browsers */
+
+    { "NTLMBasicAuth", set_flag_slot,
+      (void *) XtOffsetOf(ntlm_config_rec, ntlm_basic_on),
+      OR_AUTHCFG, FLAG, "set to 'on' to allow Basic authentication too" },
+
+    { "NTLMBasicRealm", set_string_slot,
+      (void *) XtOffsetOf(ntlm_config_rec, ntlm_basic_realm),
+      OR_AUTHCFG, TAKE1, "realm to use for Basic authentication" },
+#endif
+
+    { NULL }
+};
+
+/* both apache1 and apache2 use this to maintain per-child context */
+static ntlm_context_t global_ntlm_context;
+
+#ifndef APACHE2
+/* apache 1 doesn't seem to have a connection context I can use */
+static ntlm_connection_context_t global_connection_context;
+
+static void cleanup_ntlm_auth_helper(void *ntlm_conn_v)
+{
+    struct _ntlm_auth_helper *ntlm_conn = ntlm_conn_v;
+
+    ap_log_error( APLOG_MARK, NTLM_DEBUG, NULL, "freeing %s helper",
+                  ntlm_conn->owner ? ntlm_conn->owner->name : "ntlm" );
+
+    ap_bclose(ntlm_conn->out_to_helper);
+    ap_bclose(ntlm_conn->in_from_helper);
+}
+
+/* Dispose of a connected user */
+
+static void cleanup_connected_user_authenticated(void *unused)
+{
+    ap_log_error( APLOG_MARK, NTLM_DEBUG, NULL, "freeing user" );
+    global_connection_context.connected_user_authenticated = NULL;
+}
+#endif
+
+/* helper function to pull out the context data */
+static ntlm_connection_context_t *get_connection_context( struct conn_rec *connection ) {
+    ntlm_connection_context_t *retval = NULL;
+
+#ifdef APACHE2
+#ifdef NTLM_HAVE_CONN_MASTER
+    /* every stream of an HTTP/2 session shares the session's state */
+    while ( connection->master != NULL ) {
+        connection = connection->master;
+    }
+#endif
+    retval = (ntlm_connection_context_t *)ap_get_module_config( connection->conn_config,
+                                                                &auth_ntlm_winbind_module );
+#else
+    retval = &global_connection_context;
+#endif
+    return retval;
+}
+
+#ifdef APACHE2
+static apr_sockaddr_t *offer_client_addr( request_rec *r ) {
+#if AP_MODULE_MAGIC_AT_LEAST(20111130, 0)
+    return r->useragent_addr;
+#else
+    return r->connection->remote_addr;
+#endif
+}
+#endif
+
+#ifdef NTLM_HAVE_SHM
+static apr_uint32_t offer_key( const apr_sockaddr_t *addr ) {
+    apr_ssize_t len = addr->ipaddr_len;
+    apr_uint32_t key = apr_hashfunc_default( (const char *) addr->ipaddr_ptr, &len );
+
+    return key != 0 ? key : 1;
+}
+
+static apr_uint32_t offer_now( void ) {
+    return (apr_uint32_t) apr_time_sec( apr_time_now() - offer_table->base );
+}
+
+/* The scheme the client last authenticated with, or -1 if it isn't
+   remembered */
+static int offer_recall( request_rec *r ) {
+    apr_sockaddr_t *addr = offer_client_addr( r );
+    struct _offer_entry *e;
+    apr_uint32_t key, learned;
+
+    if ( offer_table == NULL || addr == NULL ) {
+        return -1;
+    }
+    key = offer_key( addr );
+    e = &offer_table->entries[key % offer_table->size];
+
+    if ( apr_atomic_read32( &e->key ) != key ) {
+        return -1;
+    }
+    learned = apr_atomic_read32( &e->learned );
+    if ( learned == 0 || apr_atomic_read32( &e->key ) != key
+         || offer_now() - ( learned >> 2 ) > (apr_uint32_t) offer_memory_ttl ) {
+        return -1;
+    }
+    return (int)( learned & 3 ) - 1;
+}
+
+/* Remember that the client got in with scheme.  The slot is only
+   written when that is news, so a busy client doesn't keep every
+   child's cache line bouncing. */
+static void offer_learn( request_rec *r, int scheme ) {
+    apr_sockaddr_t *addr = offer_client_addr( r );
+    struct _offer_entry *e;
+    apr_uint32_t key, now, learned;
+
+    if ( offer_table == NULL || addr == NULL ) {
+        return;
+    }
+    key = offer_key( addr );
+    e = &offer_table->entries[key % offer_table->size];
+    now = offer_now();
+
+    learned = apr_atomic_read32( &e->learned );
+    if ( apr_atomic_read32( &e->key ) == key && ( learned & 3 ) == (apr_uint32_t) scheme + 1
+         && now - ( learned >> 2 ) < (apr_uint32_t) offer_memory_ttl / 2 ) {
+        return;
+    }
+    /* cleared first, so a reader never pairs the new key with the old
+       scheme */
+    apr_atomic_set32( &e->learned, 0 );
+    apr_atomic_set32( &e->key, key );
+    apr_atomic_set32( &e->learned, now << 2 | ( scheme + 1 ));
+}
+#else
+#define offer_recall( r ) -1
+#define offer_learn( r, scheme )
+#endif
+
+#ifdef APACHE2
+/* The first NTLMAuthOffer rule the client matches, if any */
+static ntlm_offer_rule *offer_rule_match( request_rec *r, ntlm_config_rec *crec ) {
+    apr_sockaddr_t *addr = offer_client_addr( r );
+    const char *user_agent = apr_table_get( r->headers_in, "User-Agent" );
+    int i, j;
+
+    for ( i = 0; crec->offer_rules != NULL && i < crec->offer_rules->nelts; i++ ) {
+        ntlm_offer_rule *rule = APR_ARRAY_IDX( crec->offer_rules, i, ntlm_offer_rule * );
+
+        if ( rule->user_agent != NULL
+             && ( user_agent == NULL
+                  || ap_regexec( rule->user_agent, user_agent, 0, NULL, 0 ) != 0 )) {
+            continue;
+        }
+        if ( rule->subnets != NULL ) {
+            for ( j = 0; j < rule->subnets->nelts; j++ ) {
+                if ( addr != NULL
+                     && apr_ipsubnet_test( APR_ARRAY_IDX( rule->subnets, j, apr_ipsubnet_t * ),
+                                           addr )) {
+                    break;
+                }
+            }
+            if ( j == rule->subnets->nelts ) {
+                continue;
+            }
+        }
+        return rule;
+    }
+    return NULL;
+}
+#endif
+
+static int offer_enabled( ntlm_config_rec *crec, int scheme ) {
+    switch ( scheme ) {
+    case SCHEME_NEGOTIATE: return crec->negotiate_on;
+    case SCHEME_NTLM: return crec->ntlm_on;
+    default: return crec->ntlm_basic_on;
+    }
+}
+
+/* The schemes to offer the client, most wanted first, in schemes[]:
+   those of the NTLMAuthOffer rule it matches, or else Negotiate, NTLM
+   and Basic, less any not enabled here.  The scheme it last got in
+   with, if it is among them, goes to the front. */
+static int offer_schemes( request_rec *r, ntlm_config_rec *crec, int *schemes ) {
+    static const int all[SCHEMES] = { SCHEME_NEGOTIATE, SCHEME_NTLM, SCHEME_BASIC };
+    const int *order = all;
+    int norder = SCHEMES, n = 0, i, learned;
+#ifdef APACHE2
+    ntlm_offer_rule *rule = offer_rule_match( r, crec );
+
+    if ( rule != NULL ) {
+        order = rule->schemes;
+        norder = rule->nschemes;
+    }
+#endif
+
+    for ( i = 0; i < norder; i++ ) {
+        if ( offer_enabled( crec, order[i] )) {
+            schemes[n++] = order[i];
+        }
+    }
+    if ( n == 0 && order != all ) {
+        /* the rule names none of the schemes enabled here */
+        for ( i = 0; i < SCHEMES; i++ ) {
+            if ( offer_enabled( crec, all[i] )) {
+                schemes[n++] = all[i];
+            }
+        }
+    }
+
+    learned = offer_recall( r );
+    for ( i = 1; i < n; i++ ) {
+        if ( schemes[i] == learned ) {
+            memmove( schemes + 1, schemes, i * sizeof( *schemes ));
+            schemes[0] = learned;
+            break;
+        }
+    }
+    return n;
+}
+
+/* Authorisation has failed - we set some headers so the client can
+   get the hint and prompt for a password from the user. */
+
+static int
+note_auth_failure(request_rec * r, const char *negotiate_auth_line)
+{
+    ntlm_config_rec *crec
+        = (ntlm_config_rec *) ap_get_module_config(r->per_dir_config,
+                                                   &auth_ntlm_winbind_module);
+    char *line;
+    ntlm_connection_context_t *ctxt = get_connection_context( r->connection );
+    const char *header = (PROXYREQ_PROXY == r->proxyreq) ? "Proxy-Authenticate" : "WWW-Authenticate";
+    int schemes[SCHEMES], n, i;
+
+    /* MSIE will simply reply to the first, not strongest, protocol
+       listed, so the order is the client's; see offer_schemes() */
+    n = offer_schemes(r, crec, schemes);
+
+    /* a Negotiate handshake under way goes on, whatever the rules */
+    if (negotiate_auth_line != NULL && crec->negotiate_on
+        && (n == 0 || schemes[0] != SCHEME_NEGOTIATE)) {
+        for (i = 0; i < n && schemes[i] != SCHEME_NEGOTIATE; i++)
+            ;
+        if (i == n) {
+            n++;
+        }
+        memmove(schemes + 1, schemes, i * sizeof(*schemes));
+        schemes[0] = SCHEME_NEGOTIATE;
+    }
+
+    for (i = 0; i < n; i++) {
+        switch (schemes[i]) {
+        case SCHEME_NEGOTIATE:
+            line = apr_pstrcat(r->pool, NEGOTIATE_AUTH_NAME, " ",
+                               negotiate_auth_line, NULL);
+            apr_table_add(r->err_headers_out, header, line);
+            break;
+
+        case SCHEME_NTLM:
+            apr_table_add(r->err_headers_out, header, NTLM_AUTH_NAME);
+            break;
+
+        default:
+            /* so the client can use Basic if it supports nothing better */
+            line = apr_pstrcat(r->pool,
+                               "Basic realm=\"", crec->ntlm_basic_realm, "\"",
+                               NULL);
+            apr_table_add(r->err_headers_out, header, line);
+            break;
+        }
+    }
+
+    if ( ctxt->connected_user_authenticated &&
+         ctxt->connected_user_authenticated->pool ) {
+        apr_pool_destroy( ctxt->connected_user_authenticated->pool );
+	ctxt->connected_user_authenticated = NULL;
+    }
+
+    return HTTP_UNAUTHORIZED;
+}
+
+
+const char *
+get_auth_header(request_rec * r, ntlm_config_rec * crec, const char *auth_scheme)
+{
+    const char *auth_line = apr_table_get(r->headers_in,
+                                          (PROXYREQ_PROXY == r->proxyreq) ? "Proxy-Authorization"
+                                          : "Authorization");
+
+    if (!auth_line) {
+        RERROR( APR_EINIT, "no auth line present" );
+        return NULL;
+    }
+    if (strcmp(ap_getword_white(r->pool, &auth_line), auth_scheme)) {
+        RERROR( APR_EINIT, "%s auth name not present", auth_scheme );
+        return NULL;
+    }
+    if (strlen(auth_line) > (size_t) crec->max_token_size) {
+        RERROR( APR_EINIT, "%s token of %lu bytes is larger than NTLMAuthMaxTokenSize (%d)",
+                auth_scheme, (unsigned long) strlen(auth_line), crec->max_token_size );
+        return NULL;
+    }
+    return auth_line;
+}
+
+#ifndef APACHE2
+static int helper_child(void *child_stuff, child_info *pinfo)
+{
+    struct _ntlm_child_stuff *cld = (struct _ntlm_child_stuff *) child_stuff;
+    request_rec *r = cld->r;
+    char *argv0 = cld->argv0;
+    int child_pid;
+
+    RAISE_SIGSTOP(CGI_CHILD);
+
+    /* Transmute outselves into the helper
+     */
+
+    ap_cleanup_for_exec();
+
+    child_pid = ap_call_exec(r, pinfo, argv0, NULL, 1);
+
+    /* Uh oh.  Still here.  Where's the kaboom?  There was supposed to be an
+     * EARTH-shattering kaboom!
+     *
+     * Oh, well.  Muddle through as best we can...
+     *
+     * Note that only stderr is available at this point, so don't pass in
+     * a server to aplog_error.
+     */
+
+    RERROR( errno, "exec of %s failed", r->filename);
+    exit(0);
+    /* NOT REACHED */
+    return (0);
+}
+#endif
+
+
+static int
+send_auth_reply(request_rec * r, const char *auth_scheme, const char *reply)
+{
+    RDEBUG( "sending back %s", reply );
+    /* Read negotiate from ntlm_auth */
+
+    apr_table_setn(r->err_headers_out,
+                  (PROXYREQ_PROXY == r->proxyreq) ? "Proxy-Authenticate" : "WWW-Authenticate",
+                  apr_psprintf(r->pool, "%s %s", auth_scheme, reply));
+
+    /* This is to make sure that when receiving later messages
+     * that the r->connection is still alive after sending the
+     * nonce to the client.  This code is written, and the problem
+     * was pointed out by Michael Cai.
+     */
+    if(r->connection->keepalives >= r->server->keep_alive_max)
+    {
+        RDEBUG("Decrement the connection request count to keep it alive");
+        r->connection->keepalives -= 1;
+    }
+
+    return HTTP_UNAUTHORIZED;
+}
+
+#define HELPER_BACKOFF_MAX 60
+
+#ifdef APACHE2
+/* Called by apr_proc_other_child_alert() once helper_reap() has
+   collected a helper's exit status. */
+static void helper_maintenance( int reason, void *data, int status ) {
+    struct _ntlm_helper_proc *hproc = data;
+    struct _ntlm_helper_proc **pp;
+
+    switch ( reason ) {
+    case APR_OC_REASON_DEATH:
+    case APR_OC_REASON_LOST:
+        /* the caller holds global_ntlm_context.mutex */
+        if ( hproc->helper != NULL ) {
+            /* it wasn't asked to go; helper_acquire() replaces it */
+            apr_atomic_set32( &hproc->helper->dead, 1 );
+            hproc->helper = NULL;
+        }
+        for ( pp = &global_ntlm_context.procs; *pp != NULL; pp = &(*pp)->next ) {
+            if ( *pp == hproc ) {
+                *pp = hproc->next;
+                break;
+            }
+        }
+        /* runs the cleanup that unregisters us */
+        apr_pool_clear( hproc->pool );
+        hproc->next = global_ntlm_context.free_procs;
+        global_ntlm_context.free_procs = hproc;
+        break;
+    default:
+        break;
+    }
+}
+
+/* Collect any helpers that have exited.  Only our own processes are
+   polled: the other_child list we inherited from the parent holds
+   piped loggers and the like that aren't ours to wait for. */
+static void helper_reap( void ) {
+    struct _ntlm_helper_proc *hproc, *next;
+    int code;
+    apr_exit_why_e why;
+
+    POOL_LOCK( global_ntlm_context.mutex );
+    for ( hproc = global_ntlm_context.procs; hproc != NULL; hproc = next ) {
+        next = hproc->next;
+        if ( apr_proc_wait( &hproc->proc, &code, &why, APR_NOWAIT ) == APR_CHILD_DONE ) {
+            apr_proc_other_child_alert( &hproc->proc, APR_OC_REASON_DEATH, code );
+        }
+    }
+    POOL_UNLOCK( global_ntlm_context.mutex );
+}
+
+/* A record to track one helper process until it has been reaped */
+static struct _ntlm_helper_proc *helper_proc_get( struct _ntlm_auth_helper *auth_helper ) {
+    struct _ntlm_helper_proc *hproc;
+
+    POOL_LOCK( global_ntlm_context.mutex );
+    if (( hproc = global_ntlm_context.free_procs ) != NULL ) {
+        global_ntlm_context.free_procs = hproc->next;
+    } else {
+        hproc = apr_pcalloc( global_ntlm_context.pool, sizeof( struct _ntlm_helper_proc ));
+        apr_pool_create( &hproc->pool, global_ntlm_context.pool );
+    }
+#ifdef NTLM_HAVE_LAUNCHER
+    hproc->launched = 0;
+#endif
+    hproc->helper = auth_helper;
+    POOL_UNLOCK( global_ntlm_context.mutex );
+
+    return hproc;
+}
+
+static void helper_proc_put( struct _ntlm_helper_proc *hproc ) {
+    POOL_LOCK( global_ntlm_context.mutex );
+    hproc->helper = NULL;
+    hproc->next = global_ntlm_context.free_procs;
+    global_ntlm_context.free_procs = hproc;
+    POOL_UNLOCK( global_ntlm_context.mutex );
+}
+
+/* Start watching a process we just started */
+static void helper_proc_register( struct _ntlm_helper_proc *hproc ) {
+    POOL_LOCK( global_ntlm_context.mutex );
+    apr_proc_other_child_register( &hproc->proc, helper_maintenance, hproc, NULL, hproc->pool );
+    hproc->next = global_ntlm_context.procs;
+    global_ntlm_context.procs = hproc;
+    POOL_UNLOCK( global_ntlm_context.mutex );
+}
+#endif
+
+#ifdef NTLM_HAVE_LAUNCHER
+static apr_status_t fd_poll( int fd, short events, apr_time_t deadline );
+
+/* Send one message over a Unix socket, with up to two fds */
+static apr_status_t fd_send( int sock, const void *buf, apr_size_t len, const int *fds, int nfds ) {
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE( 2 * sizeof( int ))];
+    } ctl;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cm;
+    ssize_t n;
+    int flags = 0;
+
+#ifdef MSG_NOSIGNAL
+    flags = MSG_NOSIGNAL;
+#endif
+    memset( &msg, 0, sizeof( msg ));
+    iov.iov_base = (void *) buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if ( nfds > 0 ) {
+        memset( &ctl, 0, sizeof( ctl ));
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = CMSG_SPACE( nfds * sizeof( int ));
+        cm = CMSG_FIRSTHDR( &msg );
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN( nfds * sizeof( int ));
+        memcpy( CMSG_DATA( cm ), fds, nfds * sizeof( int ));
+    }
+
+    do {
+        n = sendmsg( sock, &msg, flags );
+    } while ( n < 0 && errno == EINTR );
+    if ( n < 0 ) {
+        return errno;
+    }
+    return (apr_size_t) n == len ? APR_SUCCESS : APR_EGENERAL;
+}
+
+/* Receive one message of at most *len bytes, and up to max fds sent
+   with it; fds beyond max, or with a message that didn't fit, are
+   closed */
+static apr_status_t fd_recv( int sock, void *buf, apr_size_t *len, int *fds, int max, int *nfds ) {
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE( 4 * sizeof( int ))];
+    } ctl;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cm;
+    ssize_t n;
+    int fd, i, k;
+
+    *nfds = 0;
+    memset( &msg, 0, sizeof( msg ));
+    iov.iov_base = buf;
+    iov.iov_len = *len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof( ctl.buf );
+
+    do {
+        n = recvmsg( sock, &msg, 0 );
+    } while ( n < 0 && errno == EINTR );
+    if ( n < 0 ) {
+        return errno;
+    }
+
+    for ( cm = CMSG_FIRSTHDR( &msg ); cm != NULL; cm = CMSG_NXTHDR( &msg, cm )) {
+        if ( cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS ) {
+            continue;
+        }
+        k = ( cm->cmsg_len - CMSG_LEN( 0 )) / sizeof( int );
+        for ( i = 0; i < k; i++ ) {
+            memcpy( &fd, CMSG_DATA( cm ) + i * sizeof( int ), sizeof( int ));
+            fcntl( fd, F_SETFD, FD_CLOEXEC );
+            if ( *nfds < max ) {
+                fds[(*nfds)++] = fd;
+            } else {
+                close( fd );
+            }
+        }
+    }
+    if ( n == 0 || ( msg.msg_flags & ( MSG_TRUNC | MSG_CTRUNC ))) {
+        while ( *nfds > 0 ) {
+            close( fds[--(*nfds)] );
+        }
+        return n == 0 ? APR_EOF : APR_ENOSPC;
+    }
+    *len = n;
+
+    return APR_SUCCESS;
+}
+
+/* Have the launcher start a helper, putting its pid and our ends of its
+   pipes in proc, and the outcome in *rv.  Returns 0 if there is no
+   launcher to ask, so the caller must fork the helper itself. */
+static int launcher_spawn( server_rec *s, char **argv, apr_proc_t *proc, apr_pool_t *pool,
+                           apr_status_t *rv ) {
+    char buf[LAUNCHER_MAX_REQUEST];
+    struct _launch_request req;
+    struct _launch_reply rep;
+    apr_size_t len = sizeof( req ), n;
+    int sv[2], fds[2], nfds = 0, i;
+
+    if ( launcher_fd < 0 || apr_atomic_read32( &launcher_lost )) {
+        return 0;
+    }
+
+    req.argc = 0;
+    for ( i = 0; argv[i] != NULL; i++ ) {
+        n = strlen( argv[i] ) + 1;
+        if ( len + n > sizeof( buf ) || i >= LAUNCHER_MAX_ARGS ) {
+            /* too long for the launcher, not for apr_proc_create() */
+            return 0;
+        }
+        memcpy( buf + len, argv[i], n );
+        len += n;
+        req.argc++;
+    }
+    req.len = len - sizeof( req );
+    memcpy( buf, &req, sizeof( req ));
+
+    if ( socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) != 0 ) {
+        *rv = errno;
+        return 1;
+    }
+    fcntl( sv[0], F_SETFD, FD_CLOEXEC );
+    fcntl( sv[1], F_SETFD, FD_CLOEXEC );
+    *rv = fd_send( launcher_fd, buf, len, &sv[1], 1 );
+    close( sv[1] );
+    if ( *rv == APR_SUCCESS ) {
+        *rv = fd_poll( sv[0], POLLIN, apr_time_now() + apr_time_from_sec( LAUNCHER_TIMEOUT ));
+    }
+    if ( *rv == APR_SUCCESS ) {
+        n = sizeof( rep );
+        *rv = fd_recv( sv[0], &rep, &n, fds, 2, &nfds );
+        if ( *rv == APR_SUCCESS && n != sizeof( rep )) {
+            *rv = APR_EGENERAL;
+        }
+    }
+    close( sv[0] );
+
+    if ( *rv != APR_SUCCESS ) {
+        while ( nfds > 0 ) {
+            close( fds[--nfds] );
+        }
+        if ( apr_atomic_cas32( &launcher_lost, 1, 0 ) == 0 ) {
+            SERROR( *rv, "lost the helper launcher; this child will fork helpers itself" );
+        }
+        return 0;
+    }
+    if ( rep.pid <= 0 || nfds != 2 ) {
+        while ( nfds > 0 ) {
+            close( fds[--nfds] );
+        }
+        *rv = rep.err ? rep.err : APR_EGENERAL;
+        return 1;
+    }
+
+    /* non-blocking, like the pipes apr_proc_create() gives us */
+    for ( i = 0; i < 2; i++ ) {
+        fcntl( fds[i], F_SETFL, fcntl( fds[i], F_GETFL ) | O_NONBLOCK );
+    }
+    proc->pid = rep.pid;
+    proc->err = NULL;
+    apr_os_pipe_put_ex( &proc->in, &fds[0], 1, pool );
+    apr_os_pipe_put_ex( &proc->out, &fds[1], 1, pool );
+    *rv = APR_SUCCESS;
+
+    return 1;
+}
+#endif
+
+/* Start a process in an empty helper slot.  r is NULL when called
+   from child_init.  Returns 0 if the helper couldn't be started. */
+static int spawn_auth_helper( server_rec *s, request_rec *r, struct _ntlm_auth_helper *auth_helper ) {
+    struct _ntlm_helper_pool *hp = auth_helper->owner;
+    struct _ntlm_child_stuff cld;
+    apr_pool_t *pool;
+#ifdef APACHE2
+    apr_procattr_t *attr;
+    apr_status_t rv;
+    char **argv_out;
+    apr_pool_create_ex( &pool, NULL, NULL, NULL ); /* xxx return code */
+#else
+    pool = ap_make_sub_pool( NULL );
+#endif
+    auth_helper->helper_pid = 0;
+    auth_helper->sent_challenge = 0;
+
+#ifdef APACHE2
+    argv_out = hp->argv;
+#else
+    ap_register_cleanup( pool, auth_helper, CLEANUP(cleanup_ntlm_auth_helper), ap_null_cleanup );
+#endif
+    cld.argv0 = hp->cmd;
+    cld.r = r;
+
+#ifdef APACHE2
+    apr_procattr_create( &attr, pool );
+    /* our ends of the pipes are non-blocking, so that fd_poll()
+       can put a deadline on every exchange */
+    apr_procattr_io_set( attr, APR_CHILD_BLOCK, APR_CHILD_BLOCK, APR_NO_PIPE );
+    apr_procattr_error_check_set( attr, 1 );
+    auth_helper->hproc = helper_proc_get( auth_helper );
+    auth_helper->proc = &auth_helper->hproc->proc;
+#ifdef NTLM_HAVE_LAUNCHER
+    auth_helper->hproc->launched = launcher_spawn( s, argv_out, auth_helper->proc, pool, &rv );
+    if ( !auth_helper->hproc->launched )
+#endif
+    rv = apr_proc_create( auth_helper->proc, argv_out[0], (const char * const *)argv_out, NULL, attr, pool );
+    if ( rv != APR_SUCCESS ) {
+        SERROR( rv, "couldn't spawn child ntlm helper process: %s", argv_out[0]);
+        helper_proc_put( auth_helper->hproc );
+        auth_helper->hproc = NULL;
+        auth_helper->proc = NULL;
+        apr_pool_destroy( pool );
+        return 0;
+    }
+#ifdef NTLM_HAVE_LAUNCHER
+    if ( !auth_helper->hproc->launched )
+#endif
+    helper_proc_register( auth_helper->hproc );
+    apr_atomic_set32( &auth_helper->dead, 0 );
+    auth_helper->rbuf = apr_palloc( pool, HELPER_READ_BUFSIZE );
+    auth_helper->rbuf_size = HELPER_READ_BUFSIZE;
+    auth_helper->rbuf_pos = auth_helper->rbuf_len = 0;
+    auth_helper->helper_pid = auth_helper->proc->pid;
+#else
+    auth_helper->pool = pool;
+    auth_helper->helper_pid = ap_bspawn_child(pool, helper_child,
+                                              (void *) &cld, just_wait,
+                                              &auth_helper->out_to_helper,
+                                              &auth_helper->in_from_helper,
+                                              NULL);
+
+    if (auth_helper->helper_pid == -1) {
+        SERROR( errno, "couldn't spawn child ntlm helper process: %s", cld.argv0);
+        auth_helper->pool = NULL;
+        apr_pool_destroy( pool );
+        return 0;
+    }
+#endif
+
+    auth_helper->pool = pool;
+    auth_helper->started = apr_time_now();
+    auth_helper->idle_since = auth_helper->started;
+    auth_helper->requests = 0;
+    STAT_INC( helper_spawns[hp->scheme] );
+    stats_helper_running( hp->scheme, 1 );
+
+    SDEBUG( "Launched %s helper, pid %d", hp->name, auth_helper->helper_pid );
+
+    return 1;
+}
+
+/* How long a slot whose helpers keep dying rests before trying again */
+static void helper_backoff( struct _ntlm_auth_helper *auth_helper ) {
+    int delay;
+
+    auth_helper->failures++;
+    delay = auth_helper->failures > 6 ? HELPER_BACKOFF_MAX : 1 << ( auth_helper->failures - 1 );
+    if ( delay > HELPER_BACKOFF_MAX ) {
+        delay = HELPER_BACKOFF_MAX;
+    }
+    auth_helper->respawn_at = apr_time_now() + apr_time_from_sec( delay );
+}
+
+/* Empty a slot; must be called with the pool locked.  Closing the pipes
+   makes the helper exit, and helper_reap() collects it later. */
+static void helper_close( struct _ntlm_auth_helper *auth_helper, int failed ) {
+    struct _ntlm_helper_pool *hp = auth_helper->owner;
+    apr_pool_t *pool = auth_helper->pool;
+
+    if ( auth_helper->state == HELPER_EMPTY ) {
+        return;
+    }
+    auth_helper->state = HELPER_EMPTY;
+    auth_helper->leased = 0;
+    auth_helper->in_io = 0;
+    auth_helper->pool = NULL;
+    hp->count--;
+
+    stats_helper_running( hp->scheme, -1 );
+    if ( failed ) {
+        STAT_INC( helper_deaths[hp->scheme] );
+    }
+
+    /* a helper that never managed to answer anything is most likely
+       misconfigured, or winbindd is down; don't fork it in a loop */
+    if ( failed && auth_helper->requests == 0 ) {
+        helper_backoff( auth_helper );
+    } else {
+        auth_helper->failures = 0;
+        auth_helper->respawn_at = 0;
+    }
+
+#if defined(APACHE2) && APR_HAS_THREADS
+    if ( auth_helper->channels != NULL ) {
+        int i;
+
+        /* whoever is still waiting on this helper won't get an answer */
+        for ( i = 0; i < hp->concurrency; i++ ) {
+            struct _ntlm_channel *ch = &auth_helper->channels[i];
+            if ( !ch->in_use || ch->done ) {
+                continue;
+            }
+            if ( ch->pool == NULL ) {
+                ch->in_use = 0;
+                auth_helper->outstanding--;
+            } else {
+                ch->done = 1;
+                ch->status = HTTP_INTERNAL_SERVER_ERROR;
+            }
+        }
+        apr_thread_cond_broadcast( auth_helper->chan_cond );
+    }
+#endif
+
+#ifdef APACHE2
+    POOL_LOCK( global_ntlm_context.mutex );
+    if ( auth_helper->hproc != NULL ) {
+        auth_helper->hproc->helper = NULL;
+#ifdef NTLM_HAVE_LAUNCHER
+        if ( auth_helper->hproc->launched ) {
+            /* there's nothing for helper_reap() to wait for */
+            auth_helper->hproc->next = global_ntlm_context.free_procs;
+            global_ntlm_context.free_procs = auth_helper->hproc;
+        }
+#endif
+    }
+    POOL_UNLOCK( global_ntlm_context.mutex );
+    auth_helper->hproc = NULL;
+    auth_helper->proc = NULL;
+#endif
+
+#if defined(APACHE2) && APR_HAS_THREADS
+    apr_thread_cond_signal( hp->cond );
+#endif
+
+    if ( pool != NULL ) {
+        apr_pool_destroy( pool );
+    }
+}
+
+/* Has the helper served its time? */
+static int helper_expired( struct _ntlm_auth_helper *auth_helper ) {
+    struct _ntlm_helper_pool *hp = auth_helper->owner;
+
+#ifdef APACHE2
+    if ( apr_atomic_read32( &auth_helper->dead )) {
+        return 1;
+    }
+#endif
+    if ( hp->max_requests && auth_helper->requests >= (unsigned long) hp->max_requests ) {
+        return 1;
+    }
+    if ( hp->max_age && auth_helper->started + apr_time_from_sec( hp->max_age ) <= apr_time_now()) {
+        return 1;
+    }
+
+    return 0;
+}
+
+#ifdef APACHE2
+/* Do two command lines start the same helper? */
+static int helper_argv_equal( char **a, char **b ) {
+    for ( ; *a != NULL && *b != NULL; a++, b++ ) {
+        if ( strcmp( *a, *b ) != 0 ) {
+            return 0;
+        }
+    }
+    return *a == NULL && *b == NULL;
+}
+#endif
+
+/* Find (or create) the per-child pool of helpers of one type running
+   cmd.  Sections whose command lines tokenize alike and which ask for
+   the same number of helpers share a pool, however many of them there
+   are; any other difference gets a pool of its own.  crec is NULL when
+   called from child_init, before any recycle limits are known. */
+static struct _ntlm_helper_pool *get_helper_pool( const char *name, char *cmd, int max,
+                                                  int concurrency, ntlm_config_rec *crec ) {
+    struct _ntlm_helper_pool *hp = NULL;
+#ifdef APACHE2
+    struct _ntlm_helper_pool_alias *alias, *aliases;
+    char **argv;
+#endif
+    int i, configured_max = max;
+
+    POOL_LOCK( global_ntlm_context.mutex );
+    if ( global_ntlm_context.pool == NULL ) {
+        /* Apache 1 has no child_init hook to do this for us */
+#ifdef APACHE2
+        apr_pool_create_ex( &global_ntlm_context.pool, NULL, NULL, NULL );
+#else
+        global_ntlm_context.pool = ap_make_sub_pool( NULL );
+#endif
+    }
+
+#ifdef APACHE2
+    if ( global_ntlm_context.helper_pool_aliases == NULL ) {
+        global_ntlm_context.helper_pool_aliases = apr_hash_make( global_ntlm_context.pool );
+    }
+    aliases = apr_hash_get( global_ntlm_context.helper_pool_aliases, cmd, APR_HASH_KEY_STRING );
+    for ( alias = aliases; alias != NULL; alias = alias->next ) {
+        if ( alias->max == configured_max && strcmp( alias->name, name ) == 0 ) {
+            hp = alias->hp;
+            break;
+        }
+    }
+
+    if ( hp == NULL ) {
+        if ( max == 0 ) {
+            /* one helper per worker thread can never be a bottleneck */
+            if ( ap_mpm_query( AP_MPMQ_MAX_THREADS, &max ) != APR_SUCCESS || max < 1 ) {
+                max = 1;
+            }
+        }
+        apr_tokenize_to_argv( cmd, &argv, global_ntlm_context.pool );
+        for ( hp = global_ntlm_context.helper_pools; hp != NULL; hp = hp->next ) {
+            if ( hp->max == max && strcmp( hp->name, name ) == 0 && helper_argv_equal( hp->argv, argv )) {
+                break;
+            }
+        }
+    }
+#else
+    if ( max == 0 ) {
+        max = 1;
+    }
+    for ( hp = global_ntlm_context.helper_pools; hp != NULL; hp = hp->next ) {
+        if ( hp->max == max && strcmp( hp->name, name ) == 0 && strcmp( hp->cmd, cmd ) == 0 ) {
+            break;
+        }
+    }
+#endif
+
+    if ( hp == NULL ) {
+        hp = apr_pcalloc( global_ntlm_context.pool, sizeof( struct _ntlm_helper_pool ));
+        hp->name = name;
+        hp->scheme = strcmp( name, "negotiate" ) == 0 ? SCHEME_NEGOTIATE
+            : strcmp( name, "plaintext" ) == 0 ? SCHEME_BASIC : SCHEME_NTLM;
+        hp->cmd = apr_pstrdup( global_ntlm_context.pool, cmd );
+        hp->pool = global_ntlm_context.pool;
+#ifdef APACHE2
+        hp->argv = argv;
+#if APR_HAS_THREADS
+        apr_thread_mutex_create( &hp->mutex, APR_THREAD_MUTEX_DEFAULT, hp->pool );
+        apr_thread_cond_create( &hp->cond, hp->pool );
+#endif
+#endif
+        hp->max = max;
+        hp->helpers = apr_pcalloc( hp->pool, max * sizeof( struct _ntlm_auth_helper ));
+        for ( i = 0; i < max; i++ ) {
+            hp->helpers[i].owner = hp;
+        }
+#if defined(APACHE2) && APR_HAS_THREADS
+        if ( concurrency > 0 ) {
+            hp->concurrency = concurrency;
+            for ( i = 0; i < max; i++ ) {
+                hp->helpers[i].channels = apr_pcalloc( hp->pool, concurrency * sizeof( struct _ntlm_channel ));
+                apr_thread_cond_create( &hp->helpers[i].chan_cond, hp->pool );
+            }
+        }
+#else
+        (void)concurrency;
+#endif
+        hp->next = global_ntlm_context.helper_pools;
+        global_ntlm_context.helper_pools = hp;
+    }
+
+#ifdef APACHE2
+    if ( alias == NULL ) {
+        /* remember this spelling, so next time it goes straight there */
+        alias = apr_palloc( global_ntlm_context.pool, sizeof( struct _ntlm_helper_pool_alias ));
+        alias->name = name;
+        alias->max = configured_max;
+        alias->hp = hp;
+        alias->next = aliases;
+        apr_hash_set( global_ntlm_context.helper_pool_aliases,
+                      apr_pstrdup( global_ntlm_context.pool, cmd ), APR_HASH_KEY_STRING, alias );
+    }
+#endif
+    if ( crec != NULL ) {
+        hp->max_requests = crec->helper_max_requests;
+        hp->max_age = crec->helper_max_age;
+        hp->min = hp->scheme == SCHEME_NEGOTIATE ? crec->negotiate_ntlm_auth_helper_min
+            : hp->scheme == SCHEME_BASIC ? crec->ntlm_plaintext_helper_min : crec->ntlm_auth_helper_min;
+        if ( hp->min > hp->max ) {
+            hp->min = hp->max;
+        }
+        hp->idle_timeout = crec->helper_idle_timeout;
+        hp->spawn_wait = (apr_interval_time_t) crec->helper_spawn_wait * 1000;
+    }
+    POOL_UNLOCK( global_ntlm_context.mutex );
+
+    return hp;
+}
+
+/* Start a helper in an empty slot; called with the pool locked, which
+   is dropped while the process starts.  Returns 0 on failure. */
+static int helper_spawn_locked( server_rec *s, request_rec *r, struct _ntlm_auth_helper *auth_helper ) {
+    struct _ntlm_helper_pool *hp = auth_helper->owner;
+    int ok;
+
+    auth_helper->state = HELPER_SPAWNING;
+    hp->count++;
+    POOL_UNLOCK( hp->mutex );
+    ok = spawn_auth_helper( s, r, auth_helper );
+    POOL_LOCK( hp->mutex );
+    if ( !ok ) {
+        auth_helper->state = HELPER_EMPTY;
+        hp->count--;
+        helper_backoff( auth_helper );
+#if defined(APACHE2) && APR_HAS_THREADS
+        apr_thread_cond_signal( hp->cond );
+#endif
+        return 0;
+    }
+    auth_helper->state = HELPER_READY;
+
+    return 1;
+}
+
+/* must be called with the pool locked */
+static void helper_take_lease( struct _ntlm_auth_helper *auth_helper ) {
+    auth_helper->leased = 1;
+    auth_helper->in_io = 1;
+    auth_helper->lease = ++auth_helper->owner->leases;
+    auth_helper->leased_at = apr_time_now();
+}
+
+/* Should a caller queued since queued start another helper rather than
+   wait for a busy one?  Below the minimum, always; above it, only once
+   the wait has gone on for NTLMAuthHelperSpawnWait, so the pool grows
+   with the queue rather than with every burst.  Called with the pool
+   locked. */
+static int helper_should_grow( struct _ntlm_helper_pool *hp, apr_time_t queued, apr_time_t now ) {
+#if defined(APACHE2) && APR_HAS_THREADS
+    return hp->count < hp->min || hp->count == 0 || now - queued >= hp->spawn_wait;
+#else
+    /* nobody could hand a helper back while we waited */
+    (void)hp; (void)queued; (void)now;
+    return 1;
+#endif
+}
+
+/* Check a helper out of the pool for the length of one handshake.
+   Spawns a new helper if the pool has room and the wait calls for it,
+   otherwise waits for one to be returned, taking over helpers whose
+   handshake has timed out.
+   Helpers that died or outlived their limits are replaced on the way.
+   r is NULL in the helper broker. */
+static struct _ntlm_auth_helper *helper_acquire( server_rec *s, request_rec *r,
+                                                 struct _ntlm_helper_pool *hp, int timeout ) {
+    struct _ntlm_auth_helper *auth_helper = NULL;
+    apr_time_t now, queued = apr_time_now();
+    apr_time_t deadline = queued + apr_time_from_sec( timeout ? timeout : 10 );
+    int i;
+
+#ifdef APACHE2
+    helper_reap();
+#endif
+
+    POOL_LOCK( hp->mutex );
+    for (;;) {
+        struct _ntlm_auth_helper *oldest = NULL, *empty = NULL;
+        apr_time_t next_spawn = 0, wake;
+
+        now = apr_time_now();
+        for ( i = 0; i < hp->max; i++ ) {
+            struct _ntlm_auth_helper *h = &hp->helpers[i];
+            if ( h->state == HELPER_READY && !h->leased && helper_expired( h )) {
+                SDEBUG( "retiring %s helper %d after %lu requests", hp->name, h->helper_pid, h->requests );
+                helper_close( h, 0 );
+            }
+            if ( h->state == HELPER_EMPTY ) {
+                if ( h->respawn_at <= now ) {
+                    if ( empty == NULL ) {
+                        empty = h;
+                    }
+                } else if ( next_spawn == 0 || h->respawn_at < next_spawn ) {
+                    next_spawn = h->respawn_at;
+                }
+                continue;
+            }
+            if ( h->state != HELPER_READY ) {
+                continue;
+            }
+            if ( !h->leased ) {
+                auth_helper = h;
+                break;
+            }
+            if ( !h->in_io && ( oldest == NULL || h->leased_at < oldest->leased_at )) {
+                oldest = h;
+            }
+        }
+        if ( auth_helper != NULL ) {
+            break;
+        }
+
+        if ( empty != NULL && ( helper_should_grow( hp, queued, now ) || now >= deadline )) {
+            if ( now - queued >= apr_time_from_msec( 1 )) {
+                SDEBUG( "starting %s helper %d of %d after %dms in the queue",
+                        hp->name, hp->count + 1, hp->max, (int) apr_time_as_msec( now - queued ));
+            }
+            if ( helper_spawn_locked( s, r, empty )) {
+                auth_helper = empty;
+            }
+            break;
+        }
+
+#if defined(APACHE2) && APR_HAS_THREADS
+        if ( oldest != NULL && timeout && oldest->leased_at + apr_time_from_sec( timeout ) <= now ) {
+            SDEBUG( "reclaiming %s helper %d from a stalled handshake", hp->name, oldest->helper_pid );
+            auth_helper = oldest;
+            break;
+        }
+        if ( now >= deadline ) {
+            break;
+        }
+        /* nobody signals when a backoff or the spawn wait runs out */
+        wake = deadline;
+        if ( next_spawn != 0 && next_spawn < wake ) {
+            wake = next_spawn;
+        }
+        if ( empty != NULL && queued + hp->spawn_wait < wake ) {
+            wake = queued + hp->spawn_wait;
+        }
+        apr_thread_cond_timedwait( hp->cond, hp->mutex, wake - now );
+#else
+        /* nobody else can return a helper while we wait, so take the
+           one whose handshake was abandoned longest ago */
+        (void)deadline; (void)next_spawn; (void)wake;
+        auth_helper = oldest;
+        break;
+#endif
+    }
+
+    if ( auth_helper != NULL ) {
+        helper_take_lease( auth_helper );
+        SDEBUG( "Using %s helper %d", hp->name, auth_helper->helper_pid );
+    } else {
+        SERROR( APR_EGENERAL, "no %s helper available (%d of %d in use)", hp->name, hp->count, hp->max );
+    }
+    POOL_UNLOCK( hp->mutex );
+
+    return auth_helper;
+}
+
+/* Pick a leased helper up again for a later handshake leg.  Returns
+   NULL if the lease expired and the helper went to someone else. */
+static struct _ntlm_auth_helper *helper_resume( struct _ntlm_auth_helper *auth_helper,
+                                                unsigned long lease ) {
+    struct _ntlm_helper_pool *hp;
+
+    if ( auth_helper == NULL ) {
+        return NULL;
+    }
+    hp = auth_helper->owner;
+
+    POOL_LOCK( hp->mutex );
+    if ( auth_helper->state == HELPER_READY && auth_helper->leased
+         && auth_helper->lease == lease ) {
+        auth_helper->in_io = 1;
+    } else {
+        auth_helper = NULL;
+    }
+    POOL_UNLOCK( hp->mutex );
+
+    return auth_helper;
+}
+
+/* Keep the lease but let the helper be reclaimed if the handshake stalls */
+static void helper_suspend( struct _ntlm_auth_helper *auth_helper ) {
+    struct _ntlm_helper_pool *hp = auth_helper->owner;
+
+    POOL_LOCK( hp->mutex );
+    auth_helper->in_io = 0;
+    POOL_UNLOCK( hp->mutex );
+}
+
+/* Hand the helper back to the pool for the next handshake, or retire
+   it if it has reached its request or age limit */
+static void helper_release( struct _ntlm_auth_helper *auth_helper ) {
+    struct _ntlm_helper_pool *hp = auth_helper->owner;
+
+    POOL_LOCK( hp->mutex );
+    if ( helper_expired( auth_helper )) {
+        helper_close( auth_helper, 0 );
+    } else {
+        auth_helper->leased = 0;
+        auth_helper->in_io = 0;
+        auth_helper->idle_since = apr_time_now();
+#if defined(APACHE2) && APR_HAS_THREADS
+        apr_thread_cond_signal( hp->cond );
+#endif
+    }
+    POOL_UNLOCK( hp->mutex );
+}
+
+/* Throw away a helper that misbehaved; the next acquire spawns a fresh one */
+static void helper_discard( struct _ntlm_auth_helper *auth_helper ) {
+    struct _ntlm_helper_pool *hp = auth_helper->owner;
+
+    POOL_LOCK( hp->mutex );
+    helper_close( auth_helper, 1 );
+    POOL_UNLOCK( hp->mutex );
+}
+
+/* Did the helper answer BH?  Parses a copy, as the caller wants the line */
+static int helper_reply_bh( apr_pool_t *p, const char *line ) {
+    struct helper_reply parsed;
+
+    return line != NULL && line[0] == 'B'
+        && helper_reply_parse( apr_pstrdup( p, line ), HELPER_FIELDS_BASIC, &parsed ) == 0
+        && parsed.code == HELPER_BH;
+}
+
+#ifdef APACHE2
+/* The backends a Basic user's credentials go to: those of the domain
+   they named, if it has its own, otherwise the PlaintextAuthHelper ones */
+static apr_array_header_t *plaintext_backends( request_rec *r, ntlm_config_rec *crec, const char *user ) {
+    apr_array_header_t *cmds;
+    const char *sep;
+    char *domain;
+
+    if ( crec->plaintext_domains != NULL && ( sep = strchr( user, '\\' )) != NULL ) {
+        domain = apr_pstrndup( r->pool, user, sep - user );
+        ap_str_tolower( domain );
+        if (( cmds = apr_hash_get( crec->plaintext_domains, domain, APR_HASH_KEY_STRING )) != NULL ) {
+            return cmds;
+        }
+    }
+    return crec->helper_backends[SCHEME_BASIC];
+}
+
+/* This child's state for one backend */
+static struct _ntlm_backend *backend_get( int scheme, const char *cmd ) {
+    struct _ntlm_backend *be;
+
+    if ( global_ntlm_context.backends[scheme] == NULL ) {
+        global_ntlm_context.backends[scheme] = apr_hash_make( global_ntlm_context.pool );
+    }
+    if (( be = apr_hash_get( global_ntlm_context.backends[scheme], cmd, APR_HASH_KEY_STRING )) == NULL ) {
+        be = apr_pcalloc( global_ntlm_context.pool, sizeof( *be ));
+        be->cmd = apr_pstrdup( global_ntlm_context.pool, cmd );
+        apr_hash_set( global_ntlm_context.backends[scheme], be->cmd, APR_HASH_KEY_STRING, be );
+    }
+    return be;
+}
+
+/* Pick the backend for a new handshake or Basic check from those not
+   yet tried: the one with the least work in progress among those that
+   are up, or if every one is resting, the one due back first.  Returns
+   NULL once all have been tried. */
+static struct _ntlm_backend *backend_choose( int scheme, apr_array_header_t *cmds, unsigned int *tried ) {
+    struct _ntlm_backend *best = NULL, *be;
+    apr_time_t now = apr_time_now();
+    int i, j, start, up, best_up = 0, best_i = 0;
+
+    POOL_LOCK( global_ntlm_context.mutex );
+    start = cmds->nelts > 1 ? (int)( global_ntlm_context.backend_rotor++ % cmds->nelts ) : 0;
+    for ( j = 0; j < cmds->nelts; j++ ) {
+        i = ( start + j ) % cmds->nelts;
+        if ( *tried & ( 1U << i )) {
+            continue;
+        }
+        be = backend_get( scheme, APR_ARRAY_IDX( cmds, i, char * ));
+        up = be->down_until <= now;
+        if ( best == NULL || up > best_up
+             || ( up == best_up && ( up ? apr_atomic_read32( &be->active ) < apr_atomic_read32( &best->active )
+                                     : be->down_until < best->down_until ))) {
+            best = be;
+            best_up = up;
+            best_i = i;
+        }
+    }
+    if ( best != NULL ) {
+        *tried |= 1U << best_i;
+    }
+    POOL_UNLOCK( global_ntlm_context.mutex );
+
+    return best;
+}
+
+/* The backend answered BH, timed out or went away: rest it, for
+   longer each time it happens again */
+static void backend_failed( request_rec *r, struct _ntlm_backend *be, int nbackends ) {
+    int delay;
+
+    POOL_LOCK( global_ntlm_context.mutex );
+    be->failures++;
+    delay = be->failures > 6 ? HELPER_BACKOFF_MAX : 1 << ( be->failures - 1 );
+    if ( delay > HELPER_BACKOFF_MAX ) {
+        delay = HELPER_BACKOFF_MAX;
+    }
+    be->down_until = apr_time_now() + apr_time_from_sec( delay );
+    POOL_UNLOCK( global_ntlm_context.mutex );
+
+    if ( nbackends > 1 ) {
+        RERROR( APR_EGENERAL, "helper backend %s failed, passing it over for %ds", be->cmd, delay );
+    }
+}
+
+static void backend_ok( request_rec *r, struct _ntlm_backend *be ) {
+    if ( be->failures == 0 ) {
+        return;
+    }
+    POOL_LOCK( global_ntlm_context.mutex );
+    be->failures = 0;
+    be->down_until = 0;
+    POOL_UNLOCK( global_ntlm_context.mutex );
+    RDEBUG( "helper backend %s is answering again", be->cmd );
+}
+
+/* The connection's handshake now counts against be, or nothing */
+static void connection_set_backend( ntlm_connection_context_t *ctxt, struct _ntlm_backend *be ) {
+    if ( ctxt->backend == be ) {
+        return;
+    }
+    if ( ctxt->backend != NULL ) {
+        apr_atomic_dec32( &ctxt->backend->active );
+    }
+    if ( be != NULL ) {
+        apr_atomic_inc32( &be->active );
+    }
+    ctxt->backend = be;
+}
+#endif
+
+#ifdef APACHE2
+/* Wait until a helper pipe or broker socket is ready, or the deadline
+   (0 for none) passes */
+static apr_status_t fd_poll( int fd, short events, apr_time_t deadline ) {
+    struct pollfd pfd;
+    int timeout_ms = -1;
+    int n;
+
+    pfd.fd = fd;
+    pfd.events = events;
+
+    for (;;) {
+        if ( deadline ) {
+            apr_time_t left = deadline - apr_time_now();
+            if ( left <= 0 ) {
+                return APR_TIMEUP;
+            }
+            timeout_ms = (int)(( left + 999 ) / 1000 );
+        }
+        n = poll( &pfd, 1, timeout_ms );
+        if ( n > 0 ) {
+            return APR_SUCCESS;
+        } else if ( n == 0 ) {
+            return APR_TIMEUP;
+        } else if ( errno != EINTR ) {
+            return errno;
+        }
+    }
+}
+
+/* Write a request to a (non-blocking) pipe or socket straight from the
+   pieces it is made of.  vec is consumed as it goes out. */
+static apr_status_t fd_writev( int fd, struct iovec *vec, int nvec, apr_time_t deadline ) {
+    apr_status_t rv;
+    ssize_t n;
+
+    while ( nvec > 0 ) {
+        if ( vec->iov_len == 0 ) {
+            vec++;
+            nvec--;
+            continue;
+        }
+        n = writev( fd, vec, nvec );
+        if ( n >= 0 ) {
+            while ( n > 0 && (apr_size_t) n >= vec->iov_len ) {
+                n -= vec->iov_len;
+                vec++;
+                nvec--;
+            }
+            if ( n > 0 ) {
+                vec->iov_base = (char *) vec->iov_base + n;
+                vec->iov_len -= n;
+            }
+        } else if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+            if (( rv = fd_poll( fd, POLLOUT, deadline )) != APR_SUCCESS ) {
+                return rv;
+            }
+        } else if ( errno != EINTR ) {
+            return errno;
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Read exactly len bytes */
+static apr_status_t fd_read_full( int fd, void *buf, apr_size_t len, apr_time_t deadline ) {
+    apr_status_t rv;
+    ssize_t n;
+
+    while ( len > 0 ) {
+        n = read( fd, buf, len );
+        if ( n > 0 ) {
+            buf = (char *) buf + n;
+            len -= n;
+        } else if ( n == 0 ) {
+            return APR_EOF;
+        } else if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+            if (( rv = fd_poll( fd, POLLIN, deadline )) != APR_SUCCESS ) {
+                return rv;
+            }
+        } else if ( errno != EINTR ) {
+            return errno;
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t helper_writev( struct _ntlm_auth_helper *auth_helper, struct iovec *vec,
+                                   int nvec, apr_time_t deadline ) {
+    apr_os_file_t fd;
+
+    apr_os_file_get( &fd, auth_helper->proc->in );
+    return fd_writev( fd, vec, nvec, deadline );
+}
+
+/* Read one line from the helper's (non-blocking) stdout, a buffer at a
+   time rather than a byte at a time.  The line is copied into p with
+   its newline stripped.  A line longer than limit is an error, as the
+   rest of it could only be mistaken for the next reply. */
+static apr_status_t helper_read_line( struct _ntlm_auth_helper *auth_helper, apr_pool_t *p,
+                                      apr_size_t limit, char **line, apr_time_t deadline ) {
+    apr_os_file_t fd;
+    apr_status_t rv;
+    apr_size_t used;
+    char *start, *nl;
+    ssize_t n;
+
+    apr_os_file_get( &fd, auth_helper->proc->out );
+    for (;;) {
+        start = auth_helper->rbuf + auth_helper->rbuf_pos;
+        used = auth_helper->rbuf_len - auth_helper->rbuf_pos;
+        if (( nl = memchr( start, '\n', used )) != NULL ) {
+            used = nl - start;
+            break;
+        }
+        if ( used > limit ) {
+            return APR_ENOSPC;
+        }
+
+        /* keep the partial line at the front, and fill in after it */
+        if ( auth_helper->rbuf_pos > 0 ) {
+            memmove( auth_helper->rbuf, start, used );
+            auth_helper->rbuf_pos = 0;
+            auth_helper->rbuf_len = used;
+        }
+        if ( auth_helper->rbuf_len == auth_helper->rbuf_size ) {
+            /* the old buffer goes when the helper's pool does */
+            char *bigger = apr_palloc( auth_helper->pool, auth_helper->rbuf_size * 2 );
+
+            memcpy( bigger, auth_helper->rbuf, auth_helper->rbuf_len );
+            auth_helper->rbuf = bigger;
+            auth_helper->rbuf_size *= 2;
+        }
+
+        n = read( fd, auth_helper->rbuf + auth_helper->rbuf_len,
+                  auth_helper->rbuf_size - auth_helper->rbuf_len );
+        if ( n > 0 ) {
+            auth_helper->rbuf_len += n;
+        } else if ( n == 0 ) {
+            return APR_EOF;
+        } else if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+            if (( rv = fd_poll( fd, POLLIN, deadline )) != APR_SUCCESS ) {
+                return rv;
+            }
+        } else if ( errno != EINTR ) {
+            return errno;
+        }
+    }
+
+    if ( used > limit ) {
+        return APR_ENOSPC;
+    }
+    *line = apr_palloc( p, used + 1 );
+    memcpy( *line, start, used );
+    (*line)[used] = '\0';
+    auth_helper->rbuf_pos += used + 1;
+    if ( auth_helper->rbuf_pos == auth_helper->rbuf_len ) {
+        auth_helper->rbuf_pos = auth_helper->rbuf_len = 0;
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_time_t helper_deadline( int timeout ) {
+    return timeout ? apr_time_now() + apr_time_from_sec( timeout ) : 0;
+}
+
+/* A helper that stopped answering may be stuck talking to a domain
+   controller; don't wait for it to notice its stdin has closed */
+static void helper_kill( struct _ntlm_auth_helper *auth_helper ) {
+    apr_proc_kill( auth_helper->proc, SIGKILL );
+    helper_discard( auth_helper );
+}
+#endif
+
+/* Send one request line, given in pieces, to a helper and read its
+   one-line reply, with the trailing newline stripped, into r->pool.
+   On failure the helper is thrown away and the HTTP status to give
+   the client is returned. */
+static int helper_transact( request_rec *r, ntlm_config_rec *crec,
+                            struct _ntlm_auth_helper *auth_helper,
+                            struct iovec *request, int nvec, char **reply ) {
+    int scheme = auth_helper->owner->scheme;
+    apr_time_t start = apr_time_now();
+    int bytes_read;
+#ifdef APACHE2
+    apr_status_t rv;
+    const char *leg = "writing to";
+
+    rv = helper_writev( auth_helper, request, nvec,
+                        helper_deadline( crec->helper_write_timeout ));
+    if ( rv == APR_SUCCESS ) {
+        leg = "reading from";
+        rv = helper_read_line( auth_helper, r->pool, crec->max_token_size, reply,
+                               helper_deadline( crec->helper_read_timeout ));
+    }
+
+    if ( APR_STATUS_IS_TIMEUP( rv )) {
+        apr_uint32_t timeouts = apr_atomic_inc32( &global_ntlm_context.helper_timeouts ) + 1;
+
+        RERROR( rv, "timed out %s %s helper %d, killing it (%u helper timeouts in this child)",
+                leg, auth_helper->owner->name, auth_helper->helper_pid, timeouts );
+        STAT_INC( helper_timeouts[scheme] );
+        helper_kill( auth_helper );
+        return HTTP_SERVICE_UNAVAILABLE;
+    } else if ( APR_STATUS_IS_EOF( rv )) {
+        RERROR( rv, "early EOF from helper" );
+        helper_discard( auth_helper );
+        return HTTP_INTERNAL_SERVER_ERROR;
+    } else if ( APR_STATUS_IS_ENOSPC( rv )) {
+        RERROR( rv, "%s helper %d sent a reply longer than NTLMAuthMaxTokenSize (%d)",
+                auth_helper->owner->name, auth_helper->helper_pid, crec->max_token_size );
+        helper_discard( auth_helper );
+        return HTTP_INTERNAL_SERVER_ERROR;
+    } else if ( rv != APR_SUCCESS ) {
+        RERROR( rv, "helper died while %s it!", leg );
+        helper_discard( auth_helper );
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    bytes_read = strlen( *reply );
+#else
+    char *newline;
+    int i;
+
+    for ( i = 0; i < nvec; i++ ) {
+        if ( ap_bwrite( auth_helper->out_to_helper, request[i].iov_base,
+                        request[i].iov_len ) < (int) request[i].iov_len ) {
+            RDEBUG( "failed to write to helper" );
+            helper_discard( auth_helper );
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+    ap_bflush( auth_helper->out_to_helper );
+
+    *reply = apr_palloc( r->pool, crec->max_token_size + 2 );
+    bytes_read = ap_bgets( *reply, crec->max_token_size + 2, auth_helper->in_from_helper );
+    if ( bytes_read == 0 ) {
+        RERROR( errno, "early EOF from helper" );
+        helper_discard( auth_helper );
+        return HTTP_INTERNAL_SERVER_ERROR;
+    } else if ( bytes_read == -1 ) {
+        RERROR( errno, "helper died!" );
+        helper_discard( auth_helper );
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    if (( newline = strchr( *reply, '\n' )) != NULL ) {
+        *newline = '\0';
+        bytes_read = newline - *reply;
+    } else if ( bytes_read > crec->max_token_size ) {
+        RERROR( errno, "helper sent a reply longer than NTLMAuthMaxTokenSize (%d)",
+                crec->max_token_size );
+        helper_discard( auth_helper );
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+#endif
+
+    if ( bytes_read < 1 ) {
+        RERROR( errno, "failed to read string from helper - only got %d bytes", bytes_read );
+        helper_discard( auth_helper );
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    RDEBUG( "got response: %s", *reply );
+
+    auth_helper->requests++;
+    stats_helper_latency( scheme, start );
+
+    return OK;
+}
+
+#if defined(APACHE2) && APR_HAS_THREADS
+/* Find a shared helper with a free channel, preferring the least busy
+   one and starting another only when every running helper is full.
+   Called with the pool locked. */
+static struct _ntlm_auth_helper *helper_share( request_rec *r, struct _ntlm_helper_pool *hp, int timeout ) {
+    apr_time_t now, queued = apr_time_now();
+    apr_time_t deadline = queued + apr_time_from_sec( timeout ? timeout : 10 );
+    int i;
+
+    for (;;) {
+        struct _ntlm_auth_helper *best = NULL, *empty = NULL;
+        apr_time_t wake = deadline;
+
+        now = apr_time_now();
+        for ( i = 0; i < hp->max; i++ ) {
+            struct _ntlm_auth_helper *h = &hp->helpers[i];
+            if ( h->state == HELPER_READY && h->outstanding == 0 && !h->reading && helper_expired( h )) {
+                RDEBUG( "retiring %s helper %d after %lu requests", hp->name, h->helper_pid, h->requests );
+                helper_close( h, 0 );
+            }
+            if ( h->state == HELPER_EMPTY ) {
+                if ( empty == NULL && h->respawn_at <= now && h->outstanding == 0 ) {
+                    empty = h;
+                }
+                continue;
+            }
+            if ( h->state != HELPER_READY || h->outstanding >= hp->concurrency
+                 || apr_atomic_read32( &h->dead )) {
+                continue;
+            }
+            if ( best == NULL || h->outstanding < best->outstanding ) {
+                best = h;
+            }
+        }
+        if ( best != NULL ) {
+            return best;
+        }
+        if ( empty != NULL && ( helper_should_grow( hp, queued, now ) || now >= deadline )) {
+            return helper_spawn_locked( r->server, r, empty ) ? empty : NULL;
+        }
+        if ( now >= deadline ) {
+            RERROR( APR_EGENERAL, "no %s helper channel available (%d helpers, %d channels each)",
+                    hp->name, hp->count, hp->concurrency );
+            return NULL;
+        }
+        if ( empty != NULL && queued + hp->spawn_wait < wake ) {
+            wake = queued + hp->spawn_wait;
+        }
+        apr_thread_cond_timedwait( hp->cond, hp->mutex, wake - now );
+    }
+}
+
+/* Hand a reply line read from a shared helper to the request it
+   belongs to.  Called with the pool locked. */
+static void helper_dispatch( request_rec *r, struct _ntlm_auth_helper *auth_helper, char *line ) {
+    struct _ntlm_helper_pool *hp = auth_helper->owner;
+    struct _ntlm_channel *ch;
+    const char *rest;
+    long id;
+
+    if ( helper_channel_parse( line, &id, &rest ) != 0 || id >= hp->concurrency
+         || !( ch = &auth_helper->channels[id] )->in_use || ch->done ) {
+        RERROR( APR_EGENERAL, "%s helper %d answered an unknown channel: %s",
+                hp->name, auth_helper->helper_pid, line );
+        return;
+    }
+
+    auth_helper->requests++;
+    if ( ch->pool == NULL ) {
+        /* its request gave up waiting */
+        ch->in_use = 0;
+        if ( --auth_helper->outstanding == 0 ) {
+            auth_helper->idle_since = apr_time_now();
+        }
+        apr_thread_cond_signal( hp->cond );
+        return;
+    }
+    /* the waiter is asleep, so its pool is ours to use */
+    ch->reply = apr_pstrdup( ch->pool, rest );
+    ch->status = OK;
+    ch->done = 1;
+}
+
+/* Ask a shared Basic helper to check a (user, password) pair.  Each
+   request takes a channel ID, so many can be outstanding on the same
+   pipe; whichever waiter finds nobody reading reads replies for all
+   of them until its own arrives. */
+static int plaintext_channel_verify( request_rec *r, ntlm_config_rec *crec, struct _ntlm_helper_pool *hp,
+                                     const char *user, const char *pass, char **reply ) {
+    struct _ntlm_auth_helper *auth_helper;
+    struct _ntlm_channel *ch;
+    struct iovec vec[HELPER_REQUEST_VECS];
+    char id_str[HELPER_CHANNEL_ID_SIZE], *line;
+    apr_time_t start = apr_time_now();
+    apr_time_t deadline = helper_deadline( crec->helper_read_timeout );
+    apr_status_t rv;
+    int id, result, nvec;
+
+    /* the real channel ID is filled in below; this only checks the line */
+    if (( nvec = helper_request_plaintext( vec, id_str, 0, user, pass )) < 0 ) {
+        RDEBUG( "line break in Basic credentials" );
+        *reply = "ERR";
+        return OK;
+    }
+
+    helper_reap();
+
+    POOL_LOCK( hp->mutex );
+    if (( auth_helper = helper_share( r, hp, crec->handshake_timeout )) == NULL ) {
+        POOL_UNLOCK( hp->mutex );
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
+    for ( id = 0; auth_helper->channels[id].in_use; id++ )
+        ;
+    ch = &auth_helper->channels[id];
+    ch->in_use = 1;
+    ch->done = 0;
+    ch->pool = r->pool;
+    ch->reply = NULL;
+    auth_helper->outstanding++;
+
+    /* lines must not interleave, so write with the pool locked; the
+       reader never holds the lock while it waits */
+    helper_request_plaintext( vec, id_str, id, user, pass );
+    rv = helper_writev( auth_helper, vec, nvec, helper_deadline( crec->helper_write_timeout ));
+    if ( rv != APR_SUCCESS ) {
+        RERROR( rv, "failed writing to %s helper %d", hp->name, auth_helper->helper_pid );
+        /* half a line may have gone; nothing more can be sent to it */
+        apr_proc_kill( auth_helper->proc, SIGKILL );
+        apr_atomic_set32( &auth_helper->dead, 1 );
+        ch->done = 1;
+        ch->status = APR_STATUS_IS_TIMEUP( rv ) ? HTTP_SERVICE_UNAVAILABLE : HTTP_INTERNAL_SERVER_ERROR;
+        if ( !auth_helper->reading ) {
+            helper_close( auth_helper, 1 );
+        }
+    }
+
+    while ( !ch->done ) {
+        if ( !auth_helper->reading ) {
+            auth_helper->reading = 1;
+            POOL_UNLOCK( hp->mutex );
+            rv = helper_read_line( auth_helper, r->pool, crec->max_token_size, &line, deadline );
+            POOL_LOCK( hp->mutex );
+            auth_helper->reading = 0;
+
+            if ( rv == APR_SUCCESS ) {
+                helper_dispatch( r, auth_helper, line );
+            } else {
+                if ( APR_STATUS_IS_TIMEUP( rv )) {
+                    apr_uint32_t timeouts = apr_atomic_inc32( &global_ntlm_context.helper_timeouts ) + 1;
+
+                    RERROR( rv, "timed out reading from %s helper %d, killing it (%u helper timeouts in this child)",
+                            hp->name, auth_helper->helper_pid, timeouts );
+                    STAT_INC( helper_timeouts[hp->scheme] );
+                    apr_proc_kill( auth_helper->proc, SIGKILL );
+                } else {
+                    RERROR( rv, "%s helper %d died with %d requests outstanding",
+                            hp->name, auth_helper->helper_pid, auth_helper->outstanding );
+                }
+                helper_close( auth_helper, 1 );
+                if ( APR_STATUS_IS_TIMEUP( rv )) {
+                    ch->status = HTTP_SERVICE_UNAVAILABLE;
+                }
+            }
+            /* let the next waiter take over reading */
+            apr_thread_cond_broadcast( auth_helper->chan_cond );
+            continue;
+        }
+
+        if ( deadline == 0 ) {
+            apr_thread_cond_wait( auth_helper->chan_cond, hp->mutex );
+        } else if ( apr_time_now() < deadline ) {
+            apr_thread_cond_timedwait( auth_helper->chan_cond, hp->mutex, deadline - apr_time_now());
+        } else {
+            /* the reader will time out too and kill the helper */
+            RERROR( APR_TIMEUP, "gave up waiting for %s helper %d", hp->name, auth_helper->helper_pid );
+            ch->pool = NULL;
+            POOL_UNLOCK( hp->mutex );
+            return HTTP_SERVICE_UNAVAILABLE;
+        }
+    }
+
+    result = ch->status;
+    *reply = ch->reply;
+    ch->in_use = 0;
+    if ( --auth_helper->outstanding == 0 ) {
+        auth_helper->idle_since = apr_time_now();
+    }
+    if ( auth_helper->state == HELPER_READY && auth_helper->outstanding == 0
+         && !auth_helper->reading && helper_expired( auth_helper )) {
+        helper_close( auth_helper, 0 );
+    }
+    apr_thread_cond_signal( hp->cond );
+    POOL_UNLOCK( hp->mutex );
+
+    if ( result == OK ) {
+        RDEBUG( "got response on channel %d: %s", id, *reply );
+        stats_helper_latency( hp->scheme, start );
+    }
+
+    return result;
+}
+#endif
+
+#ifdef APACHE2
+/* Send a line that every helper can answer without asking a domain
+   controller, to prove it started and speaks the protocol. */
+static int helper_probe( server_rec *s, struct _ntlm_auth_helper *auth_helper ) {
+    /* the basic helper answers ERR to a line without a password; the
+       NTLMSSP and SPNEGO helpers answer a bare YR from local state */
+    const char *probe = strcmp( auth_helper->owner->name, "plaintext" ) == 0 ? "probe\n" : "YR\n";
+    char *reply;
+    const char *answer;
+    struct iovec vec;
+    struct helper_reply parsed;
+    apr_time_t deadline = helper_deadline( HELPER_PROBE_TIMEOUT );
+    long id;
+
+    if ( auth_helper->owner->concurrency > 0 ) {
+        probe = "0 probe\n";
+    }
+    vec.iov_base = (char *) probe;
+    vec.iov_len = strlen( probe );
+
+    /* the reply is a few bytes, left in the helper's pool */
+    if ( helper_writev( auth_helper, &vec, 1, deadline ) != APR_SUCCESS
+         || helper_read_line( auth_helper, auth_helper->pool, DEFAULT_MAX_TOKEN_SIZE,
+                              &reply, deadline ) != APR_SUCCESS
+         || strlen( reply ) < 2 ) {
+        SERROR( APR_EGENERAL, "%s helper %d did not answer its warm-up request",
+                auth_helper->owner->name, auth_helper->helper_pid );
+        return 0;
+    }
+    answer = reply;
+    if ( auth_helper->owner->concurrency > 0 && helper_channel_parse( reply, &id, &answer ) != 0 ) {
+        SERROR( APR_EGENERAL, "%s helper %d answered its warm-up request without a channel ID: %s",
+                auth_helper->owner->name, auth_helper->helper_pid, reply );
+        return 0;
+    }
+    helper_reply_parse( apr_pstrdup( auth_helper->pool, answer ), HELPER_FIELDS_BASIC, &parsed );
+    if ( parsed.code == HELPER_BH ) {
+        SERROR( APR_EGENERAL, "%s helper %d reports Broken Helper: %s",
+                auth_helper->owner->name, auth_helper->helper_pid, reply );
+        STAT_INC( helper_bh[auth_helper->owner->scheme] );
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Start helpers before the child takes any requests, so nobody pays
+   for the fork and winbind connection on the request path */
+static void helper_prespawn( server_rec *s, struct _ntlm_helper_pool *hp, int count ) {
+    struct _ntlm_auth_helper *auth_helper;
+    int i, started = 0;
+
+    for ( i = 0; i < hp->max && started < count; i++ ) {
+        auth_helper = &hp->helpers[i];
+
+        POOL_LOCK( hp->mutex );
+        if ( auth_helper->state != HELPER_EMPTY ) {
+            POOL_UNLOCK( hp->mutex );
+            continue;
+        }
+        auth_helper->state = HELPER_SPAWNING;
+        hp->count++;
+        POOL_UNLOCK( hp->mutex );
+
+        if ( !spawn_auth_helper( s, NULL, auth_helper )) {
+            POOL_LOCK( hp->mutex );
+            auth_helper->state = HELPER_EMPTY;
+            hp->count--;
+            helper_backoff( auth_helper );
+            POOL_UNLOCK( hp->mutex );
+            break;
+        }
+
+        POOL_LOCK( hp->mutex );
+        auth_helper->state = HELPER_READY;
+        POOL_UNLOCK( hp->mutex );
+
+        if ( !helper_probe( s, auth_helper )) {
+            apr_proc_kill( auth_helper->proc, SIGKILL );
+            helper_discard( auth_helper );
+            break;
+        }
+        started++;
+    }
+
+    SDEBUG( "prespawned %d of %d %s helpers", started, count, hp->name );
+}
+#endif
+
+#if defined(APACHE2) && APR_HAS_THREADS
+#if defined(NTLM_HAVE_STATUS) && defined(__linux__)
+/* Resident size of a helper process in kB, 0 if it can't be told */
+static apr_uint32_t helper_rss_kb( int pid ) {
+    char path[32], buf[64];
+    unsigned long size, resident;
+    ssize_t n;
+    int fd;
+
+    apr_snprintf( path, sizeof( path ), "/proc/%d/statm", pid );
+    if (( fd = open( path, O_RDONLY )) < 0 ) {
+        return 0;
+    }
+    n = read( fd, buf, sizeof( buf ) - 1 );
+    close( fd );
+    if ( n <= 0 ) {
+        return 0;
+    }
+    buf[n] = '\0';
+    if ( sscanf( buf, "%lu %lu", &size, &resident ) != 2 ) {
+        return 0;
+    }
+    return (apr_uint32_t)( resident * ( sysconf( _SC_PAGESIZE ) / 1024 ));
+}
+#else
+#define helper_rss_kb( pid ) 0
+#endif
+
+/* Once a second, in a child or the broker: stop helpers that sat idle
+   for longer than NTLMAuthHelperIdleTimeout while their pool is above
+   its minimum, start helpers to bring a pool back up to its minimum,
+   and note how much memory the helpers take up. */
+static void helper_maintain( server_rec *s ) {
+    struct _ntlm_helper_pool *hp;
+    apr_uint32_t rss[SCHEMES];
+    apr_time_t now;
+    int i;
+
+    helper_reap();
+    memset( rss, 0, sizeof( rss ));
+
+    POOL_LOCK( global_ntlm_context.mutex );
+    hp = global_ntlm_context.helper_pools;
+    POOL_UNLOCK( global_ntlm_context.mutex );
+
+    /* pools are only ever added at the head, so the rest of the list
+       can be walked without the lock */
+    for ( ; hp != NULL; hp = hp->next ) {
+        POOL_LOCK( hp->mutex );
+        now = apr_time_now();
+        for ( i = 0; i < hp->max; i++ ) {
+            struct _ntlm_auth_helper *h = &hp->helpers[i];
+
+            if ( h->state != HELPER_READY ) {
+                continue;
+            }
+            if ( hp->idle_timeout && hp->count > hp->min
+                 && !h->leased && h->outstanding == 0 && !h->reading
+                 && h->idle_since + apr_time_from_sec( hp->idle_timeout ) <= now ) {
+                SDEBUG( "stopping %s helper %d, idle for %ds (%d running)", hp->name, h->helper_pid,
+                        (int) apr_time_sec( now - h->idle_since ), hp->count );
+                STAT_INC( helper_idle_stops[hp->scheme] );
+                helper_close( h, 0 );
+                continue;
+            }
+            rss[hp->scheme] += helper_rss_kb( h->helper_pid );
+        }
+        for ( i = 0; i < hp->max && hp->count < hp->min; i++ ) {
+            struct _ntlm_auth_helper *h = &hp->helpers[i];
+
+            /* the lock is dropped while it starts, so look again after */
+            if ( h->state == HELPER_EMPTY && h->respawn_at <= apr_time_now() && h->outstanding == 0
+                 && helper_spawn_locked( s, NULL, h )) {
+                rss[hp->scheme] += helper_rss_kb( h->helper_pid );
+            }
+        }
+        POOL_UNLOCK( hp->mutex );
+    }
+
+#ifdef NTLM_HAVE_STATUS
+    if ( stats_mine != NULL ) {
+        for ( i = 0; i < SCHEMES; i++ ) {
+            apr_atomic_set32( &stats_mine->helper_rss_kb[i], rss[i] );
+        }
+    }
+#endif
+}
+
+/* A child's maintenance thread; the broker calls helper_maintain()
+   from its accept loop instead */
+static void * APR_THREAD_FUNC helper_maintenance_thread( apr_thread_t *thd, void *data ) {
+    server_rec *s = data;
+
+    POOL_LOCK( global_ntlm_context.mutex );
+    while ( !global_ntlm_context.maintenance_stop ) {
+        apr_thread_cond_timedwait( global_ntlm_context.maintenance_cond, global_ntlm_context.mutex,
+                                   apr_time_from_sec( 1 ));
+        if ( global_ntlm_context.maintenance_stop ) {
+            break;
+        }
+        POOL_UNLOCK( global_ntlm_context.mutex );
+        helper_maintain( s );
+        POOL_LOCK( global_ntlm_context.mutex );
+    }
+    POOL_UNLOCK( global_ntlm_context.mutex );
+
+    return NULL;
+}
+
+/* Runs before the child's pools go, helper pools included */
+static apr_status_t helper_maintenance_stop( void *data ) {
+    apr_status_t rv;
+
+    POOL_LOCK( global_ntlm_context.mutex );
+    global_ntlm_context.maintenance_stop = 1;
+    apr_thread_cond_signal( global_ntlm_context.maintenance_cond );
+    POOL_UNLOCK( global_ntlm_context.mutex );
+    apr_thread_join( &rv, global_ntlm_context.maintenance_thread );
+
+    return APR_SUCCESS;
+}
+
+static void helper_maintenance_start( apr_pool_t *p, server_rec *s ) {
+    apr_status_t rv;
+
+    global_ntlm_context.maintenance_stop = 0;
+    apr_thread_cond_create( &global_ntlm_context.maintenance_cond, global_ntlm_context.pool );
+    rv = apr_thread_create( &global_ntlm_context.maintenance_thread, NULL, helper_maintenance_thread, s, p );
+    if ( rv != APR_SUCCESS ) {
+        SERROR( rv, "couldn't start the helper maintenance thread; idle helpers won't be stopped" );
+        return;
+    }
+    apr_pool_pre_cleanup_register( p, NULL, helper_maintenance_stop );
+}
+#endif
+
+#ifdef NTLM_HAVE_LAUNCHER
+/* For the launcher and the broker: the MPM's handlers, if this is a
+   restart, are no use in a process of our own */
+static void ntlm_daemon_signals( void ) {
+    sigset_t sigs;
+
+    apr_signal( SIGTERM, SIG_DFL );
+    apr_signal( SIGHUP, SIG_DFL );
+    apr_signal( AP_SIG_GRACEFUL, SIG_DFL );
+#ifdef AP_SIG_GRACEFUL_STOP
+    apr_signal( AP_SIG_GRACEFUL_STOP, SIG_DFL );
+#endif
+    apr_signal( SIGCHLD, SIG_DFL );
+    sigemptyset( &sigs );
+    sigprocmask( SIG_SETMASK, &sigs, NULL );
+}
+
+/* In the launcher: point argv at a request's arguments, in place.
+   Returns argc, or -1 if the request is malformed. */
+static int launcher_argv( char *buf, apr_size_t len, char **argv ) {
+    struct _launch_request req;
+    char *p = buf + sizeof( req ), *end = buf + len;
+    apr_uint32_t i;
+
+    if ( len <= sizeof( req )) {
+        return -1;
+    }
+    memcpy( &req, buf, sizeof( req ));
+    if ( req.argc < 1 || req.argc > LAUNCHER_MAX_ARGS || req.len != len - sizeof( req )
+         || end[-1] != '\0' ) {
+        return -1;
+    }
+    for ( i = 0; i < req.argc; i++ ) {
+        if ( p >= end ) {
+            return -1;
+        }
+        argv[i] = p;
+        p += strlen( p ) + 1;
+    }
+    argv[i] = NULL;
+
+    return p == end ? (int) i : -1;
+}
+
+/* In the launcher: start a helper with its stdin and stdout on pipes,
+   whose other ends are put in fds.  Returns 0, or the errno of the
+   pipe, fork or exec that failed. */
+static int launcher_exec( char **argv, int *fds, pid_t *pid ) {
+    int in[2], out[2], status[2], err = 0;
+    ssize_t n;
+
+    if ( pipe( in ) != 0 ) {
+        return errno;
+    }
+    if ( pipe( out ) != 0 ) {
+        err = errno;
+        close( in[0] );
+        close( in[1] );
+        return err;
+    }
+    if ( pipe( status ) != 0 ) {
+        err = errno;
+        close( in[0] );
+        close( in[1] );
+        close( out[0] );
+        close( out[1] );
+        return err;
+    }
+    /* closed by a successful exec, so anything read from it is exec's errno */
+    fcntl( status[1], F_SETFD, FD_CLOEXEC );
+
+    if (( *pid = fork()) == 0 ) {
+        dup2( in[0], STDIN_FILENO );
+        dup2( out[1], STDOUT_FILENO );
+        close( in[0] );
+        close( in[1] );
+        close( out[0] );
+        close( out[1] );
+        close( status[0] );
+        apr_signal( SIGCHLD, SIG_DFL );
+        /* what apr_proc_create() would close: httpd's listeners, logs
+           and the like */
+        apr_pool_cleanup_for_exec();
+        execvp( argv[0], argv );
+        err = errno;
+        if ( write( status[1], &err, sizeof( err )) < 0 ) {
+            /* nobody left to tell */
+        }
+        _exit( 1 );
+    }
+
+    close( in[0] );
+    close( out[1] );
+    close( status[1] );
+    if ( *pid < 0 ) {
+        err = errno;
+    } else {
+        do {
+            n = read( status[0], &err, sizeof( err ));
+        } while ( n < 0 && errno == EINTR );
+        if ( n != sizeof( err )) {
+            err = 0;
+        }
+    }
+    close( status[0] );
+    if ( err != 0 ) {
+        close( in[1] );
+        close( out[0] );
+        return err;
+    }
+    fds[0] = in[1];
+    fds[1] = out[0];
+
+    return 0;
+}
+
+/* The launcher process: small, single-threaded, and running as User */
+static void launcher_main( server_rec *s, apr_pool_t *pconf, int sock ) {
+    char buf[LAUNCHER_MAX_REQUEST];
+    char *argv[LAUNCHER_MAX_ARGS + 1];
+    struct _launch_reply rep;
+    struct pollfd pfd;
+    apr_size_t len;
+    apr_pool_t *p;
+    int reply, nfds, fds[2];
+    pid_t pid;
+
+    ntlm_daemon_signals();
+    /* the helpers are reaped as they exit */
+    apr_signal( SIGCHLD, SIG_IGN );
+
+    apr_pool_create( &p, pconf );
+    if ( ap_run_drop_privileges( p, s ) != 0 ) {
+        SERROR( APR_EGENERAL, "helper launcher: couldn't switch to User" );
+        exit( 1 );
+    }
+
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    for (;;) {
+        if ( getppid() != launcher_parent ) {
+            /* httpd went away without stopping us */
+            exit( 0 );
+        }
+        if ( poll( &pfd, 1, 1000 ) <= 0 ) {
+            continue;
+        }
+        len = sizeof( buf );
+        if ( fd_recv( sock, buf, &len, &reply, 1, &nfds ) != APR_SUCCESS || nfds != 1 ) {
+            continue;
+        }
+
+        memset( &rep, 0, sizeof( rep ));
+        if ( launcher_argv( buf, len, argv ) < 0 ) {
+            rep.err = EINVAL;
+        } else if (( rep.err = launcher_exec( argv, fds, &pid )) == 0 ) {
+            rep.pid = pid;
+        }
+        /* a child that gave up waiting has closed its end; never mind */
+        fd_send( reply, &rep, sizeof( rep ), fds, rep.pid ? 2 : 0 );
+        if ( rep.pid ) {
+            close( fds[0] );
+            close( fds[1] );
+        }
+        close( reply );
+    }
+}
+
+/* Runs in the children too, which keep their end */
+static apr_status_t launcher_cleanup( void *data ) {
+    if ( getpid() == launcher_parent && launcher_fd >= 0 ) {
+        close( launcher_fd );
+        launcher_fd = -1;
+    }
+    return APR_SUCCESS;
+}
+
+/* Fork the launcher before the other modules' post_config hooks make
+   the parent any bigger */
+static int launcher_post_config( apr_pool_t *pconf, apr_pool_t *plog,
+                                 apr_pool_t *ptemp, server_rec *s )
+{
+    apr_proc_t *proc;
+    apr_status_t rv;
+    int sv[2];
+
+    launcher_lost = 0;
+    /* the first pass over the configuration only checks it */
+    if ( !launcher_on || ap_state_query( AP_SQ_MAIN_STATE ) == AP_SQ_MS_CREATE_PRE_CONFIG ) {
+        return OK;
+    }
+
+    if ( socketpair( AF_UNIX, SOCK_DGRAM, 0, sv ) != 0 ) {
+        SERROR( errno, "couldn't create the helper launcher's socket" );
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    fcntl( sv[0], F_SETFD, FD_CLOEXEC );
+    fcntl( sv[1], F_SETFD, FD_CLOEXEC );
+
+    launcher_parent = getpid();
+    proc = apr_pcalloc( pconf, sizeof( apr_proc_t ));
+    rv = apr_proc_fork( proc, pconf );
+    if ( rv == APR_INCHILD ) {
+        close( sv[1] );
+        launcher_main( s, pconf, sv[0] );
+        exit( 0 );
+    } else if ( rv != APR_INPARENT ) {
+        SERROR( rv, "couldn't start the helper launcher; children will fork helpers themselves" );
+        close( sv[0] );
+        close( sv[1] );
+        return OK;
+    }
+
+    close( sv[0] );
+    launcher_fd = sv[1];
+    /* signalled, and waited for, when pconf goes */
+    apr_pool_note_subprocess( pconf, proc, APR_KILL_AFTER_TIMEOUT );
+    apr_pool_cleanup_register( pconf, NULL, launcher_cleanup, apr_pool_cleanup_null );
+
+    return OK;
+}
+#endif
+
+#ifdef NTLM_HAVE_BROKER
+/* May the broker run this helper command line for us? */
+static int broker_serves( const char *cmd ) {
+    return broker_on && apr_hash_get( broker_cmds, cmd, APR_HASH_KEY_STRING ) != NULL;
+}
+
+/* An idle connection to the broker, or a new one; *fresh says which */
+static apr_status_t broker_conn_get( struct _broker_conn **bcp, int *fresh ) {
+    struct _broker_conn *bc;
+    struct sockaddr_un sa;
+    int fd;
+
+    POOL_LOCK( global_ntlm_context.mutex );
+    if (( bc = broker_idle ) != NULL ) {
+        broker_idle = bc->next;
+    }
+    POOL_UNLOCK( global_ntlm_context.mutex );
+    if (( *bcp = bc ) != NULL ) {
+        *fresh = 0;
+        return APR_SUCCESS;
+    }
+
+    *fresh = 1;
+    memset( &sa, 0, sizeof( sa ));
+    sa.sun_family = AF_UNIX;
+    apr_cpystrn( sa.sun_path, broker_path, sizeof( sa.sun_path ));
+    if (( fd = socket( AF_UNIX, SOCK_STREAM, 0 )) < 0 ) {
+        return errno;
+    }
+    if ( connect( fd, (struct sockaddr *) &sa, sizeof( sa )) != 0 ) {
+        apr_status_t rv = errno;
+
+        close( fd );
+        return rv;
+    }
+    /* helpers the child starts must not inherit it */
+    fcntl( fd, F_SETFD, FD_CLOEXEC );
+    fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK );
+
+    POOL_LOCK( global_ntlm_context.mutex );
+    if (( bc = broker_spare ) != NULL ) {
+        broker_spare = bc->next;
+    } else {
+        bc = apr_palloc( global_ntlm_context.pool, sizeof( struct _broker_conn ));
+    }
+    POOL_UNLOCK( global_ntlm_context.mutex );
+    bc->fd = fd;
+    *bcp = bc;
+
+    return APR_SUCCESS;
+}
+
+/* Keep a connection for the next request, or close it if its stream
+   of requests and answers may be out of step */
+static void broker_conn_put( struct _broker_conn *bc, int keep ) {
+    POOL_LOCK( global_ntlm_context.mutex );
+    if ( keep ) {
+        bc->next = broker_idle;
+        broker_idle = bc;
+    } else {
+        close( bc->fd );
+        bc->next = broker_spare;
+        broker_spare = bc;
+    }
+    POOL_UNLOCK( global_ntlm_context.mutex );
+}
+
+/* Send a request to the broker and read the head of its answer.  An
+   idle connection may be to a broker that has since been restarted,
+   so a failure on one is tried again on a new connection.  On success
+   the rest of the answer waits on *bcp. */
+static apr_status_t broker_exchange( struct _broker_request *req, const char *cmd,
+                                     const struct iovec *line, int nline,
+                                     struct _broker_reply *rep, apr_time_t deadline,
+                                     struct _broker_conn **bcp ) {
+    struct iovec vec[HELPER_REQUEST_VECS + 2];
+    apr_status_t rv;
+    int fresh;
+
+    do {
+        if (( rv = broker_conn_get( bcp, &fresh )) != APR_SUCCESS ) {
+            return rv;
+        }
+        vec[0].iov_base = (char *) req;
+        vec[0].iov_len = sizeof( *req );
+        vec[1].iov_base = (char *) cmd;
+        vec[1].iov_len = req->cmd_len;
+        if ( nline > 0 ) {
+            memcpy( vec + 2, line, nline * sizeof( struct iovec ));
+        }
+        rv = fd_writev( (*bcp)->fd, vec, nline + 2, deadline );
+        if ( rv == APR_SUCCESS ) {
+            rv = fd_read_full( (*bcp)->fd, rep, sizeof( *rep ), deadline );
+        }
+        if ( rv != APR_SUCCESS ) {
+            broker_conn_put( *bcp, 0 );
+        }
+    } while ( rv != APR_SUCCESS && !fresh && !APR_STATUS_IS_TIMEUP( rv ));
+
+    return rv;
+}
+
+/* Have the broker's helper answer a request line, given in pieces, as
+   helper_transact() would.  conn names the handshake the line belongs
+   to, and first says it starts one.  Returns OK with the reply in
+   r->pool, or the HTTP status to give the client; HTTP_UNAUTHORIZED
+   means the handshake's helper was lost and the client must start
+   again. */
+static int broker_transact( request_rec *r, ntlm_config_rec *crec, int scheme,
+                            const char *cmd, apr_uint64_t conn, int first,
+                            const struct iovec *line, int nline, char **reply ) {
+    struct _broker_request req;
+    struct _broker_reply rep;
+    struct _broker_conn *bc;
+    apr_time_t start = apr_time_now(), deadline = 0;
+    apr_status_t rv;
+    int i;
+
+    memset( &req, 0, sizeof( req ));
+    req.conn = conn;
+    req.op = BROKER_LEG;
+    req.scheme = scheme;
+    req.first = first;
+    req.cmd_len = strlen( cmd );
+    for ( i = 0; i < nline; i++ ) {
+        req.line_len += line[i].iov_len;
+    }
+    if ( crec->helper_read_timeout ) {
+        /* the broker may have to wait for a helper before it can ask it */
+        deadline = helper_deadline( crec->handshake_timeout + crec->helper_write_timeout
+                                    + crec->helper_read_timeout );
+    }
+
+    rv = broker_exchange( &req, cmd, line, nline, &rep, deadline, &bc );
+    if ( rv != APR_SUCCESS ) {
+        RERROR( rv, "lost the helper broker at %s", broker_path );
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
+    if ( rep.status != OK ) {
+        broker_conn_put( bc, 1 );
+        return rep.status;
+    }
+    if ( rep.len > (apr_uint32_t) crec->max_token_size ) {
+        RERROR( APR_ENOSPC, "the helper broker sent a reply longer than NTLMAuthMaxTokenSize (%d)",
+                crec->max_token_size );
+        broker_conn_put( bc, 0 );
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    *reply = apr_palloc( r->pool, rep.len + 1 );
+    if (( rv = fd_read_full( bc->fd, *reply, rep.len, deadline )) != APR_SUCCESS ) {
+        RERROR( rv, "lost the helper broker at %s", broker_path );
+        broker_conn_put( bc, 0 );
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
+    (*reply)[rep.len] = '\0';
+    broker_conn_put( bc, 1 );
+
+    RDEBUG( "got response from the broker: %s", *reply );
+    stats_helper_latency( scheme, start );
+
+    return OK;
+}
+
+/* A handshake's ID, unique across children */
+static apr_uint64_t broker_conn_id( ntlm_connection_context_t *ctxt ) {
+    if ( ctxt->broker_conn == 0 ) {
+        ctxt->broker_conn = ((apr_uint64_t) getpid() << 32)
+            | ( apr_atomic_inc32( &broker_conn_seq ) + 1 );
+    }
+    return ctxt->broker_conn;
+}
+
+/* Let the broker have back the helper of a handshake whose connection
+   is going away.  There is no request to log against. */
+static apr_status_t cleanup_connection_broker( void *ctxt_v ) {
+    ntlm_connection_context_t *ctxt = ctxt_v;
+    struct _broker_request req;
+    struct _broker_reply rep;
+    struct _broker_conn *bc;
+
+    memset( &req, 0, sizeof( req ));
+    req.conn = ctxt->broker_conn;
+    req.op = BROKER_END;
+    if ( broker_exchange( &req, "", NULL, 0, &rep, helper_deadline( 1 ), &bc ) == APR_SUCCESS ) {
+        broker_conn_put( bc, 1 );
+    }
+    ctxt->broker_handshake = 0;
+    connection_set_backend( ctxt, NULL );
+
+    return APR_SUCCESS;
+}
+
+/* In the broker: take a handshake's helper out of the table */
+static struct _ntlm_auth_helper *broker_lease_take( apr_uint64_t conn, unsigned long *lease ) {
+    struct _ntlm_auth_helper *auth_helper = NULL;
+    struct _broker_lease *bl;
+
+    POOL_LOCK( global_ntlm_context.mutex );
+    if (( bl = apr_hash_get( broker_leases, &conn, sizeof( conn ))) != NULL ) {
+        apr_hash_set( broker_leases, &bl->conn, sizeof( conn ), NULL );
+        auth_helper = bl->helper;
+        *lease = bl->lease;
+        bl->next = broker_free_leases;
+        broker_free_leases = bl;
+    }
+    POOL_UNLOCK( global_ntlm_context.mutex );
+
+    return auth_helper;
+}
+
+/* Remember which helper holds a handshake until its next leg */
+static void broker_lease_keep( apr_uint64_t conn, struct _ntlm_auth_helper *auth_helper ) {
+    struct _broker_lease *bl;
+
+    POOL_LOCK( global_ntlm_context.mutex );
+    if (( bl = broker_free_leases ) != NULL ) {
+        broker_free_leases = bl->next;
+    } else {
+        bl = apr_palloc( global_ntlm_context.pool, sizeof( struct _broker_lease ));
+    }
+    bl->conn = conn;
+    bl->helper = auth_helper;
+    bl->lease = auth_helper->lease;
+    bl->kept_at = apr_time_now();
+    apr_hash_set( broker_leases, &bl->conn, sizeof( conn ), bl );
+    POOL_UNLOCK( global_ntlm_context.mutex );
+}
+
+/* Hand back the helpers of handshakes whose child died before ending
+   them.  NTLMAuthHandshakeTimeout lets a helper be taken from a slow
+   handshake anyway; this only keeps the table from growing. */
+static void broker_lease_sweep( void ) {
+    apr_time_t cutoff = apr_time_now()
+        - apr_time_from_sec( 2 * broker_crec->handshake_timeout + 60 );
+    struct _broker_lease *bl, *stale = NULL;
+    struct _ntlm_auth_helper *auth_helper;
+    apr_hash_index_t *hi;
+    void *val;
+
+    POOL_LOCK( global_ntlm_context.mutex );
+    for ( hi = apr_hash_first( NULL, broker_leases ); hi != NULL; hi = apr_hash_next( hi )) {
+        apr_hash_this( hi, NULL, NULL, &val );
+        bl = val;
+        if ( bl->kept_at < cutoff ) {
+            apr_hash_set( broker_leases, &bl->conn, sizeof( bl->conn ), NULL );
+            bl->next = stale;
+            stale = bl;
+        }
+    }
+    POOL_UNLOCK( global_ntlm_context.mutex );
+
+    /* not under the global mutex, which helper_release() may take */
+    for ( bl = stale; bl != NULL; bl = bl->next ) {
+        if (( auth_helper = helper_resume( bl->helper, bl->lease )) != NULL ) {
+            helper_release( auth_helper );
+        }
+    }
+    if ( stale != NULL ) {
+        POOL_LOCK( global_ntlm_context.mutex );
+        for ( bl = stale; bl->next != NULL; bl = bl->next )
+            ;
+        bl->next = broker_free_leases;
+        broker_free_leases = stale;
+        POOL_UNLOCK( global_ntlm_context.mutex );
+    }
+}
+
+/* In the broker: answer one request from a child.  Returns OK with the
+   helper's reply in p, or the HTTP status for the child to use. */
+static int broker_handle( server_rec *s, apr_pool_t *p, struct _broker_request *req,
+                          const char *cmd, char *line, char **reply ) {
+    static const char *const names[] = { "ntlm", "negotiate", "plaintext" };
+    static const int fields[] = { HELPER_FIELDS_NTLMSSP, HELPER_FIELDS_SPNEGO, HELPER_FIELDS_BASIC };
+    struct _ntlm_helper_pool *hp;
+    struct _ntlm_auth_helper *auth_helper = NULL, *held = NULL;
+    struct helper_reply parsed;
+    struct iovec vec;
+    unsigned long lease = 0;
+    apr_status_t rv;
+
+    if ( req->op == BROKER_END ) {
+        if (( held = broker_lease_take( req->conn, &lease )) != NULL
+            && ( auth_helper = helper_resume( held, lease )) != NULL ) {
+            helper_release( auth_helper );
+        }
+        return OK;
+    }
+
+    /* one line, as the child builds it; anything else would leave the
+       helper's replies out of step with its requests */
+    if ( req->op != BROKER_LEG || req->scheme > SCHEME_BASIC
+         || apr_hash_get( broker_cmds, cmd, APR_HASH_KEY_STRING ) == NULL
+         || req->line_len == 0 || line[req->line_len - 1] != '\n'
+         || memchr( line, '\n', req->line_len - 1 ) != NULL ) {
+        SERROR( APR_EGENERAL, "helper broker: refusing a request for %s", cmd );
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    hp = get_helper_pool( names[req->scheme], (char *) cmd, broker_helpers, 0, broker_crec );
+
+    /* put back below if the handshake goes on */
+    if ( req->conn != 0 ) {
+        held = broker_lease_take( req->conn, &lease );
+    }
+    if ( held != NULL && ( auth_helper = helper_resume( held, lease )) != NULL
+         && auth_helper->owner != hp ) {
+        helper_release( auth_helper );
+        auth_helper = NULL;
+    }
+    if ( auth_helper == NULL ) {
+        if ( !req->first ) {
+            return HTTP_UNAUTHORIZED;
+        }
+        if (( auth_helper = helper_acquire( s, NULL, hp, broker_crec->handshake_timeout )) == NULL ) {
+            return HTTP_SERVICE_UNAVAILABLE;
+        }
+    }
+
+    vec.iov_base = line;
+    vec.iov_len = req->line_len;
+    rv = helper_writev( auth_helper, &vec, 1, helper_deadline( broker_crec->helper_write_timeout ));
+    if ( rv == APR_SUCCESS ) {
+        rv = helper_read_line( auth_helper, p, broker_crec->max_token_size, reply,
+                               helper_deadline( broker_crec->helper_read_timeout ));
+    }
+    if ( APR_STATUS_IS_TIMEUP( rv )) {
+        SERROR( rv, "helper broker: timed out talking to %s helper %d, killing it",
+                hp->name, auth_helper->helper_pid );
+        STAT_INC( helper_timeouts[hp->scheme] );
+        helper_kill( auth_helper );
+        return HTTP_SERVICE_UNAVAILABLE;
+    } else if ( rv != APR_SUCCESS || (*reply)[0] == '\0' ) {
+        SERROR( rv, "helper broker: lost %s helper %d", hp->name, auth_helper->helper_pid );
+        helper_discard( auth_helper );
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    /* the child times the round trip */
+    auth_helper->requests++;
+
+    /* the child gets the whole line, so parse a copy */
+    if ( helper_reply_parse( apr_pstrdup( p, *reply ), fields[req->scheme], &parsed ) != 0 ) {
+        parsed.code = HELPER_UNKNOWN;
+    }
+    switch ( parsed.code ) {
+    case HELPER_TT:
+        if ( req->conn != 0 ) {
+            helper_suspend( auth_helper );
+            broker_lease_keep( req->conn, auth_helper );
+            break;
+        }
+        helper_release( auth_helper );
+        break;
+    case HELPER_AF:
+    case HELPER_NA:
+    case HELPER_OK:
+    case HELPER_ERR:
+        helper_release( auth_helper );
+        break;
+    case HELPER_BH:
+        STAT_INC( helper_bh[hp->scheme] );
+        /* fall through */
+    default:
+        helper_discard( auth_helper );
+        break;
+    }
+
+    return OK;
+}
+
+/* In the broker: serve one child's connection until the child closes
+   it.  Each thread has its own connection, so reads can block. */
+static void * APR_THREAD_FUNC broker_serve( apr_thread_t *thd, void *data ) {
+    server_rec *s = broker_server;
+    int fd = (int)(apr_intptr_t) data;
+    struct _broker_request req;
+    struct _broker_reply rep;
+    struct iovec vec[2];
+    char *cmd, *line, *reply;
+    apr_pool_t *p;
+
+    apr_pool_create( &p, NULL );
+    while ( fd_read_full( fd, &req, sizeof( req ), 0 ) == APR_SUCCESS ) {
+        if ( req.cmd_len > BROKER_MAX_CMD
+             || req.line_len > (apr_uint32_t) broker_crec->max_token_size + HUGE_STRING_LEN ) {
+            SERROR( APR_ENOSPC, "helper broker: oversized request, dropping the connection" );
+            break;
+        }
+        cmd = apr_palloc( p, req.cmd_len + 1 );
+        line = apr_palloc( p, req.line_len + 1 );
+        if ( fd_read_full( fd, cmd, req.cmd_len, 0 ) != APR_SUCCESS
+             || fd_read_full( fd, line, req.line_len, 0 ) != APR_SUCCESS ) {
+            break;
+        }
+        cmd[req.cmd_len] = '\0';
+        line[req.line_len] = '\0';
+
+        reply = NULL;
+        rep.status = broker_handle( s, p, &req, cmd, line, &reply );
+        rep.len = rep.status == OK && reply != NULL ? strlen( reply ) : 0;
+        vec[0].iov_base = (char *) &rep;
+        vec[0].iov_len = sizeof( rep );
+        vec[1].iov_base = reply;
+        vec[1].iov_len = rep.len;
+        if ( fd_writev( fd, vec, 2, 0 ) != APR_SUCCESS ) {
+            break;
+        }
+        apr_pool_clear( p );
+    }
+    close( fd );
+    apr_pool_destroy( p );
+
+    return NULL;
+}
+
+static void ntlm_context_init( apr_pool_t *p, ntlm_server_config_rec *srec );
+static void prespawn_configured( server_rec *s, int max_override );
+
+/* The broker process: runs as User, like a child, and serves children
+   until httpd goes away or stops it */
+static void broker_main( server_rec *s ) {
+    ntlm_server_config_rec *srec =
+        ap_get_module_config( s->module_config, &auth_ntlm_winbind_module );
+    apr_threadattr_t *attr;
+    apr_thread_t *thd;
+    apr_time_t swept = apr_time_now();
+    struct pollfd pfd;
+    apr_pool_t *p;
+    int fd;
+
+    ntlm_daemon_signals();
+    apr_signal( SIGPIPE, SIG_IGN );
+
+    apr_pool_create( &p, broker_pconf );
+    if ( ap_run_drop_privileges( p, s ) != 0 ) {
+        SERROR( APR_EGENERAL, "helper broker: couldn't switch to User" );
+        exit( 1 );
+    }
+
+    ntlm_context_init( p, srec );
+#ifdef NTLM_HAVE_STATUS
+    stats_child_init();
+#endif
+    broker_crec = ap_get_module_config( s->lookup_defaults, &auth_ntlm_winbind_module );
+    broker_leases = apr_hash_make( p );
+    prespawn_configured( s, broker_helpers );
+
+    apr_threadattr_create( &attr, p );
+    apr_threadattr_detach_set( attr, 1 );
+    SDEBUG( "helper broker %d listening on %s", (int) getpid(), broker_path );
+
+    pfd.fd = broker_listen;
+    pfd.events = POLLIN;
+    for (;;) {
+        if ( getppid() != broker_parent ) {
+            /* httpd went away without stopping us */
+            exit( 0 );
+        }
+        if ( apr_time_now() - swept > apr_time_from_sec( 1 )) {
+            helper_maintain( s );
+            broker_lease_sweep();
+            swept = apr_time_now();
+        }
+        if ( poll( &pfd, 1, 1000 ) <= 0 ) {
+            continue;
+        }
+        if (( fd = accept( broker_listen, NULL, NULL )) < 0 ) {
+            continue;
+        }
+        fcntl( fd, F_SETFD, FD_CLOEXEC );
+        if ( apr_thread_create( &thd, attr, broker_serve, (void *)(apr_intptr_t) fd, p ) != APR_SUCCESS ) {
+            SERROR( APR_EGENERAL, "helper broker: couldn't start a thread for a child" );
+            close( fd );
+        }
+    }
+}
+
+static apr_status_t broker_start( void );
+
+/* Start a new broker if the last one died, unless httpd is stopping */
+static void broker_maintenance( int reason, void *data, int status ) {
+    apr_proc_t *proc = data;
+    server_rec *s = broker_server;
+
+    switch ( reason ) {
+    case APR_OC_REASON_DEATH:
+    case APR_OC_REASON_LOST:
+        apr_proc_other_child_unregister( data );
+        if ( broker_listen >= 0 ) {
+            SERROR( APR_EGENERAL, "helper broker %d went away, starting another",
+                    (int) proc->pid );
+            broker_start();
+        }
+        break;
+    case APR_OC_REASON_RESTART:
+        /* pconf's cleanup stops it */
+        apr_proc_other_child_unregister( data );
+        break;
+    default:
+        break;
+    }
+}
+
+static apr_status_t broker_start( void ) {
+    server_rec *s = broker_server;
+    apr_proc_t *proc = apr_pcalloc( broker_pconf, sizeof( apr_proc_t ));
+    apr_status_t rv = apr_proc_fork( proc, broker_pconf );
+
+    if ( rv == APR_INCHILD ) {
+        broker_main( s );
+        exit( 0 );
+    } else if ( rv != APR_INPARENT ) {
+        SERROR( rv, "couldn't start the helper broker" );
+        return rv;
+    }
+    /* signalled, and waited for, when pconf goes */
+    apr_pool_note_subprocess( broker_pconf, proc, APR_KILL_AFTER_TIMEOUT );
+    apr_proc_other_child_register( proc, broker_maintenance, proc, NULL, broker_pconf );
+
+    return APR_SUCCESS;
+}
+
+/* Runs in the children too, which must leave the socket alone */
+static apr_status_t broker_cleanup( void *data ) {
+    if ( getpid() == broker_parent && broker_listen >= 0 ) {
+        close( broker_listen );
+        broker_listen = -1;
+        unlink( broker_path );
+    }
+    return APR_SUCCESS;
+}
+
+/* Every helper named in the server configuration may be run by the
+   broker: the directives themselves record those in sections, and
+   these are the ones servers fall back on */
+static void broker_allow_defaults( server_rec *s ) {
+    ntlm_config_rec *crec;
+    int i, j;
+
+    for ( ; s != NULL; s = s->next ) {
+        crec = ap_get_module_config( s->lookup_defaults, &auth_ntlm_winbind_module );
+        for ( i = 0; i < SCHEMES; i++ ) {
+            for ( j = 0; j < crec->helper_backends[i]->nelts; j++ ) {
+                apr_hash_set( broker_cmds, APR_ARRAY_IDX( crec->helper_backends[i], j, char * ),
+                              APR_HASH_KEY_STRING, crec );
+            }
+        }
+    }
+}
+
+/* Create the broker's socket, where only User can reach it, and start
+   the broker */
+static int broker_post_config( apr_pool_t *pconf, server_rec *s ) {
+    struct sockaddr_un sa;
+
+    /* the first pass over the configuration only checks it */
+    if ( !broker_on || ap_state_query( AP_SQ_MAIN_STATE ) == AP_SQ_MS_CREATE_PRE_CONFIG ) {
+        return OK;
+    }
+
+    broker_path = ap_runtime_dir_relative( pconf, broker_socket ? broker_socket
+                                                                : BROKER_DEFAULT_SOCKET );
+    if ( broker_path == NULL || strlen( broker_path ) >= sizeof( sa.sun_path )) {
+        SERROR( APR_EGENERAL, "NTLMAuthBrokerSocket %s is too long for a Unix socket",
+                broker_path ? broker_path : broker_socket );
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    memset( &sa, 0, sizeof( sa ));
+    sa.sun_family = AF_UNIX;
+    apr_cpystrn( sa.sun_path, broker_path, sizeof( sa.sun_path ));
+
+    unlink( broker_path );
+    if (( broker_listen = socket( AF_UNIX, SOCK_STREAM, 0 )) < 0
+        || bind( broker_listen, (struct sockaddr *) &sa, sizeof( sa )) != 0
+        || listen( broker_listen, SOMAXCONN ) != 0 ) {
+        SERROR( errno, "couldn't create the helper broker socket %s", broker_path );
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    fcntl( broker_listen, F_SETFD, FD_CLOEXEC );
+    if ( chmod( broker_path, S_IRUSR | S_IWUSR ) != 0
+         || ( geteuid() == 0 && chown( broker_path, ap_unixd_config.user_id, -1 ) != 0 )) {
+        SERROR( errno, "couldn't give the helper broker socket %s to User", broker_path );
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    broker_parent = getpid();
+    broker_pconf = pconf;
+    broker_server = s;
+    apr_pool_cleanup_register( pconf, NULL, broker_cleanup, apr_pool_cleanup_null );
+    broker_allow_defaults( s );
+
+    return broker_start() == APR_SUCCESS ? OK : HTTP_INTERNAL_SERVER_ERROR;
+}
+#endif
+
+/* Return a helper still leased by a connection that is going away */
+#ifdef APACHE2
+static apr_status_t cleanup_connection_helper( void *ctxt_v )
+#else
+static void cleanup_connection_helper( void *ctxt_v )
+#endif
+{
+    ntlm_connection_context_t *ctxt = ctxt_v;
+    struct _ntlm_auth_helper *auth_helper = helper_resume( ctxt->helper, ctxt->helper_lease );
+
+    if ( auth_helper != NULL ) {
+        helper_release( auth_helper );
+    }
+    ctxt->helper = NULL;
+#ifdef APACHE2
+    connection_set_backend( ctxt, NULL );
+    return APR_SUCCESS;
+#endif
+}
+
+/* Tie a freshly acquired helper to the connection until the handshake ends */
+static void connection_lease_helper( request_rec *r, ntlm_connection_context_t *ctxt, struct _ntlm_auth_helper *auth_helper ) {
+    if ( ctxt->helper == NULL ) {
+        apr_pool_cleanup_register( AUTH_CONN( r, ctxt )->pool, ctxt, cleanup_connection_helper, apr_pool_cleanup_null );
+    }
+    ctxt->helper = auth_helper;
+    ctxt->helper_lease = auth_helper->lease;
+}
+
+/* The handshake is over, one way or another */
+static void connection_unlease_helper( request_rec *r, ntlm_connection_context_t *ctxt ) {
+    if ( ctxt->helper != NULL ) {
+        apr_pool_cleanup_kill( AUTH_CONN( r, ctxt )->pool, ctxt, cleanup_connection_helper );
+        ctxt->helper = NULL;
+    }
+#ifdef NTLM_HAVE_BROKER
+    if ( ctxt->broker_handshake ) {
+        apr_pool_cleanup_kill( AUTH_CONN( r, ctxt )->pool, ctxt, cleanup_connection_broker );
+        ctxt->broker_handshake = 0;
+    }
+#endif
+#ifdef APACHE2
+    connection_set_backend( ctxt, NULL );
+#endif
+}
+
+#ifdef APACHE2
+/* Per-child cache of Basic credential checks.  Entries are keyed by
+   an HMAC of user:password under a secret generated when the cache is
+   created, so no plaintext password is ever kept in memory. */
+
+/* HMAC-SHA1 under a key of at most 64 bytes, of the strings in parts
+   joined by sep.  Hashing the parts in place means a password never
+   has to be copied into a buffer of its own. */
+static void hmac_sha1( const unsigned char *key, apr_size_t key_len, const char *const *parts,
+                       int nparts, char sep, unsigned char *out )
+{
+    apr_sha1_ctx_t ctx;
+    unsigned char pad[64];
+    unsigned char inner[APR_SHA1_DIGESTSIZE];
+    int i;
+
+    for ( i = 0; i < 64; i++ ) {
+        pad[i] = ( i < (int) key_len ? key[i] : 0 ) ^ 0x36;
+    }
+    apr_sha1_init( &ctx );
+    apr_sha1_update_binary( &ctx, pad, 64 );
+    for ( i = 0; i < nparts; i++ ) {
+        if ( i > 0 ) {
+            apr_sha1_update( &ctx, &sep, 1 );
+        }
+        apr_sha1_update( &ctx, parts[i], strlen( parts[i] ));
+    }
+    apr_sha1_final( inner, &ctx );
+
+    for ( i = 0; i < 64; i++ ) {
+        pad[i] ^= 0x36 ^ 0x5c;
+    }
+    apr_sha1_init( &ctx );
+    apr_sha1_update_binary( &ctx, pad, 64 );
+    apr_sha1_update_binary( &ctx, inner, sizeof( inner ));
+    apr_sha1_final( out, &ctx );
+}
+
+static void basic_cache_hmac( const unsigned char *secret, const char *backend,
+                              const char *user, const char *pass, unsigned char *out )
+{
+    const char *parts[3];
+
+    parts[0] = backend;
+    parts[1] = user;
+    parts[2] = pass;
+    hmac_sha1( secret, BASIC_CACHE_SECRET_LEN, parts, pass != NULL ? 3 : 2, ':', out );
+}
+
+/* What checks this user's password here: winbind, and the helpers of
+   the section or of the domain they named.  It goes into the cache
+   keys, so an answer from one domain's backend is never taken for
+   another's, in this child or in the shared cache.  Hashed, as command
+   lines may hold the separator. */
+static const char *basic_cache_backend( request_rec *r, ntlm_config_rec *crec, const char *user )
+{
+    const char *id = apr_array_pstrcat( r->pool, plaintext_backends( r, crec, user ), '\n' );
+    char *out = apr_palloc( r->pool, APR_SHA1PW_IDLEN
+                            + apr_base64_encode_len( APR_SHA1_DIGESTSIZE ));
+
+    if ( crec->native_backend ) {
+        id = apr_pstrcat( r->pool, "native\n", id, NULL );
+    }
+    apr_sha1_base64( id, strlen( id ), out );
+    return out;
+}
+
+/* This child's cache of the given size; sections that ask for the
+   same size share one */
+static struct _basic_cache *get_basic_cache( int size )
+{
+    struct _basic_cache *cache;
+    int i;
+
+    POOL_LOCK( global_ntlm_context.mutex );
+    if ( global_ntlm_context.basic_caches == NULL ) {
+        global_ntlm_context.basic_caches = apr_hash_make( global_ntlm_context.pool );
+    }
+    if (( cache = apr_hash_get( global_ntlm_context.basic_caches, &size, sizeof( size ))) == NULL ) {
+        cache = apr_pcalloc( global_ntlm_context.pool, sizeof( struct _basic_cache ));
+        cache->max = size;
+        cache->entries = apr_pcalloc( global_ntlm_context.pool,
+                                      size * sizeof( struct _basic_cache_entry ));
+        for ( i = 0; i < size; i++ ) {
+            cache->entries[i].next = cache->free;
+            cache->free = &cache->entries[i];
+        }
+        cache->index = apr_hash_make( global_ntlm_context.pool );
+        apr_generate_random_bytes( cache->secret, sizeof( cache->secret ));
+#if APR_HAS_THREADS
+        apr_thread_mutex_create( &cache->mutex, APR_THREAD_MUTEX_DEFAULT,
+                                 global_ntlm_context.pool );
+#endif
+        apr_hash_set( global_ntlm_context.basic_caches, &cache->max, sizeof( cache->max ), cache );
+    }
+    POOL_UNLOCK( global_ntlm_context.mutex );
+
+    return cache;
+}
+
+static void basic_cache_key( struct _basic_cache *cache, const char *backend, const char *user,
+                             const char *pass, unsigned char *key, unsigned char *user_key )
+{
+    basic_cache_hmac( cache->secret, backend, user, pass, key );
+    basic_cache_hmac( cache->secret, backend, user, NULL, user_key );
+}
+
+/* must be called with the cache locked */
+static void basic_cache_unlink( struct _basic_cache *cache, struct _basic_cache_entry *e )
+{
+    if ( e->prev ) {
+        e->prev->next = e->next;
+    } else {
+        cache->head = e->next;
+    }
+    if ( e->next ) {
+        e->next->prev = e->prev;
+    } else {
+        cache->tail = e->prev;
+    }
+    e->prev = e->next = NULL;
+}
+
+/* must be called with the cache locked */
+static void basic_cache_remove( struct _basic_cache *cache, struct _basic_cache_entry *e )
+{
+    basic_cache_unlink( cache, e );
+    apr_hash_set( cache->index, e->key, BASIC_CACHE_KEY_LEN, NULL );
+    e->next = cache->free;
+    cache->free = e;
+}
+
+/* Returns 1 for a cached success, 0 for a cached failure and -1 when
+   the credentials have to be checked by winbind */
+static int basic_cache_lookup( struct _basic_cache *cache, ntlm_config_rec *crec,
+                               const unsigned char *key )
+{
+    struct _basic_cache_entry *e;
+    int result = -1;
+
+    POOL_LOCK( cache->mutex );
+    if (( e = apr_hash_get( cache->index, key, BASIC_CACHE_KEY_LEN )) != NULL ) {
+        int ttl = e->ok ? crec->basic_cache_ttl : crec->basic_cache_negative_ttl;
+
+        if ( e->stored + apr_time_from_sec( ttl ) < apr_time_now() ) {
+            basic_cache_remove( cache, e );
+        } else {
+            result = e->ok;
+            /* move to the front of the LRU list */
+            basic_cache_unlink( cache, e );
+            e->next = cache->head;
+            if ( cache->head ) {
+                cache->head->prev = e;
+            }
+            cache->head = e;
+            if ( cache->tail == NULL ) {
+                cache->tail = e;
+            }
+        }
+    }
+    POOL_UNLOCK( cache->mutex );
+
+    return result;
+}
+
+static void basic_cache_store( struct _basic_cache *cache, const unsigned char *key,
+                               const unsigned char *user_key, int ok )
+{
+    struct _basic_cache_entry *e;
+
+    POOL_LOCK( cache->mutex );
+    if (( e = apr_hash_get( cache->index, key, BASIC_CACHE_KEY_LEN )) != NULL ) {
+        basic_cache_remove( cache, e );
+    }
+    if ( cache->free == NULL ) {
+        /* evict the least recently used entry */
+        basic_cache_remove( cache, cache->tail );
+    }
+    e = cache->free;
+    cache->free = e->next;
+
+    memcpy( e->key, key, BASIC_CACHE_KEY_LEN );
+    memcpy( e->user_key, user_key, BASIC_CACHE_KEY_LEN );
+    e->ok = ok;
+    e->stored = apr_time_now();
+    e->prev = NULL;
+    e->next = cache->head;
+    if ( cache->head ) {
+        cache->head->prev = e;
+    }
+    cache->head = e;
+    if ( cache->tail == NULL ) {
+        cache->tail = e;
+    }
+    apr_hash_set( cache->index, e->key, BASIC_CACHE_KEY_LEN, e );
+    POOL_UNLOCK( cache->mutex );
+}
+
+/* Drop every entry, good or bad, cached for a user */
+static void basic_cache_forget_user( struct _basic_cache *cache, const unsigned char *user_key )
+{
+    struct _basic_cache_entry *e, *next;
+
+    POOL_LOCK( cache->mutex );
+    for ( e = cache->head; e != NULL; e = next ) {
+        next = e->next;
+        if ( memcmp( e->user_key, user_key, BASIC_CACHE_KEY_LEN ) == 0 ) {
+            basic_cache_remove( cache, e );
+        }
+    }
+    POOL_UNLOCK( cache->mutex );
+}
+#endif
+
+#ifdef NTLM_HAVE_SOCACHE
+/* Basic credential checks shared between children (shmcb) or hosts
+   (memcache) through mod_socache.  Entries are keyed by an HMAC of
+   user:password under NTLMBasicCacheSecret, and stamped with a per-user
+   generation so a failed check can retire every entry for that user. */
+
+static void basic_socache_lock( request_rec *r )
+{
+    apr_status_t rv;
+
+    if ( basic_socache_mutex && ( rv = apr_global_mutex_lock( basic_socache_mutex )) != APR_SUCCESS ) {
+        RERROR( rv, "failed to lock the basic credential cache" );
+    }
+}
+
+static void basic_socache_unlock( request_rec *r )
+{
+    if ( basic_socache_mutex ) {
+        apr_global_mutex_unlock( basic_socache_mutex );
+    }
+}
+
+/* Fetch the user's current generation; 0 if there is none */
+static int basic_socache_generation( request_rec *r, const unsigned char *user_key,
+                                     unsigned char *gen )
+{
+    unsigned char id[BASIC_CACHE_KEY_LEN + 1];
+    unsigned int len = BASIC_SOCACHE_GEN_LEN;
+
+    id[0] = 'u';
+    memcpy( id + 1, user_key, BASIC_CACHE_KEY_LEN );
+    return basic_socache_provider->retrieve( basic_socache_instance, r->server, id, sizeof( id ),
+                                             gen, &len, r->pool ) == APR_SUCCESS
+        && len == BASIC_SOCACHE_GEN_LEN;
+}
+
+static void basic_socache_new_generation( request_rec *r, ntlm_config_rec *crec,
+                                          const unsigned char *user_key, unsigned char *gen )
+{
+    unsigned char id[BASIC_CACHE_KEY_LEN + 1];
+    int ttl = crec->basic_cache_ttl > crec->basic_cache_negative_ttl
+        ? crec->basic_cache_ttl : crec->basic_cache_negative_ttl;
+
+    id[0] = 'u';
+    memcpy( id + 1, user_key, BASIC_CACHE_KEY_LEN );
+    apr_generate_random_bytes( gen, BASIC_SOCACHE_GEN_LEN );
+    basic_socache_provider->store( basic_socache_instance, r->server, id, sizeof( id ),
+                                   apr_time_now() + apr_time_from_sec( ttl ),
+                                   gen, BASIC_SOCACHE_GEN_LEN, r->pool );
+}
+
+/* Returns 1 for a cached success, 0 for a cached failure and -1 on a miss */
+static int basic_socache_lookup( request_rec *r, const unsigned char *key,
+                                 const unsigned char *user_key )
+{
+    unsigned char id[BASIC_CACHE_KEY_LEN + 1];
+    unsigned char gen[BASIC_SOCACHE_GEN_LEN];
+    unsigned char val[1 + BASIC_SOCACHE_GEN_LEN];
+    unsigned int len = sizeof( val );
+    int result = -1;
+
+    id[0] = 'c';
+    memcpy( id + 1, key, BASIC_CACHE_KEY_LEN );
+
+    basic_socache_lock( r );
+    if ( basic_socache_generation( r, user_key, gen )
+         && basic_socache_provider->retrieve( basic_socache_instance, r->server, id, sizeof( id ),
+                                              val, &len, r->pool ) == APR_SUCCESS
+         && len == sizeof( val )
+         && memcmp( val + 1, gen, BASIC_SOCACHE_GEN_LEN ) == 0 ) {
+        result = val[0] == '1';
+    }
+    basic_socache_unlock( r );
+
+    return result;
+}
+
+static void basic_socache_store( request_rec *r, ntlm_config_rec *crec, const unsigned char *key,
+                                 const unsigned char *user_key, int ok )
+{
+    unsigned char id[BASIC_CACHE_KEY_LEN + 1];
+    unsigned char val[1 + BASIC_SOCACHE_GEN_LEN];
+    int ttl = ok ? crec->basic_cache_ttl : crec->basic_cache_negative_ttl;
+    apr_status_t rv;
+
+    id[0] = 'c';
+    memcpy( id + 1, key, BASIC_CACHE_KEY_LEN );
+    val[0] = ok ? '1' : '0';
+
+    basic_socache_lock( r );
+    if ( ok ) {
+        if ( !basic_socache_generation( r, user_key, val + 1 )) {
+            basic_socache_new_generation( r, crec, user_key, val + 1 );
+        }
+    } else {
+        /* the user's password may have changed: retire everything
+           cached for them before noting this failure */
+        basic_socache_new_generation( r, crec, user_key, val + 1 );
+    }
+    rv = basic_socache_provider->store( basic_socache_instance, r->server, id, sizeof( id ),
+                                        apr_time_now() + apr_time_from_sec( ttl ),
+                                        val, sizeof( val ), r->pool );
+    basic_socache_unlock( r );
+
+    if ( rv != APR_SUCCESS ) {
+        RDEBUG( "failed to store credentials in the shared cache" );
+    }
+}
+#endif
+
+#ifdef APACHE2
+/* Signed session cookie.  After a handshake succeeds the client gets
+   a cookie naming the user, bound to its address and good until an
+   expiry time, so a new connection can skip the handshake.  The MAC
+   uses the first NTLMAuthSessionKey; any of them is accepted, so keys
+   can be rotated without logging everybody out. */
+
+static const char *session_client_ip( request_rec *r ) {
+#if AP_MODULE_MAGIC_AT_LEAST(20111130, 0)
+    return r->useragent_ip;
+#else
+    return r->connection->remote_ip;
+#endif
+}
+
+static void session_mac( const unsigned char *key, const char *expiry, const char *auth_type,
+                         const char *user, const char *ip, unsigned char *out ) {
+    const char *parts[4];
+
+    parts[0] = expiry;
+    parts[1] = auth_type;
+    parts[2] = user;
+    parts[3] = ip;
+    hmac_sha1( key, SESSION_KEY_LEN, parts, 4, '|', out );
+}
+
+/* Give the client a cookie for the user it just authenticated as */
+static void session_issue( request_rec *r, ntlm_config_rec *crec, const char *user, const char *auth_type ) {
+    unsigned char mac[APR_SHA1_DIGESTSIZE];
+    char *expiry, *user64, *mac64, *cookie;
+
+    if ( crec->session_cookie == NULL || session_nkeys == 0 ) {
+        return;
+    }
+
+    expiry = apr_psprintf( r->pool, "%" APR_TIME_T_FMT,
+                           apr_time_sec( apr_time_now()) + crec->session_lifetime );
+    user64 = apr_palloc( r->pool, apr_base64_encode_len( strlen( user )));
+    apr_base64_encode( user64, user, strlen( user ));
+    session_mac( session_keys[0], expiry, auth_type, user, session_client_ip( r ), mac );
+    mac64 = apr_palloc( r->pool, apr_base64_encode_len( sizeof( mac )));
+    apr_base64_encode_binary( mac64, mac, sizeof( mac ));
+
+    cookie = apr_psprintf( r->pool, "%s=%s.%s.%s.%s; Path=/; Max-Age=%d%s%s",
+                           crec->session_cookie, expiry, auth_type, user64, mac64,
+                           crec->session_lifetime,
+                           crec->session_secure ? "; Secure" : "",
+                           crec->session_httponly ? "; HttpOnly" : "" );
+    apr_table_addn( r->err_headers_out, "Set-Cookie", cookie );
+}
+
+/* The value of our cookie in the request, if any */
+static char *session_cookie_value( request_rec *r, const char *name ) {
+    const char *header = apr_table_get( r->headers_in, "Cookie" );
+    apr_size_t len = strlen( name );
+
+    while ( header != NULL && *header ) {
+        header += strspn( header, " \t;" );
+        if ( strncmp( header, name, len ) == 0 && header[len] == '=' ) {
+            header += len + 1;
+            return apr_pstrndup( r->pool, header, strcspn( header, "; \t" ));
+        }
+        header = strchr( header, ';' );
+    }
+
+    return NULL;
+}
+
+/* Authenticate the request from a session cookie.  Returns OK, or
+   DECLINED if there is no valid cookie. */
+static int session_accept( request_rec *r, ntlm_config_rec *crec ) {
+    unsigned char mac[APR_SHA1_DIGESTSIZE], want[APR_SHA1_DIGESTSIZE];
+    char *value, *expiry, *auth_type, *user64, *mac64, *user, *last;
+    const char *ip = session_client_ip( r );
+    int i, len;
+
+    if ( crec->session_cookie == NULL || session_nkeys == 0
+         || ( value = session_cookie_value( r, crec->session_cookie )) == NULL ) {
+        return DECLINED;
+    }
+
+    if (( expiry = apr_strtok( value, ".", &last )) == NULL
+        || ( auth_type = apr_strtok( NULL, ".", &last )) == NULL
+        || ( user64 = apr_strtok( NULL, ".", &last )) == NULL
+        || ( mac64 = apr_strtok( NULL, ".", &last )) == NULL
+        /* exactly one MAC's worth, or decoding it would overrun mac[] */
+        || strlen( mac64 ) != (apr_size_t) apr_base64_encode_len( sizeof( mac )) - 1 ) {
+        RDEBUG( "malformed session cookie" );
+        return DECLINED;
+    }
+    if ( apr_atoi64( expiry ) <= apr_time_sec( apr_time_now())) {
+        RDEBUG( "session cookie expired" );
+        return DECLINED;
+    }
+    if ( strcmp( auth_type, NTLM_AUTH_NAME ) != 0 && strcmp( auth_type, NEGOTIATE_AUTH_NAME ) != 0 ) {
+        return DECLINED;
+    }
+
+    user = apr_palloc( r->pool, apr_base64_decode_len( user64 ) + 1 );
+    len = apr_base64_decode( user, user64 );
+    user[len] = '\0';
+    if ( apr_base64_decode_binary( mac, mac64 ) != sizeof( mac )) {
+        return DECLINED;
+    }
+
+    for ( i = 0; i < session_nkeys; i++ ) {
+        unsigned char diff = 0;
+        int j;
+
+        session_mac( session_keys[i], expiry, auth_type, user, ip, want );
+        for ( j = 0; j < (int) sizeof( mac ); j++ ) {
+            diff |= mac[j] ^ want[j];
+        }
+        if ( diff == 0 ) {
+            r->user = user;
+            r->ap_auth_type = auth_type;
+            RDEBUG( "authenticated %s from session cookie", user );
+            STAT_INC( session_hits );
+            return OK;
+        }
+    }
+
+    RDEBUG( "session cookie for %s from %s does not verify", user, ip );
+    return DECLINED;
+}
+#endif
+
+#ifdef NTLM_HAVE_THROTTLE
+/* Failure throttle.  Failed logins are counted per user and per client
+   address in a fixed-size table in shared memory.  Past the threshold
+   each further failure doubles how long the user or address is turned
+   away, up to NTLMAuthFailureMaxBackoff, and while it is, requests are
+   refused before any helper or winbind call.  A password sprayer then
+   can't lock accounts out or keep a domain controller busy.  An entry
+   is forgotten after NTLMAuthFailureMaxBackoff seconds without a
+   failure, or when the user logs in. */
+
+static void throttle_key( char kind, const char *name, unsigned char *key )
+{
+    apr_sha1_ctx_t ctx;
+    char c;
+
+    apr_sha1_init( &ctx );
+    apr_sha1_update( &ctx, &kind, 1 );
+    /* Windows account names don't care about case, so neither do we */
+    for ( ; *name; name++ ) {
+        c = apr_tolower( *name );
+        apr_sha1_update( &ctx, &c, 1 );
+    }
+    apr_sha1_final( key, &ctx );
+}
+
+/* Find key's entry, or make one if create is set.  Called locked. */
+static struct _throttle_entry *throttle_find( const unsigned char *key, apr_time_t now, int create )
+{
+    struct _throttle_entry *e, *victim = NULL;
+    apr_time_t forget = apr_time_from_sec( throttle_max_backoff );
+    apr_uint32_t start, i;
+
+    memcpy( &start, key, sizeof( start ));
+    for ( i = 0; i < THROTTLE_PROBE && i < throttle_table->size; i++ ) {
+        e = &throttle_table->entries[( start + i ) % throttle_table->size];
+        if ( memcmp( e->key, key, sizeof( e->key )) == 0 ) {
+            if ( e->failures && now >= e->blocked_until && now - e->last_failure > forget ) {
+                e->failures = 0;
+                e->blocked_until = 0;
+            }
+            return e;
+        }
+        if ( victim == NULL || e->last_failure < victim->last_failure ) {
+            victim = e;
+        }
+    }
+    if ( !create ) {
+        return NULL;
+    }
+
+    /* take the slot whose last failure is oldest */
+    if ( victim->failures && ( now < victim->blocked_until || now - victim->last_failure <= forget )) {
+        throttle_table->evictions++;
+    }
+    memcpy( victim->key, key, sizeof( victim->key ));
+    victim->failures = 0;
+    victim->last_failure = 0;
+    victim->blocked_until = 0;
+
+    return victim;
+}
+
+static int throttle_lock( request_rec *r )
+{
+    apr_status_t rv;
+
+    if (( rv = apr_global_mutex_lock( throttle_mutex )) != APR_SUCCESS ) {
+        RERROR( rv, "failed to lock the failure throttle" );
+        return 0;
+    }
+    return 1;
+}
+
+/* Is this user or client address being turned away right now? */
+static int throttle_blocked( request_rec *r, char kind, const char *name )
+{
+    unsigned char key[APR_SHA1_DIGESTSIZE];
+    struct _throttle_entry *e;
+    apr_time_t now = apr_time_now(), until = 0;
+
+    if ( throttle_table == NULL || name == NULL
+         || ( kind == THROTTLE_USER ? throttle_user_threshold : throttle_ip_threshold ) == 0 ) {
+        return 0;
+    }
+    throttle_key( kind, name, key );
+
+    if ( !throttle_lock( r )) {
+        return 0;
+    }
+    throttle_table->checks++;
+    if (( e = throttle_find( key, now, 0 )) != NULL && e->blocked_until > now ) {
+        until = e->blocked_until;
+        if ( kind == THROTTLE_USER ) {
+            throttle_table->rejected_user++;
+        } else {
+            throttle_table->rejected_ip++;
+        }
+    }
+    apr_global_mutex_unlock( throttle_mutex );
+
+    if ( until ) {
+        RDEBUG( "refusing %s %s for another %" APR_TIME_T_FMT "s after repeated failures",
+                kind == THROTTLE_USER ? "user" : "client", name, apr_time_sec( until - now ) + 1 );
+        return 1;
+    }
+    return 0;
+}
+
+static void throttle_note( char kind, const char *name, int threshold, apr_time_t now )
+{
+    unsigned char key[APR_SHA1_DIGESTSIZE];
+    struct _throttle_entry *e;
+    apr_uint32_t over;
+
+    throttle_key( kind, name, key );
+    e = throttle_find( key, now, 1 );
+    e->failures++;
+    e->last_failure = now;
+    if ( e->failures >= (apr_uint32_t) threshold ) {
+        over = e->failures - threshold;
+        e->blocked_until = now + apr_time_from_sec(
+            over >= 30 || ( 1 << over ) > throttle_max_backoff ? throttle_max_backoff : 1 << over );
+    }
+}
+
+/* Count a failed login from this client, and by this user if known */
+static void throttle_failed( request_rec *r, const char *user )
+{
+    apr_time_t now = apr_time_now();
+
+    if ( throttle_table == NULL || !throttle_lock( r )) {
+        return;
+    }
+    throttle_table->failures++;
+    if ( throttle_ip_threshold ) {
+        throttle_note( THROTTLE_IP, session_client_ip( r ), throttle_ip_threshold, now );
+    }
+    if ( user != NULL && throttle_user_threshold ) {
+        throttle_note( THROTTLE_USER, user, throttle_user_threshold, now );
+    }
+    apr_global_mutex_unlock( throttle_mutex );
+}
+
+/* A user who got in starts over; their address keeps its count, or
+   one good account would let a sprayer reset it */
+static void throttle_succeeded( request_rec *r, const char *user )
+{
+    unsigned char key[APR_SHA1_DIGESTSIZE];
+    struct _throttle_entry *e;
+
+    if ( throttle_table == NULL || user == NULL || !throttle_user_threshold ) {
+        return;
+    }
+    throttle_key( THROTTLE_USER, user, key );
+
+    if ( !throttle_lock( r )) {
+        return;
+    }
+    if (( e = throttle_find( key, apr_time_now(), 0 )) != NULL ) {
+        e->failures = 0;
+        e->blocked_until = 0;
+    }
+    apr_global_mutex_unlock( throttle_mutex );
+}
+#else
+#define throttle_blocked( r, kind, name ) 0
+#define throttle_failed( r, user )
+#define throttle_succeeded( r, user )
+#endif
+
+#ifdef HAVE_WBCLIENT
+static int process_msg(request_rec * r, ntlm_config_rec * crec, const char *auth_type);
+
+/* Native winbind backend.  Talks to winbindd through libwbclient
+   instead of a pipe to ntlm_auth: Basic passwords go straight to
+   wbcAuthenticateUserEx, and for NTLM the module issues its own
+   challenge and hands the client's Type-3 responses to winbind. */
+
+#define NTLMSSP_NEGOTIATE_UNICODE       0x00000001
+#define NTLMSSP_NEGOTIATE_OEM           0x00000002
+#define NTLMSSP_REQUEST_TARGET          0x00000004
+#define NTLMSSP_NEGOTIATE_NTLM          0x00000200
+#define NTLMSSP_NEGOTIATE_ALWAYS_SIGN   0x00008000
+#define NTLMSSP_TARGET_TYPE_DOMAIN      0x00010000
+#define NTLMSSP_NEGOTIATE_NTLM2         0x00080000
+#define NTLMSSP_NEGOTIATE_TARGET_INFO   0x00800000
+#define NTLMSSP_NEGOTIATE_128           0x20000000
+#define NTLMSSP_NEGOTIATE_56            0x80000000
+
+#define MSV_AV_EOL              0
+#define MSV_AV_NB_COMPUTER_NAME 1
+#define MSV_AV_NB_DOMAIN_NAME   2
+#define MSV_AV_DNS_DOMAIN_NAME  4
+
+static apr_uint32_t ntlmssp_get32( const unsigned char *p ) {
+    return p[0] | ( p[1] << 8 ) | ( p[2] << 16 ) | ((apr_uint32_t)p[3] << 24 );
+}
+
+static void ntlmssp_put16( unsigned char *p, unsigned int v ) {
+    p[0] = v & 0xff;
+    p[1] = ( v >> 8 ) & 0xff;
+}
+
+static void ntlmssp_put32( unsigned char *p, apr_uint32_t v ) {
+    ntlmssp_put16( p, v & 0xffff );
+    ntlmssp_put16( p + 2, v >> 16 );
+}
+
+/* Point at the payload described by a security buffer, or NULL if it
+   runs off the end of the message */
+static const unsigned char *ntlmssp_secbuf( const unsigned char *msg, apr_size_t len,
+                                            apr_size_t at, apr_size_t *buf_len ) {
+    apr_size_t l, off;
+
+    if ( at + 8 > len ) {
+        return NULL;
+    }
+    l = msg[at] | ( msg[at + 1] << 8 );
+    off = ntlmssp_get32( msg + at + 4 );
+    if ( off > len || l > len - off ) {
+        return NULL;
+    }
+    *buf_len = l;
+    return msg + off;
+}
+
+/* Copy a string out of an NTLMSSP message as UTF-8 */
+static char *ntlmssp_string( apr_pool_t *p, const unsigned char *s, apr_size_t len, int unicode ) {
+    char *out, *o;
+    apr_size_t i;
+
+    if ( !unicode ) {
+        return apr_pstrmemdup( p, (const char *)s, len );
+    }
+
+    o = out = apr_palloc( p, len / 2 * 3 + 1 );
+    for ( i = 0; i + 1 < len; i += 2 ) {
+        unsigned int c = s[i] | ( s[i + 1] << 8 );
+        if ( c >= 0xd800 && c < 0xdc00 && i + 3 < len ) {
+            /* surrogate pair: emit a four byte sequence */
+            unsigned int lo = s[i + 2] | ( s[i + 3] << 8 );
+            if ( lo >= 0xdc00 && lo < 0xe000 ) {
+                c = 0x10000 + (( c - 0xd800 ) << 10 ) + ( lo - 0xdc00 );
+                i += 2;
+            }
+        }
+        if ( c < 0x80 ) {
+            *o++ = c;
+        } else if ( c < 0x800 ) {
+            *o++ = 0xc0 | ( c >> 6 );
+            *o++ = 0x80 | ( c & 0x3f );
+        } else if ( c < 0x10000 ) {
+            *o++ = 0xe0 | ( c >> 12 );
+            *o++ = 0x80 | (( c >> 6 ) & 0x3f );
+            *o++ = 0x80 | ( c & 0x3f );
+        } else {
+            *o++ = 0xf0 | ( c >> 18 );
+            *o++ = 0x80 | (( c >> 12 ) & 0x3f );
+            *o++ = 0x80 | (( c >> 6 ) & 0x3f );
+            *o++ = 0x80 | ( c & 0x3f );
+        }
+    }
+    *o = '\0';
+    return out;
+}
+
+/* Write an ASCII name into a Type-2 message, as UTF-16LE if the client
+   asked for Unicode; returns the number of bytes written */
+static apr_size_t ntlmssp_put_name( unsigned char *p, const char *name, int unicode ) {
+    apr_size_t i, len = strlen( name );
+
+    if ( !unicode ) {
+        memcpy( p, name, len );
+        return len;
+    }
+    for ( i = 0; i < len; i++ ) {
+        ntlmssp_put16( p + 2 * i, (unsigned char)name[i] );
+    }
+    return 2 * len;
+}
+
+static struct wbcContext *native_ctx_get( void ) {
+#ifdef NTLM_WBC_CTX
+    struct wbcContext *wctx = NULL;
+
+    POOL_LOCK( global_ntlm_context.mutex );
+    if ( global_ntlm_context.native_nctx > 0 ) {
+        wctx = global_ntlm_context.native_ctx[--global_ntlm_context.native_nctx];
+    }
+    POOL_UNLOCK( global_ntlm_context.mutex );
+
+    return wctx ? wctx : wbcCtxCreate();
+#else
+    /* the old libwbclient shares one winbindd socket per process */
+    POOL_LOCK( global_ntlm_context.native_mutex );
+    return NULL;
+#endif
+}
+
+static void native_ctx_put( struct wbcContext *wctx ) {
+#ifdef NTLM_WBC_CTX
+    if ( wctx == NULL ) {
+        return;
+    }
+    POOL_LOCK( global_ntlm_context.mutex );
+    if ( global_ntlm_context.native_nctx < NATIVE_MAX_CONTEXTS ) {
+        global_ntlm_context.native_ctx[global_ntlm_context.native_nctx++] = wctx;
+        wctx = NULL;
+    }
+    POOL_UNLOCK( global_ntlm_context.mutex );
+    if ( wctx != NULL ) {
+        wbcCtxFree( wctx );
+    }
+#else
+    POOL_UNLOCK( global_ntlm_context.native_mutex );
+#endif
+}
+
+#ifdef NTLM_WBC_CTX
+#define native_ping( c ) wbcCtxPing( c )
+#define native_interface_details( c, d ) wbcCtxInterfaceDetails( c, d )
+#define native_authenticate( c, p, i, e ) wbcCtxAuthenticateUserEx( c, NULL, p, i, e )
+#define native_lookup_name( c, d, n, s, t ) wbcCtxLookupName( c, d, n, s, t )
+#define native_lookup_user_sids( c, s, g, n, o ) wbcCtxLookupUserSids( c, s, g, n, o )
+#else
+#define native_ping( c ) wbcPing()
+#define native_interface_details( c, d ) wbcInterfaceDetails( d )
+#define native_authenticate( c, p, i, e ) wbcAuthenticateUserEx( NULL, p, i, e )
+#define native_lookup_name( c, d, n, s, t ) wbcLookupName( d, n, s, t )
+#define native_lookup_user_sids( c, s, g, n, o ) wbcLookupUserSids( s, g, n, o )
+#endif
+
+/* Is winbindd there?  Also learns the names to put in our challenges */
+static int native_available( request_rec *r ) {
+    struct wbcContext *wctx = native_ctx_get();
+    struct wbcInterfaceDetails *details = NULL;
+    wbcErr wbc_status = native_ping( wctx );
+
+    if ( WBC_ERROR_IS_OK( wbc_status ) && global_ntlm_context.native_domain == NULL ) {
+        wbc_status = native_interface_details( wctx, &details );
+    }
+    native_ctx_put( wctx );
+
+    if ( !WBC_ERROR_IS_OK( wbc_status )) {
+        RERROR( APR_EGENERAL, "winbindd is not available (%s), falling back to ntlm_auth",
+                wbcErrorString( wbc_status ));
+        return 0;
+    }
+
+    if ( details != NULL ) {
+        POOL_LOCK( global_ntlm_context.mutex );
+        if ( global_ntlm_context.native_domain == NULL ) {
+            global_ntlm_context.native_separator = details->winbind_separator;
+            global_ntlm_context.native_computer =
+                apr_pstrdup( global_ntlm_context.pool, details->netbios_name ? details->netbios_name : "" );
+            global_ntlm_context.native_dns_domain =
+                apr_pstrdup( global_ntlm_context.pool, details->dns_domain ? details->dns_domain : "" );
+            global_ntlm_context.native_domain =
+                apr_pstrdup( global_ntlm_context.pool, details->netbios_domain ? details->netbios_domain : "" );
+        }
+        POOL_UNLOCK( global_ntlm_context.mutex );
+        wbcFreeMemory( details );
+    }
+
+    return 1;
+}
+
+/* Check a (user, password) pair with winbindd.  Points reply at "OK" or
+   "ERR", or returns DECLINED if the ntlm_auth helper has to be used. */
+static int native_verify_plaintext( request_rec *r, const char *user, const char *pass, const char **reply ) {
+    struct wbcAuthUserParams params;
+    struct wbcAuthUserInfo *info = NULL;
+    struct wbcAuthErrorInfo *error = NULL;
+    struct wbcContext *wctx;
+    const char *sep;
+    wbcErr wbc_status;
+
+    if ( global_ntlm_context.native_domain == NULL && !native_available( r )) {
+        return DECLINED;
+    }
+
+    memset( &params, 0, sizeof( params ));
+    if (( sep = strchr( user, global_ntlm_context.native_separator )) != NULL ) {
+        params.domain_name = apr_pstrmemdup( r->pool, user, sep - user );
+        params.account_name = sep + 1;
+    } else {
+        params.account_name = user;
+    }
+    params.level = WBC_AUTH_USER_LEVEL_PLAIN;
+    params.password.plaintext = pass;
+
+    wctx = native_ctx_get();
+    wbc_status = native_authenticate( wctx, &params, &info, &error );
+    native_ctx_put( wctx );
+
+    if ( WBC_ERROR_IS_OK( wbc_status )) {
+        *reply = "OK";
+    } else if ( wbc_status == WBC_ERR_AUTH_ERROR ) {
+        RDEBUG( "winbind rejected %s: %s", user, error && error->nt_string ? error->nt_string : "" );
+        *reply = "ERR";
+    } else {
+        RERROR( APR_EGENERAL, "winbind could not check %s: %s", user, wbcErrorString( wbc_status ));
+        wbcFreeMemory( info );
+        wbcFreeMemory( error );
+        return wbc_status == WBC_ERR_WINBIND_NOT_AVAILABLE ? DECLINED : HTTP_INTERNAL_SERVER_ERROR;
+    }
+    wbcFreeMemory( info );
+    wbcFreeMemory( error );
+
+    return OK;
+}
+
+/* Answer a Type-1 message with a Type-2 carrying our own challenge */
+static const char *native_ntlm_challenge( request_rec *r, ntlm_connection_context_t *ctxt,
+                                          apr_uint32_t client_flags ) {
+    const char *domain = global_ntlm_context.native_domain;
+    const char *computer = global_ntlm_context.native_computer;
+    const char *dns_domain = global_ntlm_context.native_dns_domain;
+    int unicode = ( client_flags & NTLMSSP_NEGOTIATE_UNICODE ) != 0;
+    apr_uint32_t flags;
+    unsigned char *msg, *p, *info;
+    apr_size_t name_len, info_len, len;
+    char *b64;
+
+    flags = NTLMSSP_REQUEST_TARGET | NTLMSSP_NEGOTIATE_NTLM | NTLMSSP_TARGET_TYPE_DOMAIN
+        | NTLMSSP_NEGOTIATE_TARGET_INFO
+        | ( unicode ? NTLMSSP_NEGOTIATE_UNICODE : NTLMSSP_NEGOTIATE_OEM )
+        | ( client_flags & ( NTLMSSP_NEGOTIATE_ALWAYS_SIGN | NTLMSSP_NEGOTIATE_NTLM2
+                             | NTLMSSP_NEGOTIATE_128 | NTLMSSP_NEGOTIATE_56 ));
+
+    /* header, target name, and AV pairs for domain, computer, DNS domain and EOL */
+    len = 48 + 2 * strlen( domain ) + 4 * 4
+        + 2 * ( strlen( domain ) + strlen( computer ) + strlen( dns_domain ));
+    msg = apr_pcalloc( r->pool, len );
+
+    memcpy( msg, "NTLMSSP", 8 );
+    ntlmssp_put32( msg + 8, 2 );
+    ntlmssp_put32( msg + 20, flags );
+    apr_generate_random_bytes( ctxt->ntlm_challenge, sizeof( ctxt->ntlm_challenge ));
+    memcpy( msg + 24, ctxt->ntlm_challenge, 8 );
+    ctxt->ntlm_flags = flags;
+
+    p = msg + 48;
+    name_len = ntlmssp_put_name( p, domain, unicode );
+    ntlmssp_put16( msg + 12, name_len );
+    ntlmssp_put16( msg + 14, name_len );
+    ntlmssp_put32( msg + 16, p - msg );
+    p += name_len;
+
+    /* target info is always Unicode */
+    info = p;
+    ntlmssp_put16( p, MSV_AV_NB_DOMAIN_NAME );
+    ntlmssp_put16( p + 2, 2 * strlen( domain ));
+    p += 4 + ntlmssp_put_name( p + 4, domain, 1 );
+    ntlmssp_put16( p, MSV_AV_NB_COMPUTER_NAME );
+    ntlmssp_put16( p + 2, 2 * strlen( computer ));
+    p += 4 + ntlmssp_put_name( p + 4, computer, 1 );
+    ntlmssp_put16( p, MSV_AV_DNS_DOMAIN_NAME );
+    ntlmssp_put16( p + 2, 2 * strlen( dns_domain ));
+    p += 4 + ntlmssp_put_name( p + 4, dns_domain, 1 );
+    ntlmssp_put16( p, MSV_AV_EOL );
+    ntlmssp_put16( p + 2, 0 );
+    p += 4;
+    info_len = p - info;
+    ntlmssp_put16( msg + 40, info_len );
+    ntlmssp_put16( msg + 42, info_len );
+    ntlmssp_put32( msg + 44, info - msg );
+
+    b64 = apr_palloc( r->pool, apr_base64_encode_len( p - msg ));
+    apr_base64_encode_binary( b64, msg, p - msg );
+
+    return b64;
+}
+
+/* Check the responses in a Type-3 message against our challenge */
+static int native_ntlm_authenticate( request_rec *r, ntlm_connection_context_t *ctxt,
+                                     const unsigned char *msg, apr_size_t len ) {
+    struct wbcAuthUserParams params;
+    struct wbcAuthUserInfo *info = NULL;
+    struct wbcAuthErrorInfo *error = NULL;
+    struct wbcContext *wctx;
+    const unsigned char *lm, *nt, *dom, *usr, *wks;
+    apr_size_t lm_len, nt_len, dom_len, usr_len, wks_len;
+    apr_uint32_t flags;
+    const char *name;
+    int unicode;
+    wbcErr wbc_status;
+
+    if ( len < 64
+         || ( lm = ntlmssp_secbuf( msg, len, 12, &lm_len )) == NULL
+         || ( nt = ntlmssp_secbuf( msg, len, 20, &nt_len )) == NULL
+         || ( dom = ntlmssp_secbuf( msg, len, 28, &dom_len )) == NULL
+         || ( usr = ntlmssp_secbuf( msg, len, 36, &usr_len )) == NULL
+         || ( wks = ntlmssp_secbuf( msg, len, 44, &wks_len )) == NULL ) {
+        RDEBUG( "malformed NTLMSSP authenticate message" );
+        return note_auth_failure( r, NULL );
+    }
+    flags = ntlmssp_get32( msg + 60 );
+    unicode = (( flags ? flags : ctxt->ntlm_flags ) & NTLMSSP_NEGOTIATE_UNICODE ) != 0;
+
+    memset( &params, 0, sizeof( params ));
+    params.account_name = ntlmssp_string( r->pool, usr, usr_len, unicode );
+    params.domain_name = ntlmssp_string( r->pool, dom, dom_len, unicode );
+    params.workstation_name = ntlmssp_string( r->pool, wks, wks_len, unicode );
+    name = apr_psprintf( r->pool, "%s%c%s", params.domain_name,
+                         global_ntlm_context.native_separator, params.account_name );
+    if ( throttle_blocked( r, THROTTLE_USER, name )) {
+        return note_auth_failure( r, NULL );
+    }
+    params.parameter_control = WBC_MSV1_0_ALLOW_WORKSTATION_TRUST_ACCOUNT
+        | WBC_MSV1_0_ALLOW_SERVER_TRUST_ACCOUNT;
+    params.level = WBC_AUTH_USER_LEVEL_RESPONSE;
+    memcpy( params.password.response.challenge, ctxt->ntlm_challenge, 8 );
+    params.password.response.nt_length = nt_len;
+    params.password.response.nt_data = (uint8_t *)nt;
+    params.password.response.lm_length = lm_len;
+    params.password.response.lm_data = (uint8_t *)lm;
+
+    if (( ctxt->ntlm_flags & NTLMSSP_NEGOTIATE_NTLM2 ) && nt_len == 24 && lm_len == 24 ) {
+        /* NTLM2 session response: the real challenge is a hash of ours
+           and the client's, and the LM field only carries the latter */
+        unsigned char nonce[16], digest[APR_MD5_DIGESTSIZE];
+
+        memcpy( nonce, ctxt->ntlm_challenge, 8 );
+        memcpy( nonce + 8, lm, 8 );
+        apr_md5( digest, nonce, sizeof( nonce ));
+        memcpy( params.password.response.challenge, digest, 8 );
+        params.password.response.lm_length = 0;
+        params.password.response.lm_data = NULL;
+    }
+
+    wctx = native_ctx_get();
+    wbc_status = native_authenticate( wctx, &params, &info, &error );
+    native_ctx_put( wctx );
+
+    if ( !WBC_ERROR_IS_OK( wbc_status )) {
+        if ( wbc_status == WBC_ERR_AUTH_ERROR ) {
+            RDEBUG( "user not authenticated: %s", error && error->nt_string ? error->nt_string : "" );
+            throttle_failed( r, name );
+            STAT_INC( failed[SCHEME_NTLM] );
+        } else {
+            RERROR( APR_EGENERAL, "winbind could not check NTLM response: %s",
+                    wbcErrorString( wbc_status ));
+        }
+        wbcFreeMemory( info );
+        wbcFreeMemory( error );
+        return note_auth_failure( r, NULL );
+    }
+
+    ctxt->connected_user_authenticated->user =
+        apr_psprintf( ctxt->connected_user_authenticated->pool, "%s%c%s",
+                      info->domain_name, global_ntlm_context.native_separator,
+                      info->account_name );
+    ctxt->connected_user_authenticated->keepalives = ctxt->conn->keepalives;
+    wbcFreeMemory( info );
+    wbcFreeMemory( error );
+
+    r->user = ctxt->connected_user_authenticated->user;
+    r->ap_auth_type = apr_pstrdup( r->connection->pool, NTLM_AUTH_NAME );
+    throttle_succeeded( r, name );
+    STAT_INC( completed[SCHEME_NTLM] );
+    offer_learn( r, SCHEME_NTLM );
+    RDEBUG( "authenticated %s", ctxt->connected_user_authenticated->user );
+
+    return OK;
+}
+
+/* NTLM handshake handled in the module.  Falls back to the ntlm_auth
+   helper for the whole handshake when winbindd can't be reached at
+   the first leg. */
+static int process_msg_native( request_rec *r, ntlm_config_rec *crec ) {
+    ntlm_connection_context_t *ctxt = get_connection_context( r->connection );
+    const char *client_msg;
+    unsigned char *msg;
+    apr_pool_t *pool;
+    int len, result;
+
+    if (( client_msg = get_auth_header( r, crec, NTLM_AUTH_NAME )) == NULL ) {
+        RDEBUG( "client did not return NTLM authentication header" );
+        return note_auth_failure( r, NULL );
+    }
+    while ( *client_msg == ' ' || *client_msg == '\t' ) {
+        client_msg++;
+    }
+
+    msg = apr_palloc( r->pool, apr_base64_decode_len( client_msg ));
+    len = apr_base64_decode_binary( msg, client_msg );
+    if ( len < 12 || memcmp( msg, "NTLMSSP", 8 ) != 0 ) {
+        RDEBUG( "not an NTLMSSP message" );
+        return note_auth_failure( r, NULL );
+    }
+
+    switch ( ntlmssp_get32( msg + 8 )) {
+    case 1:
+        if ( ctxt->connected_user_authenticated != NULL ) {
+            apr_pool_destroy( ctxt->connected_user_authenticated->pool );
+            ctxt->connected_user_authenticated = NULL;
+        }
+        if ( !native_available( r )) {
+            ctxt->native_ntlm = 0;
+            return process_msg( r, crec, NTLM_AUTH_NAME );
+        }
+
+        apr_pool_create_ex( &pool, ctxt->conn->pool, NULL, NULL );
+        ctxt->connected_user_authenticated =
+            apr_pcalloc( pool, sizeof( struct _connected_user_authenticated ));
+        ctxt->connected_user_authenticated->pool = pool;
+        ctxt->native_ntlm = 1;
+        STAT_INC( started[SCHEME_NTLM] );
+
+        return send_auth_reply( r, NTLM_AUTH_NAME,
+                                native_ntlm_challenge( r, ctxt, len >= 16 ? ntlmssp_get32( msg + 12 ) : 0 ));
+
+    case 3:
+        if ( ctxt->connected_user_authenticated == NULL ) {
+            RDEBUG( "NTLMSSP authenticate message without a challenge" );
+            return note_auth_failure( r, NULL );
+        }
+        if ( !ctxt->native_ntlm ) {
+            /* this handshake started on the helper */
+            return process_msg( r, crec, NTLM_AUTH_NAME );
+        }
+        if (( result = native_ntlm_authenticate( r, ctxt, msg, len )) == OK ) {
+            session_issue( r, crec, r->user, NTLM_AUTH_NAME );
+        }
+        return result;
+
+    default:
+        RDEBUG( "unexpected NTLMSSP message type" );
+        return note_auth_failure( r, NULL );
+    }
+}
+#endif
+
+#ifdef NTLM_HAVE_AUTHZ
+/* Require winbind-group: authorisation by Windows group membership.
+   A user's group SIDs, nested groups included, are asked of winbindd
+   once and kept on the connection, and in the NTLMBasicSOCache if
+   there is one, for NTLMGroupCacheTTL seconds; every Require line is
+   then answered from memory.  Group names are turned into SIDs once
+   per child. */
+
+#ifdef HAVE_WBCLIENT
+#define GROUP_SOCACHE_MAX 16384         /* longest SID list shared */
+
+/* Split a DOMAIN<sep>name for wbcLookupName; "\" is always accepted */
+static void group_split_name( request_rec *r, const char *full, const char **domain, const char **name ) {
+    const char *sep = strchr( full, global_ntlm_context.native_separator );
+
+    if ( sep == NULL ) {
+        sep = strchr( full, '\\' );
+    }
+    if ( sep == NULL ) {
+        *domain = "";
+        *name = full;
+    } else {
+        *domain = apr_pstrmemdup( r->pool, full, sep - full );
+        *name = sep + 1;
+    }
+}
+
+/* The SID of a group named in a Require line, or NULL if winbindd
+   doesn't know it.  A SID may also be given directly. */
+static const char *group_name_sid( request_rec *r, const char *group ) {
+    struct wbcDomainSid sid;
+    enum wbcSidType type;
+    struct wbcContext *wctx;
+    char buf[WBC_SID_STRING_BUFLEN], *key, *k;
+    const char *domain, *name, *found;
+    wbcErr wbc_status;
+
+    if ( strncasecmp( group, "S-1-", 4 ) == 0 ) {
+        if ( !WBC_ERROR_IS_OK( wbcStringToSid( group, &sid ))
+             || !WBC_ERROR_IS_OK( wbcSidToStringBuf( &sid, buf, sizeof( buf )))) {
+            RERROR( APR_EGENERAL, "Require winbind-group: %s is not a SID", group );
+            return NULL;
+        }
+        return apr_pstrdup( r->pool, buf );
+    }
+
+    key = apr_pstrdup( r->pool, group );
+    for ( k = key; *k; k++ ) {
+        *k = apr_tolower( *k );
+    }
+    POOL_LOCK( global_ntlm_context.mutex );
+    if ( global_ntlm_context.group_names == NULL ) {
+        global_ntlm_context.group_names = apr_hash_make( global_ntlm_context.pool );
+    }
+    found = apr_hash_get( global_ntlm_context.group_names, key, APR_HASH_KEY_STRING );
+    POOL_UNLOCK( global_ntlm_context.mutex );
+    if ( found != NULL ) {
+        return found;
+    }
+
+    group_split_name( r, group, &domain, &name );
+    wctx = native_ctx_get();
+    wbc_status = native_lookup_name( wctx, domain, name, &sid, &type );
+    native_ctx_put( wctx );
+    if ( WBC_ERROR_IS_OK( wbc_status )) {
+        wbc_status = wbcSidToStringBuf( &sid, buf, sizeof( buf ));
+    }
+    if ( !WBC_ERROR_IS_OK( wbc_status )) {
+        /* not remembered, so a group created later is picked up */
+        RERROR( APR_EGENERAL, "Require winbind-group: winbind could not find %s: %s",
+                group, wbcErrorString( wbc_status ));
+        return NULL;
+    }
+
+    POOL_LOCK( global_ntlm_context.mutex );
+    if (( found = apr_hash_get( global_ntlm_context.group_names, key, APR_HASH_KEY_STRING )) == NULL ) {
+        found = apr_pstrdup( global_ntlm_context.pool, buf );
+        apr_hash_set( global_ntlm_context.group_names,
+                      apr_pstrdup( global_ntlm_context.pool, key ), APR_HASH_KEY_STRING, found );
+    }
+    POOL_UNLOCK( global_ntlm_context.mutex );
+
+    return found;
+}
+
+#ifdef NTLM_HAVE_SOCACHE
+/* Shared cache entries are keyed on a hash of the lowercased user name */
+static void group_socache_id( const char *user, unsigned char *id ) {
+    apr_sha1_ctx_t ctx;
+    char c;
+
+    id[0] = 'g';
+    apr_sha1_init( &ctx );
+    for ( ; *user; user++ ) {
+        c = apr_tolower( *user );
+        apr_sha1_update( &ctx, &c, 1 );
+    }
+    apr_sha1_final( id + 1, &ctx );
+}
+#endif
+
+/* The user's group SIDs, space separated, from the shared cache or
+   from winbindd; NULL if winbindd can't say */
+static char *group_sids_fetch( request_rec *r, ntlm_config_rec *crec, const char *user ) {
+    struct wbcDomainSid sid, *sids = NULL;
+    enum wbcSidType type;
+    struct wbcContext *wctx;
+    char buf[WBC_SID_STRING_BUFLEN];
+    const char *domain, *name;
+    apr_array_header_t *list;
+    uint32_t i, num = 0;
+    wbcErr wbc_status;
+    char *joined;
+#ifdef NTLM_HAVE_SOCACHE
+    unsigned char id[1 + APR_SHA1_DIGESTSIZE];
+    unsigned int len = GROUP_SOCACHE_MAX;
+    apr_status_t rv;
+
+    if ( basic_socache_instance && crec->group_cache_ttl > 0 ) {
+        joined = apr_palloc( r->pool, GROUP_SOCACHE_MAX + 1 );
+        group_socache_id( user, id );
+        basic_socache_lock( r );
+        rv = basic_socache_provider->retrieve( basic_socache_instance, r->server, id, sizeof( id ),
+                                               (unsigned char *) joined, &len, r->pool );
+        basic_socache_unlock( r );
+        if ( rv == APR_SUCCESS ) {
+            joined[len] = '\0';
+            RDEBUG( "groups of %s found in shared cache", user );
+            STAT_INC( group_socache_hits );
+            return joined;
+        }
+    }
+#endif
+
+    if ( global_ntlm_context.native_domain == NULL && !native_available( r )) {
+        return NULL;
+    }
+    group_split_name( r, user, &domain, &name );
+
+    STAT_INC( group_lookups );
+    wctx = native_ctx_get();
+    wbc_status = native_lookup_name( wctx, domain, name, &sid, &type );
+    if ( WBC_ERROR_IS_OK( wbc_status )) {
+        wbc_status = native_lookup_user_sids( wctx, &sid, 0, &num, &sids );
+    }
+    native_ctx_put( wctx );
+    if ( !WBC_ERROR_IS_OK( wbc_status )) {
+        RERROR( APR_EGENERAL, "winbind could not list the groups of %s: %s",
+                user, wbcErrorString( wbc_status ));
+        return NULL;
+    }
+
+    list = apr_array_make( r->pool, num, sizeof( char * ));
+    for ( i = 0; i < num; i++ ) {
+        if ( WBC_ERROR_IS_OK( wbcSidToStringBuf( &sids[i], buf, sizeof( buf )))) {
+            *(char **) apr_array_push( list ) = apr_pstrdup( r->pool, buf );
+        }
+    }
+    wbcFreeMemory( sids );
+    joined = apr_array_pstrcat( r->pool, list, ' ' );
+    RDEBUG( "%s is in %u groups", user, num );
+
+#ifdef NTLM_HAVE_SOCACHE
+    if ( basic_socache_instance && crec->group_cache_ttl > 0 && strlen( joined ) <= GROUP_SOCACHE_MAX ) {
+        basic_socache_lock( r );
+        rv = basic_socache_provider->store( basic_socache_instance, r->server, id, sizeof( id ),
+                                            apr_time_now() + apr_time_from_sec( crec->group_cache_ttl ),
+                                            (unsigned char *) joined, strlen( joined ), r->pool );
+        basic_socache_unlock( r );
+        if ( rv != APR_SUCCESS ) {
+            RDEBUG( "failed to store the groups of %s in the shared cache", user );
+        }
+    }
+#endif
+
+    return joined;
+}
+
+/* Make sure the connection holds r->user's group SIDs */
+static int group_sids_load( request_rec *r, ntlm_config_rec *crec, ntlm_connection_context_t *ctxt ) {
+    apr_time_t now = apr_time_now();
+    char *joined, *sid, *last;
+
+    if ( ctxt->group_sids != NULL && strcmp( ctxt->group_user, r->user ) == 0
+         && now - ctxt->group_fetched < apr_time_from_sec( crec->group_cache_ttl )) {
+        return OK;
+    }
+    if (( joined = group_sids_fetch( r, crec, r->user )) == NULL ) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if ( ctxt->group_pool == NULL ) {
+        apr_pool_create_ex( &ctxt->group_pool, ctxt->conn->pool, NULL, NULL );
+    } else {
+        apr_pool_clear( ctxt->group_pool );
+    }
+    ctxt->group_user = apr_pstrdup( ctxt->group_pool, r->user );
+    ctxt->group_sids = apr_hash_make( ctxt->group_pool );
+    ctxt->group_fetched = now;
+    joined = apr_pstrdup( ctxt->group_pool, joined );
+    for ( sid = apr_strtok( joined, " ", &last ); sid != NULL; sid = apr_strtok( NULL, " ", &last )) {
+        apr_hash_set( ctxt->group_sids, sid, APR_HASH_KEY_STRING, sid );
+    }
+
+    return OK;
+}
+
+static authz_status group_check( request_rec *r, ntlm_config_rec *crec, ntlm_connection_context_t *ctxt,
+                                 const char *require_line ) {
+    const char *groups = require_line, *group, *sid;
+
+    if ( group_sids_load( r, crec, ctxt ) != OK ) {
+        return AUTHZ_GENERAL_ERROR;
+    }
+    while ( *( group = ap_getword_conf( r->pool, &groups )) != '\0' ) {
+        if (( sid = group_name_sid( r, group )) != NULL
+            && apr_hash_get( ctxt->group_sids, sid, APR_HASH_KEY_STRING ) != NULL ) {
+            RDEBUG( "%s is in %s", r->user, group );
+            return AUTHZ_GRANTED;
+        }
+    }
+    RDEBUG( "%s is in none of %s", r->user, require_line );
+
+    return AUTHZ_DENIED;
+}
+
+static authz_status group_check_authorization( request_rec *r, const char *require_line,
+                                               const void *parsed_require_line ) {
+    ntlm_config_rec *crec =
+        (ntlm_config_rec *) ap_get_module_config(r->per_dir_config, &auth_ntlm_winbind_module);
+    ntlm_connection_context_t *ctxt;
+
+    if ( r->user == NULL ) {
+        return AUTHZ_DENIED_NO_USER;
+    }
+    ctxt = get_connection_context( r->connection );
+
+#if defined(NTLM_HAVE_CONN_MASTER) && APR_HAS_THREADS
+    if ( r->connection->master != NULL ) {
+        authz_status result;
+
+        /* sibling HTTP/2 streams share the cached SIDs */
+        apr_thread_mutex_lock( ctxt->mutex );
+        result = group_check( r, crec, ctxt, require_line );
+        apr_thread_mutex_unlock( ctxt->mutex );
+
+        return result;
+    }
+#endif
+    return group_check( r, crec, ctxt, require_line );
+}
+#endif
+
+static const char *group_parse_require_line( cmd_parms *cmd, const char *require_line,
+                                             const void **parsed_require_line ) {
+#ifdef HAVE_WBCLIENT
+    if ( *require_line == '\0' ) {
+        return "Require winbind-group needs at least one group name";
+    }
+    return NULL;
+#else
+    return "Require winbind-group: this module was built without libwbclient";
+#endif
+}
+
+static const authz_provider authz_winbind_group_provider = {
+#ifdef HAVE_WBCLIENT
+    &group_check_authorization,
+#else
+    NULL,
+#endif
+    &group_parse_require_line,
+};
 #endif
 
-    if ( auth_helper == NULL ) {
-        struct _ntlm_child_stuff cld;
-        apr_pool_t *pool;
-#ifdef APACHE2
-        char **argv_out;
-        apr_pool_create_ex( &pool, NULL, NULL, NULL ); /* xxx return code */
-#else
-        pool = ap_make_sub_pool( NULL );
+/* Ask a plaintext helper running cmd to check a (user, password)
+   pair.  reply is pointed at the helper's answer, in r->pool. */
+static int plaintext_backend_verify( request_rec *r, ntlm_config_rec * crec, char *cmd,
+                                     const char *user, const char *pass, const char **reply )
+{
+    struct iovec vec[HELPER_REQUEST_VECS];
+    struct helper_reply parsed;
+    char *answer;
+    int result, nvec;
+    struct _ntlm_helper_pool *hp;
+    struct _ntlm_auth_helper *auth_helper;
+
+    if (( nvec = helper_request_plaintext( vec, NULL, -1, user, pass )) < 0 ) {
+        RDEBUG( "line break in Basic credentials" );
+        *reply = "ERR";
+        return OK;
+    }
+#ifdef NTLM_HAVE_BROKER
+    if ( broker_serves( cmd )) {
+        /* a one-off, so no handshake ID */
+        result = broker_transact( r, crec, SCHEME_BASIC, cmd, 0, 1, vec, nvec, &answer );
+        *reply = answer;
+        return result;
+    }
 #endif
-        auth_helper = apr_pcalloc( pool, sizeof( struct _ntlm_auth_helper ));
-        auth_helper->pool = pool;
-        auth_helper->helper_pid = 0;
 
 #ifdef APACHE2
-        apr_tokenize_to_argv( cmd, &argv_out, pool );
+    hp = get_helper_pool( "plaintext", cmd, crec->ntlm_plaintext_helper_max,
+                          global_ntlm_context.plaintext_concurrency, crec );
+#if APR_HAS_THREADS
+    if ( hp->concurrency > 0 ) {
+        result = plaintext_channel_verify( r, crec, hp, user, pass, &answer );
+        *reply = answer;
+        return result;
+    }
+#endif
 #else
-        ap_register_cleanup( pool, auth_helper, cleanup, ap_null_cleanup );
+    hp = get_helper_pool( "plaintext", cmd, crec->ntlm_plaintext_helper_max, 0, crec );
 #endif
-        cld.argv0 = cmd;
-        cld.r = r;
+    if (( auth_helper = helper_acquire( r->server, r, hp, crec->handshake_timeout )) == NULL ) {
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    if (( result = helper_transact( r, crec, auth_helper, vec, nvec, &answer )) != OK ) {
+        return result;
+    }
+    *reply = answer;
 
+    /* parse a copy: the caller wants the whole answer */
+    helper_reply_parse( apr_pstrdup( r->pool, answer ), HELPER_FIELDS_BASIC, &parsed );
+    if ( parsed.code == HELPER_OK || parsed.code == HELPER_ERR ) {
+        helper_release( auth_helper );
+    } else {
+        helper_discard( auth_helper );
+    }
+
+    return OK;
+}
+
+/* Ask the Plaintext helpers to check a (user, password) pair, going
+   on to the user's next backend if one answers BH or not at all */
+static int plaintext_helper_verify( request_rec *r, ntlm_config_rec * crec, const char *user, const char *pass, const char **reply )
+{
 #ifdef APACHE2
-        apr_procattr_create( &attr, pool );
-        apr_procattr_io_set( attr, APR_FULL_BLOCK, APR_FULL_BLOCK, APR_NO_PIPE );
-        apr_procattr_error_check_set( attr, 1 );
-        auth_helper->proc = (apr_proc_t *)apr_pcalloc(pool, sizeof(apr_proc_t)) ;
-        if ( apr_proc_create( auth_helper->proc, argv_out[0], (const char * const *)argv_out, NULL, attr, pool ) != APR_SUCCESS ) {
-            RERROR( errno, "couldn't spawn child ntlm helper process: %s", argv_out[0]);
-            return NULL;
+    apr_array_header_t *cmds = plaintext_backends( r, crec, user );
+    struct _ntlm_backend *be;
+    unsigned int tried = 0;
+    int result = HTTP_INTERNAL_SERVER_ERROR;
+
+    while (( be = backend_choose( SCHEME_BASIC, cmds, &tried )) != NULL ) {
+        apr_atomic_inc32( &be->active );
+        result = plaintext_backend_verify( r, crec, (char *) be->cmd, user, pass, reply );
+        apr_atomic_dec32( &be->active );
+        if ( result == OK && !helper_reply_bh( r->pool, *reply )) {
+            backend_ok( r, be );
+            return OK;
         }
-        auth_helper->helper_pid = auth_helper->proc->pid;
-#else
-        auth_helper->helper_pid = ap_bspawn_child(pool, helper_child,
-                                                  (void *) &cld, just_wait,
-                                                  &auth_helper->out_to_helper,
-                                                  &auth_helper->in_from_helper,
-                                                  NULL);
-
-        if (auth_helper->helper_pid == -1) {
-            RERROR( errno, "couldn't spawn child ntlm helper process: %s", cld.argv0);
-            return NULL;
+        backend_failed( r, be, cmds->nelts );
+        if ( tried == ( 1U << cmds->nelts ) - 1 ) {
+            break;
         }
+        RDEBUG( "trying the next Plaintext helper backend" );
+    }
+    return result;
+#else
+    return plaintext_backend_verify( r, crec, crec->ntlm_plaintext_helper, user, pass, reply );
 #endif
+}
 
-        RDEBUG( "Launched ntlm_helper, pid %d", auth_helper->helper_pid );
-    } else {
-        RDEBUG( "Using existing auth helper %d", auth_helper->helper_pid );
+/* Check a (user, password) pair with whichever backend is configured */
+static int plaintext_verify( request_rec *r, ntlm_config_rec * crec, const char *user, const char *pass, const char **reply )
+{
+#ifdef HAVE_WBCLIENT
+    if ( crec->native_backend ) {
+        int result = native_verify_plaintext( r, user, pass, reply );
+        if ( result != DECLINED ) {
+            return result;
+        }
     }
-
-    return auth_helper;
+#endif
+    return plaintext_helper_verify( r, crec, user, pass, reply );
 }
 
 /* Call winbind to authenticate a (user, password)
@@ -493,15 +5928,18 @@ static struct _ntlm_auth_helper *get_auth_helper( request_rec *r, struct _ntlm_a
 static int winbind_authenticate_plaintext( request_rec *r, ntlm_config_rec * crec, char *user, char *pass)
 {
     ntlm_connection_context_t *ctxt = get_connection_context( r->connection );
-    char *newline;
-    char args_to_helper[HUGE_STRING_LEN];
-    char args_from_helper[HUGE_STRING_LEN];
-    size_t bytes_written;
-    int bytes_read;
-
-    if (( global_ntlm_context.ntlm_plaintext_helper = get_auth_helper( r, global_ntlm_context.ntlm_plaintext_helper, crec->ntlm_plaintext_helper, CLEANUP(cleanup_ntlm_plaintext_helper))) == NULL ) {
-        return HTTP_INTERNAL_SERVER_ERROR;
-    }
+    const char *args_from_helper;
+    struct helper_reply reply;
+    int result;
+#ifdef APACHE2
+    struct _basic_cache *cache = NULL;
+    unsigned char key[BASIC_CACHE_KEY_LEN], user_key[BASIC_CACHE_KEY_LEN];
+    const char *backend = NULL;
+    int cached = -1;
+#endif
+#ifdef NTLM_HAVE_SOCACHE
+    unsigned char skey[BASIC_CACHE_KEY_LEN], suser_key[BASIC_CACHE_KEY_LEN];
+#endif
 
     if ( ctxt->connected_user_authenticated == NULL ) {
         apr_pool_t *pool;
@@ -509,7 +5947,7 @@ static int winbind_authenticate_plaintext( request_rec *r, ntlm_config_rec * cre
         RDEBUG( "creating auth user" );
 
 #ifdef APACHE2
-        apr_pool_create_ex( &pool, r->connection->pool, NULL, NULL );
+        apr_pool_create_ex( &pool, ctxt->conn->pool, NULL, NULL );
 #else
         pool = ap_make_sub_pool(r->connection->pool);
 #endif
@@ -530,70 +5968,73 @@ static int winbind_authenticate_plaintext( request_rec *r, ntlm_config_rec * cre
         return OK;
     }
 
-    snprintf( args_to_helper, HUGE_STRING_LEN, "%s %s\n", user, pass );
-
-#ifdef APACHE2
-    bytes_written = strlen( args_to_helper );
-    apr_file_write( global_ntlm_context.ntlm_plaintext_helper->proc->in, args_to_helper, &bytes_written );
-#else
-    bytes_written = ap_bwrite( global_ntlm_context.ntlm_plaintext_helper->out_to_helper, args_to_helper, strlen( args_to_helper ));
-#endif
-
-    if ( bytes_written < strlen( args_to_helper )) {
-        RDEBUG( "failed to write user/pass to helper - wrote %d bytes", (int) bytes_written );
-        apr_pool_destroy( global_ntlm_context.ntlm_plaintext_helper->pool );
-        apr_pool_destroy( ctxt->connected_user_authenticated->pool );
-        return HTTP_INTERNAL_SERVER_ERROR;
+    if ( throttle_blocked( r, THROTTLE_USER, user )) {
+        return note_auth_failure( r, NULL );
     }
+    STAT_INC( started[SCHEME_BASIC] );
 
 #ifdef APACHE2
-    apr_file_flush( global_ntlm_context.ntlm_plaintext_helper->proc->in );
-    if ( apr_file_gets( args_from_helper, HUGE_STRING_LEN, global_ntlm_context.ntlm_plaintext_helper->proc->out ) == APR_SUCCESS ) {
-        bytes_read = strlen( args_from_helper );
-    } else {
-        bytes_read = 0;
+    if ( crec->basic_cache_size > 0 ) {
+        backend = basic_cache_backend( r, crec, user );
+        cache = get_basic_cache( crec->basic_cache_size );
+        basic_cache_key( cache, backend, user, pass, key, user_key );
+        if (( cached = basic_cache_lookup( cache, crec, key )) != -1 ) {
+            STAT_INC( basic_cache_hits );
+        }
     }
-#else
-    ap_bflush( global_ntlm_context.ntlm_plaintext_helper->out_to_helper );
-    bytes_read = ap_bgets( args_from_helper, HUGE_STRING_LEN, global_ntlm_context.ntlm_plaintext_helper->in_from_helper );
-#endif
-    if ( bytes_read == 0 ) {
-        RERROR( errno, "early EOF from helper" );
-        apr_pool_destroy(global_ntlm_context.ntlm_plaintext_helper->pool);
-        apr_pool_destroy(ctxt->connected_user_authenticated->pool);
-
-        return HTTP_INTERNAL_SERVER_ERROR;
-    } else if (bytes_read == -1) {
-        RERROR( errno, "helper died!" );
-        apr_pool_destroy(global_ntlm_context.ntlm_plaintext_helper->pool);
-        apr_pool_destroy(ctxt->connected_user_authenticated->pool);
-
-        return HTTP_INTERNAL_SERVER_ERROR;
-    } else if (bytes_read < 2) {
-        RERROR( errno, "failed to read NTLMSSP string from helper - only got %d bytes", bytes_read);
-        apr_pool_destroy(global_ntlm_context.ntlm_plaintext_helper->pool);
-        apr_pool_destroy(ctxt->connected_user_authenticated->pool);
 
-        return HTTP_INTERNAL_SERVER_ERROR;
+#ifdef NTLM_HAVE_SOCACHE
+    if ( cached == -1 && basic_socache_instance ) {
+        if ( backend == NULL ) {
+            backend = basic_cache_backend( r, crec, user );
+        }
+        basic_cache_hmac( basic_socache_secret, backend, user, pass, skey );
+        basic_cache_hmac( basic_socache_secret, backend, user, NULL, suser_key );
+        if (( cached = basic_socache_lookup( r, skey, suser_key )) != -1 ) {
+            RDEBUG( "credentials for %s found in shared cache", user );
+            STAT_INC( basic_socache_hits );
+            if ( cache != NULL ) {
+                basic_cache_store( cache, key, user_key, cached );
+            }
+        }
     }
+#endif
 
-    newline = strchr(args_from_helper, '\n');
-    if (newline != NULL) {
-        *newline = '\0';
+    if ( cached == 1 ) {
+        RDEBUG( "credentials for %s found in cache", user );
+        args_from_helper = "OK";
+    } else if ( cached == 0 ) {
+        RDEBUG( "credentials for %s failed recently", user );
+        args_from_helper = "ERR";
+    } else
+#endif
+    if (( result = plaintext_verify( r, crec, user, pass, &args_from_helper )) != OK ) {
+        apr_pool_destroy( ctxt->connected_user_authenticated->pool );
+        ctxt->connected_user_authenticated = NULL;
+        return result;
     }
 
-    RDEBUG( "got response: %s", args_from_helper );
-
-    if ( strncmp( args_from_helper, "OK", 2 ) == 0 ) {
+    helper_reply_parse( apr_pstrdup( r->pool, args_from_helper ), HELPER_FIELDS_BASIC, &reply );
+    if ( reply.code == HELPER_OK ) {
         RDEBUG( "authentication succeeded!" );
+        throttle_succeeded( r, user );
+        STAT_INC( completed[SCHEME_BASIC] );
+        offer_learn( r, SCHEME_BASIC );
+#ifdef APACHE2
+        if ( cache != NULL && cached == -1 ) {
+            basic_cache_store( cache, key, user_key, 1 );
+        }
+#endif
+#ifdef NTLM_HAVE_SOCACHE
+        if ( basic_socache_instance && cached == -1 ) {
+            basic_socache_store( r, crec, skey, suser_key, 1 );
+        }
+#endif
         ctxt->connected_user_authenticated->user = apr_pstrdup(ctxt->connected_user_authenticated->pool, user);
-        ctxt->connected_user_authenticated->keepalives = r->connection->keepalives;
+        ctxt->connected_user_authenticated->keepalives = AUTH_CONN( r, ctxt )->keepalives;
 #ifdef APACHE2
         r->user = ctxt->connected_user_authenticated->user;
         r->ap_auth_type = apr_pstrdup(r->connection->pool, "Basic");
-        /* disconnect the child process */
-        /*        apr_proc_kill( global_ntlm_context.ntlm_plaintext_helper->proc, 9 );
-                  apr_proc_wait( global_ntlm_context.ntlm_plaintext_helper->proc, &exit, &why, APR_WAIT );*/
 #else
         r->connection->user = ctxt->connected_user_authenticated->user;
         r->connection->ap_auth_type = ap_pstrdup(r->connection->pool, "Basic");
@@ -601,16 +6042,151 @@ static int winbind_authenticate_plaintext( request_rec *r, ntlm_config_rec * cre
         RDEBUG( "authenticated %s", ctxt->connected_user_authenticated->user );
         return  OK;
     } else {
-        if ( strncmp( args_from_helper, "ERR", 3 ) == 0 ) {
+        if ( reply.code == HELPER_ERR ) {
             RDEBUG( "username/password incorrect" );
+            throttle_failed( r, user );
+            STAT_INC( failed[SCHEME_BASIC] );
+#ifdef APACHE2
+            if ( cache != NULL && cached == -1 ) {
+                /* the user's password may have changed: forget any
+                   credentials cached for them before noting this one */
+                basic_cache_forget_user( cache, user_key );
+                basic_cache_store( cache, key, user_key, 0 );
+            }
+#endif
+#ifdef NTLM_HAVE_SOCACHE
+            if ( basic_socache_instance && cached == -1 ) {
+                basic_socache_store( r, crec, skey, suser_key, 0 );
+            }
+#endif
             return note_auth_failure( r, NULL );
         } else {
             RDEBUG( "unknown helper response %s", args_from_helper );
+            apr_pool_destroy( ctxt->connected_user_authenticated->pool );
+            ctxt->connected_user_authenticated = NULL;
             return HTTP_INTERNAL_SERVER_ERROR;
         }
     }
 }
 
+/* Send one leg of an NTLM or Negotiate handshake to a helper.  The
+   first leg goes to the least busy backend that is up, and on to the
+   next if one answers BH or not at all; later legs go back to the
+   helper the first one reached.  Returns OK with the helper's answer
+   in *reply and the helper, unless the broker holds it, in *helper;
+   HTTP_UNAUTHORIZED if the handshake expired between legs; otherwise
+   the status to give the client. */
+static int handshake_leg( request_rec *r, ntlm_config_rec *crec, ntlm_connection_context_t *ctxt,
+                          int scheme, const char *message_type, const char *client_msg,
+                          char **reply, struct _ntlm_auth_helper **helper )
+{
+    const char *name = scheme == SCHEME_NEGOTIATE ? "negotiate" : "ntlm";
+    int max = scheme == SCHEME_NEGOTIATE ? crec->negotiate_ntlm_auth_helper_max : crec->ntlm_auth_helper_max;
+    int first = strcmp( message_type, "YR" ) == 0;
+    struct iovec vec[HELPER_REQUEST_VECS];
+    struct _ntlm_auth_helper *auth_helper;
+    struct _ntlm_helper_pool *hp;
+    int result, nvec, busy;
+    char *cmd;
+#ifdef APACHE2
+    apr_array_header_t *cmds = crec->helper_backends[scheme];
+    struct _ntlm_backend *be;
+    unsigned int tried = 0;
+#endif
+
+    *helper = NULL;
+    for (;;) {
+        auth_helper = NULL;
+        busy = 0;
+#ifdef APACHE2
+        if ( !first ) {
+            be = ctxt->backend;
+        } else if (( be = backend_choose( scheme, cmds, &tried )) != NULL ) {
+            connection_set_backend( ctxt, be );
+        }
+        if ( be == NULL ) {
+            return HTTP_UNAUTHORIZED;
+        }
+        cmd = (char *) be->cmd;
+#else
+        cmd = scheme == SCHEME_NEGOTIATE ? crec->negotiate_ntlm_auth_helper : crec->ntlm_auth_helper;
+#endif
+        /* the caller checked the token; each try uses vec up */
+        nvec = helper_request_token( vec, message_type, client_msg );
+
+#ifdef NTLM_HAVE_BROKER
+        if ( broker_serves( cmd )) {
+            /* the broker holds the handshake's helper between legs */
+            if ( !ctxt->broker_handshake ) {
+                apr_pool_cleanup_register( AUTH_CONN( r, ctxt )->pool, ctxt, cleanup_connection_broker,
+                                           apr_pool_cleanup_null );
+                ctxt->broker_handshake = 1;
+            }
+            result = broker_transact( r, crec, scheme, cmd, broker_conn_id( ctxt ), first,
+                                      vec, nvec, reply );
+            if ( result == HTTP_UNAUTHORIZED ) {
+                return result;
+            }
+        } else
+#endif
+        {
+            hp = get_helper_pool( name, cmd, max, 0, crec );
+            if ( first ) {
+                if (( auth_helper = helper_resume( ctxt->helper, ctxt->helper_lease )) != NULL
+                    && auth_helper->owner != hp ) {
+                    helper_release( auth_helper );
+                    auth_helper = NULL;
+                }
+                if ( auth_helper == NULL ) {
+                    auth_helper = helper_acquire( r->server, r, hp, crec->handshake_timeout );
+                }
+                if ( auth_helper != NULL ) {
+                    connection_lease_helper( r, ctxt, auth_helper );
+                }
+            } else if (( auth_helper = helper_resume( ctxt->helper, ctxt->helper_lease )) == NULL ) {
+                return HTTP_UNAUTHORIZED;
+            }
+
+            if ( auth_helper == NULL ) {
+                /* every helper busy; not the backend's fault */
+                result = HTTP_SERVICE_UNAVAILABLE;
+                busy = 1;
+            } else if (( result = helper_transact( r, crec, auth_helper, vec, nvec, reply )) != OK ) {
+                /* thrown away */
+                auth_helper = NULL;
+            }
+        }
+
+        if ( result == OK && !helper_reply_bh( r->pool, *reply )) {
+#ifdef APACHE2
+            backend_ok( r, be );
+#endif
+            *helper = auth_helper;
+            return OK;
+        }
+#ifdef APACHE2
+        if ( !busy ) {
+            backend_failed( r, be, cmds->nelts );
+        }
+        if ( first && tried != ( 1U << cmds->nelts ) - 1 ) {
+            if ( result == OK ) {
+                RERROR( APR_EGENERAL, "ntlm_auth reports Broken Helper: %s", *reply );
+                STAT_INC( helper_bh[scheme] );
+                if ( auth_helper != NULL ) {
+                    helper_discard( auth_helper );
+                }
+            }
+            connection_unlease_helper( r, ctxt );
+            RDEBUG( "trying the next %s helper backend", name );
+            continue;
+        }
+#endif
+        /* a BH is left to the caller */
+        *helper = auth_helper;
+        return result;
+    }
+}
+
 /* Process a message received from the client.  This can be a request for a
    challenge (type 1) or a request to authenticate a challenge/response
    (type 3). */
@@ -620,30 +6196,24 @@ process_msg(request_rec * r, ntlm_config_rec * crec, const char *auth_type)
 {
     const char *client_msg;
     const char *message_type;
-    char *childarg;
-    char *newline;
-    char args_to_helper[HUGE_STRING_LEN];
-    char args_from_helper[HUGE_STRING_LEN];
+    struct iovec args_to_helper[HELPER_REQUEST_VECS];
+    char *args_from_helper;
+    struct helper_reply reply;
     ntlm_connection_context_t *ctxt = get_connection_context( r->connection );
-    size_t bytes_written;
-    int bytes_read;
+    int result, scheme;
     struct _ntlm_auth_helper *auth_helper;
 
-    /* If this is the first request with this connection, then create
-     * a ntlm_auth_helper entry for it. It will be cleaned up when the
-     * connection is dropped */
+    /* Decode the information the WWW-Authenticate header */
+    if ((client_msg = get_auth_header(r, crec, auth_type)) == NULL) {
+        RDEBUG( "client did not return NTLM authentication header");
+        return note_auth_failure(r, NULL);
+    }
 
     if (strcmp(auth_type, NEGOTIATE_AUTH_NAME) == 0) {
-        auth_helper = get_auth_helper( r, global_ntlm_context.negotiate_ntlm_auth_helper, crec->negotiate_ntlm_auth_helper, CLEANUP(cleanup_negotiate_ntlm_auth_helper));
-        global_ntlm_context.negotiate_ntlm_auth_helper = auth_helper;
+        scheme = SCHEME_NEGOTIATE;
     } else if (strcmp(auth_type, NTLM_AUTH_NAME) == 0) {
-        auth_helper = get_auth_helper( r, global_ntlm_context.ntlm_auth_helper, crec->ntlm_auth_helper, CLEANUP(cleanup_ntlm_auth_helper));
-        global_ntlm_context.ntlm_auth_helper = auth_helper;
+        scheme = SCHEME_NTLM;
     } else {
-        auth_helper = NULL;
-    }
-
-    if ( auth_helper == NULL ) {
         return HTTP_INTERNAL_SERVER_ERROR;
     }
 
@@ -653,7 +6223,7 @@ process_msg(request_rec * r, ntlm_config_rec * crec, const char *auth_type)
         RDEBUG( "creating auth user" );
 
 #ifdef APACHE2
-        apr_pool_create_ex( &pool, r->connection->pool, NULL, NULL );
+        apr_pool_create_ex( &pool, ctxt->conn->pool, NULL, NULL );
 #else
         pool = ap_make_sub_pool(r->connection->pool);
 #endif
@@ -671,202 +6241,405 @@ process_msg(request_rec * r, ntlm_config_rec * crec, const char *auth_type)
         ctxt->connected_user_authenticated->auth_type = NULL;
 
         message_type = "YR";
+        STAT_INC( started[scheme] );
     } else {
         message_type = "KK";
     }
 
-    /* Decode the information the WWW-Authenticate header */
-    if ((client_msg = get_auth_header(r, crec, auth_type)) == NULL) {
-        RDEBUG( "client did not return NTLM authentication header");
-        return note_auth_failure(r, NULL);
+    /* The first leg checks a helper out of the pool; later legs must
+     * go back to the same helper, which holds the NTLMSSP state.  The
+     * lease is returned when the handshake finishes or the connection
+     * is dropped. */
+
+    if ( helper_request_token( args_to_helper, message_type, client_msg ) < 0 ) {
+        RDEBUG( "client sent a line break in its %s token", auth_type );
+        if (( auth_helper = helper_resume( ctxt->helper, ctxt->helper_lease )) != NULL ) {
+            helper_release( auth_helper );
+        }
+#ifdef NTLM_HAVE_BROKER
+        if ( ctxt->broker_handshake ) {
+            apr_pool_cleanup_run( AUTH_CONN( r, ctxt )->pool, ctxt, cleanup_connection_broker );
+        }
+#endif
+        connection_unlease_helper( r, ctxt );
+        apr_pool_destroy(ctxt->connected_user_authenticated->pool);
+        ctxt->connected_user_authenticated = NULL;
+        return note_auth_failure( r, NULL );
     }
 
-    /* Pipe to helper */
-    snprintf(args_to_helper, HUGE_STRING_LEN, "%s %s\n", message_type, client_msg);
+    RDEBUG( "parsing reply from helper to %s %s", message_type, client_msg );
 
-#ifdef APACHE2
-    bytes_written = strlen( args_to_helper );
-    apr_file_write( auth_helper->proc->in, args_to_helper, &bytes_written );
-#else
-    bytes_written = ap_bwrite(auth_helper->out_to_helper, args_to_helper, strlen(args_to_helper));
-#endif
-    if (bytes_written < strlen(args_to_helper)) {
-        RDEBUG("failed to write NTLMSSP string to helper - wrote %d bytes", (int) bytes_written);
-        apr_pool_destroy(auth_helper->pool);
+    result = handshake_leg( r, crec, ctxt, scheme, message_type, client_msg,
+                            &args_from_helper, &auth_helper );
+    if ( result == HTTP_UNAUTHORIZED ) {
+        RDEBUG( "handshake expired before the %s leg arrived", message_type );
+        connection_unlease_helper( r, ctxt );
+        return note_auth_failure( r, NULL );
+    } else if ( result != OK ) {
+        connection_unlease_helper( r, ctxt );
+        apr_pool_destroy(ctxt->connected_user_authenticated->pool);
+        ctxt->connected_user_authenticated = NULL;
+
+        return result;
+    }
+
+    /* inspect message type.  The Negotiate helper's reply has 3 parts:
+       - The code: TT, AF or NA
+       - The blob to send to the client, coded in base64
+       - The argument:
+             For TT it's a dummy '*'
+             For AF it's domain\\user
+             For NA it's the NT error code
+       The NTLM helper's has the code and the blob or the argument. */
+
+    if (helper_reply_parse(args_from_helper, scheme == SCHEME_NEGOTIATE ? HELPER_FIELDS_SPNEGO
+                           : HELPER_FIELDS_NTLMSSP, &reply) != 0) {
+        RERROR( APR_EGENERAL, "failed to parse response from helper: %s", args_from_helper);
+        if ( auth_helper != NULL ) {
+            helper_discard( auth_helper );
+        }
+        connection_unlease_helper( r, ctxt );
         apr_pool_destroy(ctxt->connected_user_authenticated->pool);
+        ctxt->connected_user_authenticated = NULL;
 
         return HTTP_INTERNAL_SERVER_ERROR;
     }
 
+    switch (reply.code) {
+    case HELPER_TT:
+        /* send to client */
+        if ( auth_helper != NULL ) {
+            helper_suspend( auth_helper );
+        }
+        return send_auth_reply(r, auth_type, reply.blob ? reply.blob : reply.arg);
+
+    case HELPER_NA:
+        /* not authenticated */
+        if ( auth_helper != NULL ) {
+            helper_release( auth_helper );
+        }
+        connection_unlease_helper( r, ctxt );
+        RDEBUG("user not authenticated: %s", reply.arg);
+        throttle_failed(r, NULL);
+        STAT_INC( failed[scheme] );
+        return note_auth_failure(r, reply.blob);
+
+    case HELPER_AF:
+        /* record username */
+        if ( auth_helper != NULL ) {
+            helper_release( auth_helper );
+        }
+        connection_unlease_helper( r, ctxt );
+        ctxt->connected_user_authenticated->user =
+            apr_pstrdup(ctxt->connected_user_authenticated->pool, reply.arg);
+        if (scheme == SCHEME_NTLM) {
+            ctxt->connected_user_authenticated->keepalives =
+                AUTH_CONN( r, ctxt )->keepalives;
+        }
 #ifdef APACHE2
-    apr_file_flush( auth_helper->proc->in );
+        r->user = ctxt->connected_user_authenticated->user;
+        if (scheme == SCHEME_NEGOTIATE) {
+            ctxt->connected_user_authenticated->auth_type =
+                apr_pstrdup(ctxt->conn->pool, auth_type);
+            r->ap_auth_type = ctxt->connected_user_authenticated->auth_type;
+        } else {
+            r->ap_auth_type = apr_pstrdup(r->connection->pool, auth_type);
+        }
+        session_issue(r, crec, r->user, auth_type);
+        throttle_succeeded(r, r->user);
+        STAT_INC( completed[scheme] );
+        offer_learn( r, scheme );
+#else
+        r->connection->user = ctxt->connected_user_authenticated->user;
+        if (scheme == SCHEME_NEGOTIATE) {
+            ctxt->connected_user_authenticated->auth_type = ap_pstrdup(r->connection->pool, auth_type);
+            r->connection->ap_auth_type = ctxt->connected_user_authenticated->auth_type;
+        } else {
+            r->connection->ap_auth_type = ap_pstrdup(r->connection->pool, auth_type);
+        }
+#endif
+        RDEBUG( "authenticated %s",
+                ctxt->connected_user_authenticated->user );
+
+        if (reply.blob != NULL && strcmp("*", reply.blob) != 0) {
+            /* Send last leg (possible mutual authentication token) */
+            apr_table_setn(r->headers_out,
+                          (PROXYREQ_PROXY == r->proxyreq) ? "Proxy-Authenticate" : "WWW-Authenticate",
+                          apr_psprintf(r->pool, "%s %s", auth_type, reply.blob));
+        }
+        return OK;
 
-    RDEBUG( "parsing reply from helper to %s", args_to_helper );
+    case HELPER_BH:
+        /* helper is busted */
+        RERROR( APR_EGENERAL, "ntlm_auth reports Broken Helper: %s", args_from_helper);
+        STAT_INC( helper_bh[scheme] );
+        break;
 
-    if ( apr_file_gets(args_from_helper, HUGE_STRING_LEN, auth_helper->proc->out ) == APR_SUCCESS ) {
-        bytes_read = strlen( args_from_helper );
-    } else {
-        bytes_read = 0;
+    default:
+        RERROR( APR_EGENERAL, "could not parse %s helper callback: %s", auth_type, args_from_helper);
+        break;
     }
-#else
-    ap_bflush(auth_helper->out_to_helper);
 
-    bytes_read = ap_bgets(args_from_helper, HUGE_STRING_LEN, auth_helper->in_from_helper);
-#endif
+    /* Helper failed */
 
-    if (bytes_read == 0) {
-        RERROR( errno, "early EOF from helper" );
-        apr_pool_destroy(auth_helper->pool);
-        apr_pool_destroy(ctxt->connected_user_authenticated->pool);
+    if ( auth_helper != NULL ) {
+        helper_discard( auth_helper );
+    }
+    connection_unlease_helper( r, ctxt );
+    apr_pool_destroy(ctxt->connected_user_authenticated->pool);
+    ctxt->connected_user_authenticated = NULL;
 
-        return HTTP_INTERNAL_SERVER_ERROR;
-    } else if (bytes_read == -1) {
-        RERROR( errno, "helper died!");
-        apr_pool_destroy(auth_helper->pool);
-        apr_pool_destroy(ctxt->connected_user_authenticated->pool);
+    return HTTP_INTERNAL_SERVER_ERROR;
+}
 
-        return HTTP_INTERNAL_SERVER_ERROR;
-    } else if (bytes_read < 2) {
-        RERROR( errno, "failed to read NTLMSSP string from helper - only got %d bytes", bytes_read );
-        apr_pool_destroy(auth_helper->pool);
-        apr_pool_destroy(ctxt->connected_user_authenticated->pool);
+#ifdef HAVE_GSSAPI
+/* In-module Kerberos acceptor for Negotiate.  Kerberos tokens carry
+   everything needed to check them against a keytab in one leg, so
+   they skip the gss-spnego helper; NTLM wrapped in SPNEGO still goes
+   to the helper, which keeps the NTLMSSP state. */
 
-        return HTTP_INTERNAL_SERVER_ERROR;
-    }
+static const unsigned char spnego_oid[] = { 0x2b, 0x06, 0x01, 0x05, 0x05, 0x02 };
+static const unsigned char ntlmssp_oid[] = { 0x2b, 0x06, 0x01, 0x04, 0x01, 0x82, 0x37, 0x02, 0x02, 0x0a };
 
-    newline = strchr(args_from_helper, '\n');
-    if (newline != NULL) {
-        *newline = '\0';
+/* Step over a DER tag and length; returns the start of the contents */
+static const unsigned char *der_enter( const unsigned char *p, const unsigned char *end,
+                                       unsigned char tag, apr_size_t *len ) {
+    apr_size_t n = 0;
+    int bytes;
+
+    if ( end - p < 2 || *p++ != tag ) {
+        return NULL;
     }
+    if ( *p < 0x80 ) {
+        n = *p++;
+    } else {
+        bytes = *p++ & 0x7f;
+        if ( bytes < 1 || bytes > 4 || end - p < bytes ) {
+            return NULL;
+        }
+        while ( bytes-- ) {
+            n = ( n << 8 ) | *p++;
+        }
+    }
+    if ( n > (apr_size_t)( end - p )) {
+        return NULL;
+    }
+    *len = n;
 
-    RDEBUG( "got response: %s", args_from_helper );
+    return p;
+}
 
-    /* inspect message type */
+/* Does this Negotiate token belong to the in-module acceptor?  Only
+   an initial token whose preferred mechanism isn't NTLMSSP does, or
+   any token on a connection whose exchange we already started. */
+static int negotiate_is_kerberos( request_rec *r, ntlm_connection_context_t *ctxt,
+                                  const unsigned char *tok, apr_size_t len ) {
+    const unsigned char *p, *end = tok + len;
+    apr_size_t n;
 
-    childarg = strchr(args_from_helper, ' ');
-    if (childarg == NULL) {
-        RERROR( errno, "failed to parse response from helper");
-        apr_pool_destroy(auth_helper->pool);
-        apr_pool_destroy(ctxt->connected_user_authenticated->pool);
+    if ( ctxt->gss_ctx != GSS_C_NO_CONTEXT ) {
+        return 1;
+    }
+    if ( ctxt->helper != NULL ) {
+        /* an NTLM handshake is under way on the helper */
+        return 0;
+    }
 
-        return HTTP_INTERNAL_SERVER_ERROR;
+    /* InitialContextToken: [APPLICATION 0] { thisMech OID, token } */
+    if (( p = der_enter( tok, end, 0x60, &n )) == NULL
+        || ( p = der_enter( p, end, 0x06, &n )) == NULL ) {
+        return 0;
+    }
+    if ( n != sizeof( spnego_oid ) || memcmp( p, spnego_oid, n ) != 0 ) {
+        /* raw Kerberos */
+        return 1;
     }
-    childarg++;
 
-    if (strcasecmp(auth_type, NTLM_AUTH_NAME) == 0) {
-        /* if TT, send to client */
+    /* NegTokenInit: [0] SEQUENCE { mechTypes [0] SEQUENCE OF OID, ... } */
+    p += n;
+    if (( p = der_enter( p, end, 0xa0, &n )) == NULL
+        || ( p = der_enter( p, end, 0x30, &n )) == NULL
+        || ( p = der_enter( p, end, 0xa0, &n )) == NULL
+        || ( p = der_enter( p, end, 0x30, &n )) == NULL
+        || ( p = der_enter( p, end, 0x06, &n )) == NULL ) {
+        return 0;
+    }
+    if ( n == sizeof( ntlmssp_oid ) && memcmp( p, ntlmssp_oid, n ) == 0 ) {
+        RDEBUG( "client prefers NTLMSSP in SPNEGO; using the helper" );
+        return 0;
+    }
 
-        if (strncmp(args_from_helper, "TT ", 3) == 0) {
-            return send_auth_reply(r, auth_type, childarg);
-        }
+    return 1;
+}
 
-        /* if NA, not authenticated */
+static void gss_log_status( request_rec *r, const char *what, OM_uint32 major, OM_uint32 minor ) {
+    OM_uint32 ctx = 0, min;
+    gss_buffer_desc msg;
+    char *text = "";
+
+    do {
+        gss_display_status( &min, major, GSS_C_GSS_CODE, GSS_C_NO_OID, &ctx, &msg );
+        text = apr_pstrcat( r->pool, text, (char *) msg.value, "; ", NULL );
+        gss_release_buffer( &min, &msg );
+    } while ( ctx != 0 );
+    do {
+        gss_display_status( &min, minor, GSS_C_MECH_CODE, GSS_C_NO_OID, &ctx, &msg );
+        text = apr_pstrcat( r->pool, text, (char *) msg.value, NULL );
+        gss_release_buffer( &min, &msg );
+    } while ( ctx != 0 );
+
+    RERROR( APR_EGENERAL, "%s: %s", what, text );
+}
 
-        if (strncmp(args_from_helper, "NA ", 3) == 0) {
-            RDEBUG("user not authenticated: %s", childarg);
-            return note_auth_failure(r, NULL);
-        }
+/* Acceptor credentials for a keytab, acquired once per child */
+static gss_cred_id_t gss_keytab_cred( request_rec *r, const char *keytab ) {
+    gss_cred_id_t cred;
+    gss_key_value_element_desc element;
+    gss_key_value_set_desc store;
+    OM_uint32 major, minor;
 
-        /* if AF, record username */
-        if (strncmp(args_from_helper, "AF ", 3) == 0) {
-            ctxt->connected_user_authenticated->user =
-                apr_pstrdup(ctxt->connected_user_authenticated->pool,
-                            childarg);
-            ctxt->connected_user_authenticated->keepalives =
-                r->connection->keepalives;
-#ifdef APACHE2
-            r->user = ctxt->connected_user_authenticated->user;
-            r->ap_auth_type = apr_pstrdup(r->connection->pool, auth_type);
-            /* disconnect the child process */
-            /*            apr_proc_kill( auth_helper->proc, 9 );
-                          apr_proc_wait( auth_helper->proc, &exit, &why, APR_WAIT );*/
-#else
-            r->connection->user = ctxt->connected_user_authenticated->user;
-            r->connection->ap_auth_type = ap_pstrdup(r->connection->pool, auth_type);
-#endif
-            RDEBUG( "authenticated %s",
-                    ctxt->connected_user_authenticated->user );
-            return OK;
+    POOL_LOCK( global_ntlm_context.mutex );
+    if ( global_ntlm_context.gss_creds == NULL ) {
+        global_ntlm_context.gss_creds = apr_hash_make( global_ntlm_context.pool );
+    }
+    cred = apr_hash_get( global_ntlm_context.gss_creds, keytab, APR_HASH_KEY_STRING );
+    if ( cred == NULL ) {
+        element.key = "keytab";
+        element.value = keytab;
+        store.count = 1;
+        store.elements = &element;
+        major = gss_acquire_cred_from( &minor, GSS_C_NO_NAME, GSS_C_INDEFINITE, GSS_C_NO_OID_SET,
+                                       GSS_C_ACCEPT, &store, &cred, NULL, NULL );
+        if ( GSS_ERROR( major )) {
+            gss_log_status( r, apr_psprintf( r->pool, "can't use keytab %s", keytab ), major, minor );
+            cred = GSS_C_NO_CREDENTIAL;
+        } else {
+            apr_hash_set( global_ntlm_context.gss_creds,
+                          apr_pstrdup( global_ntlm_context.pool, keytab ), APR_HASH_KEY_STRING, cred );
         }
-    } else if (strcasecmp(auth_type, NEGOTIATE_AUTH_NAME) == 0) {
+    }
+    POOL_UNLOCK( global_ntlm_context.mutex );
 
-    /* The child's reply contains 3 parts:
-       - The code: TT, AF or NA
-       - The blob to send to the client, coded in base64
-       - The argument:
-             For TT it's a dummy '*'
-         For AF it's domain\\user
-         For NA it's the NT error code
-    */
+    return cred;
+}
 
-        char *childarg3 = strchr(childarg, ' ');
-        if (childarg3 == NULL) {
-            RERROR( errno, "failed to parse response from helper");
-            apr_pool_destroy(auth_helper->pool);
-            apr_pool_destroy(ctxt->connected_user_authenticated->pool);
+static apr_status_t cleanup_gss_ctx( void *ctxt_v ) {
+    ntlm_connection_context_t *ctxt = ctxt_v;
+    OM_uint32 minor;
 
-            return HTTP_INTERNAL_SERVER_ERROR;
-        }
-        *childarg3 = '\0';
-        childarg3++;
+    if ( ctxt->gss_ctx != GSS_C_NO_CONTEXT ) {
+        gss_delete_sec_context( &minor, &ctxt->gss_ctx, GSS_C_NO_BUFFER );
+    }
 
-        /* if TT, send to client */
+    return APR_SUCCESS;
+}
 
-        if (strncmp(args_from_helper, "TT ", 3) == 0) {
-            return send_auth_reply(r, auth_type, childarg);
-        }
+static void forget_gss_ctx( request_rec *r, ntlm_connection_context_t *ctxt ) {
+    cleanup_gss_ctx( ctxt );
+    apr_pool_cleanup_kill( ctxt->conn->pool, ctxt, cleanup_gss_ctx );
+}
 
-        /* if NA, not authenticated */
+/* Check a Kerberos Negotiate token ourselves */
+static int process_negotiate_gss( request_rec *r, ntlm_config_rec *crec, const unsigned char *tok, apr_size_t len ) {
+    ntlm_connection_context_t *ctxt = get_connection_context( r->connection );
+    gss_cred_id_t cred;
+    gss_buffer_desc input, output = GSS_C_EMPTY_BUFFER, name_buf = GSS_C_EMPTY_BUFFER;
+    gss_name_t client = GSS_C_NO_NAME;
+    OM_uint32 major, minor;
+    apr_pool_t *pool;
+    char *user, *reply = NULL;
 
-        if (strncmp(args_from_helper, "NA ", 3) == 0) {
-            RDEBUG("user not authenticated: %s", childarg3);
-            return note_auth_failure(r, childarg);
-        }
+    if (( cred = gss_keytab_cred( r, crec->negotiate_keytab )) == GSS_C_NO_CREDENTIAL ) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
 
-        /* if AF, record username */
-        if (strncmp(args_from_helper, "AF ", 3) == 0) {
-            ctxt->connected_user_authenticated->user =
-                apr_pstrdup(ctxt->connected_user_authenticated->pool,
-                            childarg3);
-#ifdef APACHE2
-            r->user = ctxt->connected_user_authenticated->user;
-            ctxt->connected_user_authenticated->auth_type =
-                apr_pstrdup(r->connection->pool, auth_type);
-            r->ap_auth_type = ctxt->connected_user_authenticated->auth_type;
-#else
-            r->connection->user = ctxt->connected_user_authenticated->user;
-            ctxt->connected_user_authenticated->auth_type = ap_pstrdup(r->connection->pool, auth_type);
-            r->connection->ap_auth_type = ctxt->connected_user_authenticated->auth_type;
-#endif
+    if ( ctxt->gss_ctx == GSS_C_NO_CONTEXT ) {
+        apr_pool_cleanup_register( ctxt->conn->pool, ctxt, cleanup_gss_ctx, apr_pool_cleanup_null );
+        STAT_INC( started[SCHEME_NEGOTIATE] );
+    }
 
-            if (strcmp("*", childarg) != 0) {
-                /* Send last leg (possible mutual authentication token) */
-                apr_table_setn(r->headers_out,
-                              (PROXYREQ_PROXY == r->proxyreq) ? "Proxy-Authenticate" : "WWW-Authenticate",
-                              apr_psprintf(r->pool, "%s %s", auth_type, childarg));
-            }
+    input.value = (void *) tok;
+    input.length = len;
+    major = gss_accept_sec_context( &minor, &ctxt->gss_ctx, cred, &input, GSS_C_NO_CHANNEL_BINDINGS,
+                                    &client, NULL, &output, NULL, NULL, NULL );
+    if ( output.length ) {
+        reply = apr_palloc( r->pool, apr_base64_encode_len( output.length ));
+        apr_base64_encode_binary( reply, output.value, output.length );
+        gss_release_buffer( &minor, &output );
+    }
 
-            RDEBUG( "wow, we're all happy here" );
+    if ( GSS_ERROR( major )) {
+        gss_log_status( r, "gss_accept_sec_context failed", major, minor );
+        forget_gss_ctx( r, ctxt );
+        STAT_INC( failed[SCHEME_NEGOTIATE] );
+        return note_auth_failure( r, reply );
+    }
+    if ( major & GSS_S_CONTINUE_NEEDED ) {
+        return send_auth_reply( r, NEGOTIATE_AUTH_NAME, reply );
+    }
 
-            return OK;
+    major = gss_display_name( &minor, client, &name_buf, NULL );
+    gss_release_name( &minor, &client );
+    forget_gss_ctx( r, ctxt );
+    if ( GSS_ERROR( major )) {
+        gss_log_status( r, "gss_display_name failed", major, minor );
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    user = apr_pstrndup( r->pool, name_buf.value, name_buf.length );
+    gss_release_buffer( &minor, &name_buf );
+    if ( crec->negotiate_strip_realm ) {
+        char *at = strrchr( user, '@' );
+        if ( at != NULL ) {
+            *at = '\0';
         }
     }
 
-    /* Helper failed */
+    if ( ctxt->connected_user_authenticated != NULL ) {
+        apr_pool_destroy( ctxt->connected_user_authenticated->pool );
+    }
+    apr_pool_create_ex( &pool, ctxt->conn->pool, NULL, NULL );
+    ctxt->connected_user_authenticated = apr_pcalloc( pool, sizeof( struct _connected_user_authenticated ));
+    ctxt->connected_user_authenticated->pool = pool;
+    ctxt->connected_user_authenticated->user = apr_pstrdup( pool, user );
+    ctxt->connected_user_authenticated->auth_type = apr_pstrdup( pool, NEGOTIATE_AUTH_NAME );
+    ctxt->connected_user_authenticated->keepalives = ctxt->conn->keepalives;
+
+    r->user = ctxt->connected_user_authenticated->user;
+    r->ap_auth_type = ctxt->connected_user_authenticated->auth_type;
+
+    if ( reply != NULL ) {
+        /* mutual authentication token */
+        apr_table_setn( r->headers_out,
+                        (PROXYREQ_PROXY == r->proxyreq) ? "Proxy-Authenticate" : "WWW-Authenticate",
+                        apr_psprintf( r->pool, "%s %s", NEGOTIATE_AUTH_NAME, reply ));
+    }
 
-    /* if BH, helper is busted */
+    session_issue( r, crec, r->user, NEGOTIATE_AUTH_NAME );
+    STAT_INC( completed[SCHEME_NEGOTIATE] );
+    offer_learn( r, SCHEME_NEGOTIATE );
+    RDEBUG( "authenticated %s with Kerberos", r->user );
 
-    if (strncmp(args_from_helper, "BH ", 3) == 0) {
-        RERROR( APR_EGENERAL, "ntlm_auth reports Broken Helper: %s", args_from_helper);
-    } else {
-        RERROR( APR_EGENERAL, "could not parse %s helper callback: %s", auth_type, args_from_helper);
-    }
+    return OK;
+}
 
-    apr_pool_destroy(auth_helper->pool);
-    apr_pool_destroy(ctxt->connected_user_authenticated->pool);
+/* Route a Negotiate token to the in-module acceptor if it's Kerberos */
+static int negotiate_try_gss( request_rec *r, ntlm_config_rec *crec, const char *token ) {
+    ntlm_connection_context_t *ctxt = get_connection_context( r->connection );
+    unsigned char *tok;
+    int len;
 
-    return HTTP_INTERNAL_SERVER_ERROR;
+    if ( crec->negotiate_keytab == NULL ) {
+        return DECLINED;
+    }
+    tok = apr_palloc( r->pool, apr_base64_decode_len( token ));
+    len = apr_base64_decode_binary( tok, token );
+    if ( len <= 0 || !negotiate_is_kerberos( r, ctxt, tok, len )) {
+        return DECLINED;
+    }
+
+    return process_negotiate_gss( r, crec, tok, len );
 }
+#endif
 
 /* Called to create a configuration structure for each <Directory> section
    that uses the ntlm auth module. */
@@ -887,6 +6660,102 @@ ntlm_winbind_dir_config(apr_pool_t * p, char *d)
     crec->ntlm_auth_helper = "ntlm_auth --helper-protocol=squid-2.5-ntlmssp";
     crec->negotiate_ntlm_auth_helper = "ntlm_auth --helper-protocol=gss-spnego";
     crec->ntlm_plaintext_helper = "ntlm_auth --helper-protocol=squid-2.5-basic";
+    crec->ntlm_auth_helper_max = 0;
+    crec->negotiate_ntlm_auth_helper_max = 0;
+    crec->ntlm_plaintext_helper_max = 0;
+    crec->ntlm_auth_helper_min = 0;
+    crec->negotiate_ntlm_auth_helper_min = 0;
+    crec->ntlm_plaintext_helper_min = 0;
+    crec->helper_idle_timeout = 0;
+    crec->helper_spawn_wait = 0;
+    crec->handshake_timeout = 10;
+    crec->helper_read_timeout = 15;
+    crec->helper_write_timeout = 5;
+    crec->helper_max_requests = 0;
+    crec->helper_max_age = 0;
+    crec->max_token_size = DEFAULT_MAX_TOKEN_SIZE;
+    crec->basic_cache_size = 0;
+    crec->basic_cache_ttl = 300;
+    crec->basic_cache_negative_ttl = 30;
+    crec->native_backend = 0;
+    crec->negotiate_keytab = NULL;
+    crec->negotiate_strip_realm = 0;
+    crec->session_cookie = NULL;
+    crec->session_lifetime = 3600;
+    crec->session_secure = 1;
+    crec->session_httponly = 1;
+    crec->group_cache_ttl = 300;
+#ifdef APACHE2
+    crec->helper_backends[SCHEME_NTLM] = apr_array_make(p, 1, sizeof(char *));
+    APR_ARRAY_PUSH(crec->helper_backends[SCHEME_NTLM], char *) = crec->ntlm_auth_helper;
+    crec->helper_backends[SCHEME_NEGOTIATE] = apr_array_make(p, 1, sizeof(char *));
+    APR_ARRAY_PUSH(crec->helper_backends[SCHEME_NEGOTIATE], char *) = crec->negotiate_ntlm_auth_helper;
+    crec->helper_backends[SCHEME_BASIC] = apr_array_make(p, 1, sizeof(char *));
+    APR_ARRAY_PUSH(crec->helper_backends[SCHEME_BASIC], char *) = crec->ntlm_plaintext_helper;
+    crec->plaintext_domains = NULL;
+    crec->offer_rules = NULL;
+#endif
+
+    return crec;
+}
+
+#define MERGE(field) \
+    crec->field = CONF_ISSET(add, CONF_OFFSET(field)) ? add->field : base->field
+
+/* A nested section, or a virtual host, keeps what it sets and takes
+   everything else from the enclosing one */
+static void *
+ntlm_winbind_merge_dir_config(apr_pool_t * p, void *base_v, void *add_v)
+{
+    ntlm_config_rec *base = base_v, *add = add_v;
+    ntlm_config_rec *crec
+        = (ntlm_config_rec *) apr_pcalloc(p, sizeof(ntlm_config_rec));
+    unsigned int i;
+
+    MERGE(ntlm_on);
+    MERGE(negotiate_on);
+    MERGE(ntlm_basic_on);
+    MERGE(ntlm_basic_realm);
+    MERGE(authoritative);
+    MERGE(ntlm_auth_helper);
+    MERGE(negotiate_ntlm_auth_helper);
+    MERGE(ntlm_plaintext_helper);
+    MERGE(ntlm_auth_helper_max);
+    MERGE(negotiate_ntlm_auth_helper_max);
+    MERGE(ntlm_plaintext_helper_max);
+    MERGE(ntlm_auth_helper_min);
+    MERGE(negotiate_ntlm_auth_helper_min);
+    MERGE(ntlm_plaintext_helper_min);
+    MERGE(helper_idle_timeout);
+    MERGE(helper_spawn_wait);
+    MERGE(handshake_timeout);
+    MERGE(helper_read_timeout);
+    MERGE(helper_write_timeout);
+    MERGE(helper_max_requests);
+    MERGE(helper_max_age);
+    MERGE(max_token_size);
+    MERGE(basic_cache_size);
+    MERGE(basic_cache_ttl);
+    MERGE(basic_cache_negative_ttl);
+    MERGE(native_backend);
+    MERGE(negotiate_keytab);
+    MERGE(negotiate_strip_realm);
+    MERGE(session_cookie);
+    MERGE(session_lifetime);
+    MERGE(session_secure);
+    MERGE(session_httponly);
+    MERGE(group_cache_ttl);
+#ifdef APACHE2
+    MERGE(helper_backends[SCHEME_NTLM]);
+    MERGE(helper_backends[SCHEME_NEGOTIATE]);
+    MERGE(helper_backends[SCHEME_BASIC]);
+    MERGE(plaintext_domains);
+    MERGE(offer_rules);
+#endif
+
+    for ( i = 0; i < sizeof( crec->set ) / sizeof( crec->set[0] ); i++ ) {
+        crec->set[i] = base->set[i] | add->set[i];
+    }
 
     return crec;
 }
@@ -929,8 +6798,53 @@ authenticate_basic_user(request_rec * r, ntlm_config_rec * crec,
     return result;
 }
 
-/* Check the user id from a http request */
-static int check_user_id(request_rec * r) {
+#ifdef NTLM_HAVE_AUTHN
+/* AuthBasicProvider winbind: checks passwords for mod_auth_basic through
+   NTLMAuthBackend, like NTLMBasicAuth does, so Basic can be combined
+   with httpd's own providers such as mod_authn_socache.  The module's
+   Basic caches are left to NTLMBasicAuth. */
+static authn_status winbind_check_password(request_rec *r, const char *user, const char *password)
+{
+    ntlm_config_rec *crec =
+        (ntlm_config_rec *) ap_get_module_config(r->per_dir_config,
+                                                 &auth_ntlm_winbind_module);
+    struct helper_reply reply;
+    const char *answer;
+
+    if ( throttle_blocked( r, THROTTLE_USER, user )) {
+        return AUTH_DENIED;
+    }
+    STAT_INC( started[SCHEME_BASIC] );
+    if ( plaintext_verify( r, crec, user, password, &answer ) != OK ) {
+        return AUTH_GENERAL_ERROR;
+    }
+
+    helper_reply_parse( apr_pstrdup( r->pool, answer ), HELPER_FIELDS_BASIC, &reply );
+    switch ( reply.code ) {
+    case HELPER_OK:
+        RDEBUG( "winbind provider authenticated %s", user );
+        throttle_succeeded( r, user );
+        STAT_INC( completed[SCHEME_BASIC] );
+        return AUTH_GRANTED;
+    case HELPER_ERR:
+        RDEBUG( "winbind provider: username/password incorrect for %s", user );
+        throttle_failed( r, user );
+        STAT_INC( failed[SCHEME_BASIC] );
+        return AUTH_DENIED;
+    default:
+        RERROR( APR_EGENERAL, "unknown helper response %s", answer );
+        return AUTH_GENERAL_ERROR;
+    }
+}
+
+static const authn_provider authn_winbind_provider = {
+    &winbind_check_password,
+    NULL,                       /* no digest: winbind won't give out hashes */
+};
+#endif
+
+/* Authenticate a request, with the connection's auth state to ourselves */
+static int authenticate_request(request_rec * r) {
     ntlm_config_rec *crec =
         (ntlm_config_rec *) ap_get_module_config(r->per_dir_config,
                                                  &auth_ntlm_winbind_module);
@@ -940,16 +6854,23 @@ static int check_user_id(request_rec * r) {
                                           : "Authorization");
     const char *auth_line2;
 
+    /* Leave the request to other modules, such as mod_auth_basic with
+       AuthBasicProvider winbind, where no scheme of ours is on */
+    if (!crec->ntlm_on && !crec->negotiate_on && !crec->ntlm_basic_on) {
+        RDEBUG( "no NTLM, Negotiate or Basic authentication configured here" );
+        return DECLINED;
+    }
+
     /* Trust the authentication on an existing connection */
     if (ctxt->connected_user_authenticated && ctxt->connected_user_authenticated->user) {
         /* internal redirects cause this to get called more than once
            per request on Apache 1.x. This compensates by checking if
            the connection is the same as the one we authed against */
-        if ( !auth_line || ( ctxt->connected_user_authenticated->keepalives == r->connection->keepalives )) {
+        if ( !auth_line || ( ctxt->connected_user_authenticated->keepalives == AUTH_CONN(r, ctxt)->keepalives )) {
             /* silently accept login with same credentials */
             RDEBUG( "retaining user %s",
                     ctxt->connected_user_authenticated->user );
-            RDEBUG( "keepalives: %d", r->connection->keepalives );
+            RDEBUG( "keepalives: %d", AUTH_CONN(r, ctxt)->keepalives );
 #ifdef APACHE2
             r->user = ctxt->connected_user_authenticated->user;
             r->ap_auth_type = ctxt->connected_user_authenticated->auth_type;
@@ -968,6 +6889,13 @@ static int check_user_id(request_rec * r) {
         }
     }
 
+#ifdef APACHE2
+    /* A new connection from a client that authenticated on another one */
+    if (!auth_line && session_accept(r, crec) == OK) {
+        return OK;
+    }
+#endif
+
     /* No authentication line given.  Return a 401 and a WWW-Authenticate
        header so authentication can commence. */
 
@@ -976,6 +6904,12 @@ static int check_user_id(request_rec * r) {
         return HTTP_UNAUTHORIZED;
     }
 
+    /* A client that keeps failing is refused before it costs a helper
+       or winbind call */
+    if (throttle_blocked(r, THROTTLE_IP, session_client_ip(r))) {
+        return note_auth_failure(r, NULL);
+    }
+
     /* If basic authentication is requested and enabled, try to
        authenticate the user with basic */
 
@@ -993,6 +6927,12 @@ static int check_user_id(request_rec * r) {
             RDEBUG("Negotiate authentication is not enabled");
             return DECLINED;
         } else {
+#ifdef HAVE_GSSAPI
+            int result = negotiate_try_gss(r, crec, ap_getword_white(r->pool, &auth_line2));
+            if (result != DECLINED) {
+                return result;
+            }
+#endif
             return process_msg(r, crec, NEGOTIATE_AUTH_NAME);
         }
     }
@@ -1006,6 +6946,11 @@ static int check_user_id(request_rec * r) {
             return DECLINED;
         } else {
             RDEBUG( "doing ntlm auth dance" );
+#ifdef HAVE_WBCLIENT
+            if (crec->native_backend) {
+                return process_msg_native(r, crec);
+            }
+#endif
             return process_msg(r, crec, NTLM_AUTH_NAME);
         }
     }
@@ -1020,28 +6965,575 @@ static int check_user_id(request_rec * r) {
     return DECLINED;
 }
 
+/* Check the user id from a http request */
+static int check_user_id(request_rec * r) {
+#if defined(NTLM_HAVE_CONN_MASTER) && APR_HAS_THREADS
+    if (r->connection->master != NULL) {
+        /* sibling HTTP/2 streams run on different threads, but a
+           handshake leg from one must not overtake another's */
+        ntlm_connection_context_t *ctxt = get_connection_context( r->connection );
+        int result;
+
+        apr_thread_mutex_lock( ctxt->mutex );
+        result = authenticate_request( r );
+        apr_thread_mutex_unlock( ctxt->mutex );
+
+        return result;
+    }
+#endif
+    return authenticate_request( r );
+}
+
 /* Dispatch list for API hooks */
 #ifdef APACHE2
 static int ntlm_pre_conn(conn_rec *c, void *csd) {
-    ntlm_connection_context_t *ctxt = apr_pcalloc(c->pool, sizeof(ntlm_connection_context_t));
+    ntlm_connection_context_t *ctxt;
+
+#ifdef NTLM_HAVE_CONN_MASTER
+    if (c->master != NULL) {
+        /* get_connection_context() looks on the master */
+        return OK;
+    }
+#endif
 
+    ctxt = apr_pcalloc(c->pool, sizeof(ntlm_connection_context_t));
+    ctxt->conn = c;
+#if APR_HAS_THREADS
+    apr_thread_mutex_create(&ctxt->mutex, APR_THREAD_MUTEX_DEFAULT, c->pool);
+#endif
     ap_set_module_config(c->conn_config, &auth_ntlm_winbind_module, ctxt);
 
     return OK;
 }
 
+/* The helper pools and their locks, for a child or the broker */
+static void ntlm_context_init( apr_pool_t *p, ntlm_server_config_rec *srec )
+{
+    apr_pool_create( &global_ntlm_context.pool, p );
+#if APR_HAS_THREADS
+    apr_thread_mutex_create( &global_ntlm_context.mutex,
+                             APR_THREAD_MUTEX_DEFAULT, global_ntlm_context.pool );
+#if defined(HAVE_WBCLIENT) && !defined(NTLM_WBC_CTX)
+    apr_thread_mutex_create( &global_ntlm_context.native_mutex,
+                             APR_THREAD_MUTEX_DEFAULT, global_ntlm_context.pool );
+#endif
+#endif
+#ifdef HAVE_WBCLIENT
+    global_ntlm_context.native_separator = '\\';
+#endif
+
+    global_ntlm_context.plaintext_concurrency = srec->plaintext_concurrency;
+}
+
+/* NTLMAuthHelperPrespawn.  The broker passes the number of helpers it
+   runs per command line as max; a child passes 0 for the configured
+   limits. */
+static void prespawn_configured( server_rec *s, int max_override )
+{
+    ntlm_server_config_rec *srec =
+        ap_get_module_config(s->module_config, &auth_ntlm_winbind_module);
+    ntlm_config_rec *crec =
+        ap_get_module_config(s->lookup_defaults, &auth_ntlm_winbind_module);
+    int i;
+
+    for ( i = 0; i < srec->prespawn->nelts; i++ ) {
+        ntlm_prespawn_rec *pre = &APR_ARRAY_IDX( srec->prespawn, i, ntlm_prespawn_rec );
+        apr_array_header_t *cmds;
+        int j, max, concurrency = 0;
+
+        /* warm the pools the server's own settings would use, one for
+           each of its backends */
+        if ( strcmp( pre->type, "negotiate" ) == 0 ) {
+            cmds = crec->helper_backends[SCHEME_NEGOTIATE];
+            max = crec->negotiate_ntlm_auth_helper_max;
+        } else if ( strcmp( pre->type, "plaintext" ) == 0 ) {
+            cmds = crec->helper_backends[SCHEME_BASIC];
+            max = crec->ntlm_plaintext_helper_max;
+            concurrency = srec->plaintext_concurrency;
+        } else {
+            cmds = crec->helper_backends[SCHEME_NTLM];
+            max = crec->ntlm_auth_helper_max;
+        }
+        if ( pre->cmd != NULL ) {
+            cmds = apr_array_make( global_ntlm_context.pool, 1, sizeof( char * ));
+            APR_ARRAY_PUSH( cmds, char * ) = pre->cmd;
+        }
+        if ( max_override > 0 ) {
+            max = max_override;
+            concurrency = 0;
+        }
+        for ( j = 0; j < cmds->nelts; j++ ) {
+            helper_prespawn( s, get_helper_pool( pre->type, APR_ARRAY_IDX( cmds, j, char * ), max,
+                                                 concurrency, NULL ), pre->count );
+        }
+    }
+}
+
+/* Set up the per-child helper pools and start any helpers configured
+   with NTLMAuthHelperPrespawn; the rest are spawned on demand */
+static void ntlm_child_init(apr_pool_t *p, server_rec *s)
+{
+    ntlm_server_config_rec *srec =
+        ap_get_module_config(s->module_config, &auth_ntlm_winbind_module);
+
+#ifdef NTLM_HAVE_SOCACHE
+    if ( basic_socache_mutex ) {
+        apr_status_t rv = apr_global_mutex_child_init( &basic_socache_mutex,
+                                                       apr_global_mutex_lockfile( basic_socache_mutex ),
+                                                       p );
+        if ( rv != APR_SUCCESS ) {
+            SERROR( rv, "failed to attach to the basic credential cache mutex" );
+        }
+    }
+#endif
+#ifdef NTLM_HAVE_THROTTLE
+    if ( throttle_mutex ) {
+        apr_status_t rv = apr_global_mutex_child_init( &throttle_mutex,
+                                                       apr_global_mutex_lockfile( throttle_mutex ),
+                                                       p );
+        if ( rv != APR_SUCCESS ) {
+            SERROR( rv, "failed to attach to the failure throttle mutex" );
+            throttle_table = NULL;
+        }
+    }
+#endif
+#ifdef NTLM_HAVE_STATUS
+    stats_child_init();
+#endif
+
+    ntlm_context_init( p, srec );
+
+#ifdef NTLM_HAVE_BROKER
+    if ( broker_on ) {
+        /* the broker runs the helpers, prespawned ones included */
+        if ( broker_listen >= 0 ) {
+            close( broker_listen );
+            broker_listen = -1;
+        }
+        return;
+    }
+#endif
+    prespawn_configured( s, 0 );
+#if APR_HAS_THREADS
+    helper_maintenance_start( p, s );
+#endif
+}
+
+static int ntlm_pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp)
+{
+#ifdef NTLM_HAVE_SOCACHE
+    apr_status_t rv = ap_mutex_register(pconf, BASIC_SOCACHE_MUTEX, NULL,
+                                        APR_LOCK_DEFAULT, 0);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    basic_socache_provider = NULL;
+    basic_socache_instance = NULL;
+    basic_socache_mutex = NULL;
+    basic_socache_secret_set = 0;
+#endif
+#ifdef NTLM_HAVE_THROTTLE
+    rv = ap_mutex_register(pconf, THROTTLE_MUTEX, NULL, APR_LOCK_DEFAULT, 0);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    throttle_size = 0;
+    throttle_user_threshold = 5;
+    throttle_ip_threshold = 50;
+    throttle_max_backoff = 300;
+    throttle_table = NULL;
+    throttle_mutex = NULL;
+#endif
+#ifdef NTLM_HAVE_SHM
+    offer_memory_size = 0;
+    offer_memory_ttl = 86400;
+    offer_table = NULL;
+#endif
+    session_nkeys = 0;
+    session_keys_set = 0;
+#ifdef NTLM_HAVE_LAUNCHER
+    launcher_on = 0;
+#endif
+#ifdef NTLM_HAVE_BROKER
+    broker_on = 0;
+    broker_socket = NULL;
+    broker_helpers = 8;
+    broker_cmds = apr_hash_make(pconf);
+#endif
+
+    return OK;
+}
+
+#ifdef NTLM_HAVE_SOCACHE
+
+static apr_status_t destroy_basic_socache(void *data)
+{
+    if (basic_socache_instance) {
+        basic_socache_provider->destroy(basic_socache_instance, (server_rec *)data);
+        basic_socache_instance = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+static int basic_socache_post_config(apr_pool_t *pconf, server_rec *s)
+{
+    static struct ap_socache_hints hints = { BASIC_CACHE_KEY_LEN + 1,
+                                             1 + BASIC_SOCACHE_GEN_LEN,
+                                             apr_time_from_sec(60) };
+    apr_status_t rv;
+
+    if (basic_socache_instance == NULL) {
+        return OK;
+    }
+
+    if (basic_socache_provider->flags & AP_SOCACHE_FLAG_NOTMPSAFE) {
+        rv = ap_global_mutex_create(&basic_socache_mutex, NULL, BASIC_SOCACHE_MUTEX,
+                                    NULL, s, pconf, 0);
+        if (rv != APR_SUCCESS) {
+            SERROR( rv, "failed to create the basic credential cache mutex" );
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    rv = basic_socache_provider->init(basic_socache_instance, "mod_auth_ntlm_winbind",
+                                      &hints, s, pconf);
+    if (rv != APR_SUCCESS) {
+        SERROR( rv, "failed to initialise the basic credential cache" );
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    apr_pool_cleanup_register(pconf, s, destroy_basic_socache, apr_pool_cleanup_null);
+
+    if (!basic_socache_secret_set) {
+        /* good enough for children sharing one host */
+        apr_generate_random_bytes(basic_socache_secret, sizeof(basic_socache_secret));
+    }
+
+    return OK;
+}
+#endif
+
+#ifdef NTLM_HAVE_SHM
+/* A zeroed segment that every child inherits: anonymous if we can,
+   like shmcb, or else a file in the runtime directory */
+static void *ntlm_shm_create(apr_pool_t *pconf, server_rec *s, apr_size_t size,
+                             const char *name)
+{
+    apr_shm_t *shm;
+    apr_status_t rv;
+    void *base;
+
+    rv = apr_shm_create(&shm, size, NULL, pconf);
+    if (rv == APR_ENOTIMPL) {
+        const char *fname = ap_runtime_dir_relative(pconf, name);
+
+        apr_shm_remove(fname, pconf);
+        rv = apr_shm_create(&shm, size, fname, pconf);
+    }
+    if (rv != APR_SUCCESS) {
+        SERROR( rv, "failed to create shared memory for %s (%lu bytes)",
+                name, (unsigned long) size );
+        return NULL;
+    }
+
+    base = apr_shm_baseaddr_get(shm);
+    memset(base, 0, size);
+    return base;
+}
+#endif
+
+#ifdef NTLM_HAVE_THROTTLE
+static int throttle_post_config(apr_pool_t *pconf, server_rec *s)
+{
+    apr_status_t rv;
+
+    if (throttle_size == 0) {
+        return OK;
+    }
+
+    rv = ap_global_mutex_create(&throttle_mutex, NULL, THROTTLE_MUTEX, NULL, s, pconf, 0);
+    if (rv != APR_SUCCESS) {
+        SERROR( rv, "failed to create the failure throttle mutex" );
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    throttle_table = ntlm_shm_create(pconf, s, APR_OFFSETOF(struct _throttle_table, entries)
+                                     + throttle_size * sizeof(struct _throttle_entry),
+                                     "ntlm-winbind-throttle");
+    if (throttle_table == NULL) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    throttle_table->size = throttle_size;
+
+    return OK;
+}
+#endif
+
+#ifdef NTLM_HAVE_SHM
+static int offer_post_config(apr_pool_t *pconf, server_rec *s)
+{
+    if (offer_memory_size == 0 || offer_memory_ttl == 0) {
+        return OK;
+    }
+
+    offer_table = ntlm_shm_create(pconf, s, APR_OFFSETOF(struct _offer_table, entries)
+                                  + offer_memory_size * sizeof(struct _offer_entry),
+                                  "ntlm-winbind-offer");
+    if (offer_table == NULL) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    offer_table->size = offer_memory_size;
+    offer_table->base = apr_time_now();
+
+    return OK;
+}
+#endif
+
+#ifdef NTLM_HAVE_STATUS
+static int stats_post_config(apr_pool_t *pconf, server_rec *s)
+{
+    /* a slot for as many children as the MPM will ever run at once;
+       children still finishing a graceful restart count into the
+       segment they were born with */
+    if (ap_mpm_query(AP_MPMQ_HARD_LIMIT_DAEMONS, &stats_slots) != APR_SUCCESS
+        || stats_slots < 1) {
+        stats_slots = 1;
+    }
+#ifdef NTLM_HAVE_BROKER
+    if (broker_on) {
+        stats_slots++;
+    }
+#endif
+    stats_base = ntlm_shm_create(pconf, s, stats_slots * STATS_STRIDE, "ntlm-winbind-stats");
+    stats_mine = NULL;
+
+    return stats_base == NULL ? HTTP_INTERNAL_SERVER_ERROR : OK;
+}
+
+static void stats_sum(struct _ntlm_stats *sum)
+{
+    apr_uint32_t *out = (apr_uint32_t *) sum;
+    apr_size_t n = APR_OFFSETOF(struct _ntlm_stats, helpers_running) / sizeof(apr_uint32_t), j;
+    int i, k;
+
+    memset(sum, 0, sizeof(*sum));
+    for (i = 0; i < stats_slots; i++) {
+        struct _ntlm_stats *slot = STATS_SLOT(i);
+        apr_uint32_t *in = (apr_uint32_t *) slot;
+        int alive = slot->pid != 0 && (kill((pid_t) slot->pid, 0) == 0 || errno != ESRCH);
+
+        for (j = 0; j < n; j++) {
+            out[j] += in[j];
+        }
+        /* helpers run now only in children that are still alive; the
+           peak is the most any one child (or the broker) ever ran */
+        for (k = 0; k < SCHEMES; k++) {
+            if (alive) {
+                sum->helpers_running[k] += slot->helpers_running[k];
+                sum->helper_rss_kb[k] += slot->helper_rss_kb[k];
+            }
+            if (slot->helpers_peak[k] > sum->helpers_peak[k]) {
+                sum->helpers_peak[k] = slot->helpers_peak[k];
+            }
+        }
+    }
+}
+
+static const char *stats_bucket_label(apr_pool_t *p, int i)
+{
+    int ms = stats_bucket_ms[i < STATS_BUCKETS - 1 ? i : i - 1];
+
+    return apr_psprintf(p, "%s%d%s", i < STATS_BUCKETS - 1 ? "&lt;" : "&gt;=",
+                        ms < 1000 ? ms : ms / 1000, ms < 1000 ? "ms" : "s");
+}
+
+/* mod_status: a table in the HTML page, Key: value lines for ?auto */
+static int ntlm_status_hook(request_rec *r, int flags)
+{
+    struct _ntlm_stats st;
+    int i, j;
+
+    if (stats_base == NULL) {
+        return OK;
+    }
+    stats_sum(&st);
+
+    if (flags & AP_STATUS_SHORT) {
+        for (i = 0; i < SCHEMES; i++) {
+            ap_rprintf(r, "NTLM%sStarted: %u\n", stats_scheme_names[i], st.started[i]);
+            ap_rprintf(r, "NTLM%sCompleted: %u\n", stats_scheme_names[i], st.completed[i]);
+            ap_rprintf(r, "NTLM%sFailed: %u\n", stats_scheme_names[i], st.failed[i]);
+        }
+        for (i = 0; i < SCHEMES; i++) {
+            const char *h = stats_helper_names[i];
+
+            ap_rprintf(r, "NTLMHelperRequests_%s: %u\n", h, st.helper_requests[i]);
+            ap_rprintf(r, "NTLMHelperSpawns_%s: %u\n", h, st.helper_spawns[i]);
+            ap_rprintf(r, "NTLMHelperDeaths_%s: %u\n", h, st.helper_deaths[i]);
+            ap_rprintf(r, "NTLMHelperBH_%s: %u\n", h, st.helper_bh[i]);
+            ap_rprintf(r, "NTLMHelperTimeouts_%s: %u\n", h, st.helper_timeouts[i]);
+            ap_rprintf(r, "NTLMHelperIdleStops_%s: %u\n", h, st.helper_idle_stops[i]);
+            ap_rprintf(r, "NTLMHelpersRunning_%s: %u\n", h, st.helpers_running[i]);
+            ap_rprintf(r, "NTLMHelpersPeak_%s: %u\n", h, st.helpers_peak[i]);
+            ap_rprintf(r, "NTLMHelperRSSKB_%s: %u\n", h, st.helper_rss_kb[i]);
+            ap_rprintf(r, "NTLMHelperLatency_%s:", h);
+            for (j = 0; j < STATS_BUCKETS; j++) {
+                ap_rprintf(r, " %u", st.helper_latency[i][j]);
+            }
+            ap_rputs("\n", r);
+        }
+        ap_rputs("NTLMHelperLatencyBucketsMs:", r);
+        for (j = 0; j < STATS_BUCKETS - 1; j++) {
+            ap_rprintf(r, " %d", stats_bucket_ms[j]);
+        }
+        ap_rputs(" +Inf\n", r);
+        ap_rprintf(r, "NTLMBasicCacheHits: %u\n", st.basic_cache_hits);
+        ap_rprintf(r, "NTLMBasicSOCacheHits: %u\n", st.basic_socache_hits);
+        ap_rprintf(r, "NTLMSessionCookieHits: %u\n", st.session_hits);
+        ap_rprintf(r, "NTLMGroupLookups: %u\n", st.group_lookups);
+        ap_rprintf(r, "NTLMGroupSOCacheHits: %u\n", st.group_socache_hits);
+#ifdef NTLM_HAVE_THROTTLE
+        if (throttle_table != NULL) {
+            ap_rprintf(r, "NTLMThrottleChecks: %u\n", throttle_table->checks);
+            ap_rprintf(r, "NTLMThrottleFailures: %u\n", throttle_table->failures);
+            ap_rprintf(r, "NTLMThrottleRejectedUser: %u\n", throttle_table->rejected_user);
+            ap_rprintf(r, "NTLMThrottleRejectedIP: %u\n", throttle_table->rejected_ip);
+            ap_rprintf(r, "NTLMThrottleEvictions: %u\n", throttle_table->evictions);
+        }
+#endif
+        return OK;
+    }
+
+    ap_rputs("<hr />\n<h2>mod_auth_ntlm_winbind</h2>\n", r);
+    ap_rputs("<table border=\"0\"><tr><th>Scheme</th><th>Started</th>"
+             "<th>Completed</th><th>Failed</th></tr>\n", r);
+    for (i = 0; i < SCHEMES; i++) {
+        ap_rprintf(r, "<tr><td>%s</td><td>%u</td><td>%u</td><td>%u</td></tr>\n",
+                   stats_scheme_names[i], st.started[i], st.completed[i], st.failed[i]);
+    }
+    ap_rputs("</table>\n", r);
+
+    ap_rputs("<table border=\"0\"><tr><th>Helper</th><th>Running</th><th>Peak</th>"
+             "<th>RSS</th><th>Requests</th><th>Spawns</th><th>Deaths</th><th>BH</th>"
+             "<th>Timeouts</th><th>Idle stops</th>", r);
+    for (j = 0; j < STATS_BUCKETS; j++) {
+        ap_rprintf(r, "<th>%s</th>", stats_bucket_label(r->pool, j));
+    }
+    ap_rputs("</tr>\n", r);
+    for (i = 0; i < SCHEMES; i++) {
+        ap_rprintf(r, "<tr><td>%s</td><td>%u</td><td>%u</td><td>%u kB</td><td>%u</td><td>%u</td>"
+                   "<td>%u</td><td>%u</td><td>%u</td><td>%u</td>",
+                   stats_helper_names[i], st.helpers_running[i], st.helpers_peak[i],
+                   st.helper_rss_kb[i],
+                   st.helper_requests[i], st.helper_spawns[i], st.helper_deaths[i],
+                   st.helper_bh[i], st.helper_timeouts[i], st.helper_idle_stops[i]);
+        for (j = 0; j < STATS_BUCKETS; j++) {
+            ap_rprintf(r, "<td>%u</td>", st.helper_latency[i][j]);
+        }
+        ap_rputs("</tr>\n", r);
+    }
+    ap_rputs("</table>\n", r);
+
+    ap_rprintf(r, "<dl><dt>Basic cache hits: %u in this child's cache, %u in the shared cache</dt>\n",
+               st.basic_cache_hits, st.basic_socache_hits);
+    ap_rprintf(r, "<dt>Requests let in by session cookie: %u</dt>\n", st.session_hits);
+    ap_rprintf(r, "<dt>Group memberships asked of winbindd: %u, found in the shared cache: %u</dt>\n",
+               st.group_lookups, st.group_socache_hits);
+#ifdef NTLM_HAVE_THROTTLE
+    if (throttle_table != NULL) {
+        ap_rprintf(r, "<dt>Failure throttle (%u entries): %u checks, %u failures recorded, "
+                   "%u refused by user, %u by client address, %u live entries evicted</dt>\n",
+                   throttle_table->size, throttle_table->checks, throttle_table->failures,
+                   throttle_table->rejected_user, throttle_table->rejected_ip,
+                   throttle_table->evictions);
+    }
+#endif
+    ap_rputs("</dl>\n", r);
+
+    return OK;
+}
+#endif
+
+static int ntlm_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+                            apr_pool_t *ptemp, server_rec *s)
+{
+    if (!session_keys_set) {
+        /* cookies then only survive until the next restart, and
+           aren't accepted by other hosts behind a balancer */
+        apr_generate_random_bytes(session_keys[0], SESSION_KEY_LEN);
+        session_nkeys = 1;
+    }
+
+#ifdef NTLM_HAVE_THROTTLE
+    if (throttle_post_config(pconf, s) != OK) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+#endif
+#ifdef NTLM_HAVE_SHM
+    if (offer_post_config(pconf, s) != OK) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+#endif
+#ifdef NTLM_HAVE_STATUS
+    if (stats_post_config(pconf, s) != OK) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+#endif
+
+#ifdef NTLM_HAVE_SOCACHE
+    if (basic_socache_post_config(pconf, s) != OK) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+#endif
+
+#ifdef NTLM_HAVE_BROKER
+    /* last, so that the broker inherits the shared memory */
+    return broker_post_config(pconf, s);
+#else
+    return OK;
+#endif
+}
+
+static void *ntlm_winbind_server_config(apr_pool_t *p, server_rec *s)
+{
+    ntlm_server_config_rec *srec = apr_pcalloc(p, sizeof(ntlm_server_config_rec));
+
+    srec->prespawn = apr_array_make(p, 3, sizeof(ntlm_prespawn_rec));
+
+    return srec;
+}
 
 static void register_hooks(apr_pool_t *pool)
 {
+    ap_hook_pre_config(ntlm_pre_config,NULL,NULL,APR_HOOK_MIDDLE);
+#ifdef NTLM_HAVE_LAUNCHER
+    ap_hook_post_config(launcher_post_config,NULL,NULL,APR_HOOK_REALLY_FIRST);
+#endif
+    ap_hook_post_config(ntlm_post_config,NULL,NULL,APR_HOOK_MIDDLE);
+    ap_hook_child_init(ntlm_child_init,NULL,NULL,APR_HOOK_MIDDLE);
     ap_hook_pre_connection(ntlm_pre_conn,NULL,NULL,APR_HOOK_MIDDLE);
     ap_hook_check_user_id(check_user_id,NULL,NULL,APR_HOOK_MIDDLE);
+#ifdef NTLM_HAVE_STATUS
+    APR_OPTIONAL_HOOK(ap,status_hook,ntlm_status_hook,NULL,NULL,APR_HOOK_MIDDLE);
+#endif
+#ifdef NTLM_HAVE_AUTHN
+    ap_register_auth_provider(pool, AUTHN_PROVIDER_GROUP, "winbind",
+                              AUTHN_PROVIDER_VERSION, &authn_winbind_provider,
+                              AP_AUTH_INTERNAL_PER_CONF);
+#endif
+#ifdef NTLM_HAVE_AUTHZ
+    ap_register_auth_provider(pool, AUTHZ_PROVIDER_GROUP, "winbind-group",
+                              AUTHZ_PROVIDER_VERSION, &authz_winbind_group_provider,
+                              AP_AUTH_INTERNAL_PER_CONF);
+#endif
 };
 
 module AP_MODULE_DECLARE_DATA auth_ntlm_winbind_module = {
     STANDARD20_MODULE_STUFF,
     ntlm_winbind_dir_config, /* create per-dir    config structures */
-    NULL,                    /* merge  per-dir    config structures */
-    NULL,                    /* create per-server config structures */
+    ntlm_winbind_merge_dir_config, /* merge  per-dir    config structures */
+    ntlm_winbind_server_config, /* create per-server config structures */
     NULL,                    /* merge  per-server config structures */
     ntlm_winbind_cmds,       /* table of config file commands       */
     register_hooks,          /* register hooks */
@@ -1051,7 +7543,7 @@ module MODULE_VAR_EXPORT auth_ntlm_winbind_module = {
     STANDARD_MODULE_STUFF,
     NULL,                    /* module initializer                  */
     ntlm_winbind_dir_config, /* create per-dir    config structures */
-    NULL,                    /* merge  per-dir    config structures */
+    ntlm_winbind_merge_dir_config, /* merge  per-dir    config structures */
     NULL,                    /* create per-server config structures */
     NULL,                    /* merge  per-server config structures */
     ntlm_winbind_cmds,       /* table of config file commands       */
@@ -0,0 +1,134 @@
+/* Helper request formatting and reply parsing; see ntlm_helper_proto.h */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "ntlm_helper_proto.h"
+
+static void set_vec( struct iovec *vec, const char *base, size_t len ) {
+    vec->iov_base = (char *) base;
+    vec->iov_len = len;
+}
+
+/* A field that would end the line early, or run into the next one */
+static int bad_field( const char *s, size_t *len ) {
+    *len = strcspn( s, "\r\n" );
+    return s[*len] != '\0';
+}
+
+int helper_request_token( struct iovec *vec, const char *type, const char *blob ) {
+    size_t len;
+
+    if ( blob == NULL ) {
+        set_vec( &vec[0], type, strlen( type ));
+        set_vec( &vec[1], "\n", 1 );
+        return 2;
+    }
+    if ( bad_field( blob, &len )) {
+        return -1;
+    }
+    set_vec( &vec[0], type, strlen( type ));
+    set_vec( &vec[1], " ", 1 );
+    set_vec( &vec[2], blob, len );
+    set_vec( &vec[3], "\n", 1 );
+    return 4;
+}
+
+int helper_request_plaintext( struct iovec *vec, char *id_buf, int id,
+                              const char *user, const char *pass ) {
+    size_t user_len, pass_len;
+    int n = 0;
+
+    if ( bad_field( user, &user_len ) || bad_field( pass, &pass_len )) {
+        return -1;
+    }
+    if ( id >= 0 ) {
+        snprintf( id_buf, HELPER_CHANNEL_ID_SIZE, "%d ", id );
+        set_vec( &vec[n++], id_buf, strlen( id_buf ));
+    }
+    set_vec( &vec[n++], user, user_len );
+    set_vec( &vec[n++], " ", 1 );
+    set_vec( &vec[n++], pass, pass_len );
+    set_vec( &vec[n++], "\n", 1 );
+    return n;
+}
+
+/* The reply's code, and its length in *n */
+static int reply_code( const char *line, size_t *n ) {
+    int code;
+
+    switch ( line[0] ) {
+    case 'T': code = line[1] == 'T' ? HELPER_TT : HELPER_UNKNOWN; break;
+    case 'A': code = line[1] == 'F' ? HELPER_AF : HELPER_UNKNOWN; break;
+    case 'N': code = line[1] == 'A' ? HELPER_NA : HELPER_UNKNOWN; break;
+    case 'B': code = line[1] == 'H' ? HELPER_BH : HELPER_UNKNOWN; break;
+    case 'O': code = line[1] == 'K' ? HELPER_OK : HELPER_UNKNOWN; break;
+    case 'E': code = line[1] == 'R' && line[2] == 'R' ? HELPER_ERR : HELPER_UNKNOWN; break;
+    default: return HELPER_UNKNOWN;
+    }
+    if ( code == HELPER_UNKNOWN ) {
+        return code;
+    }
+    /* the code's characters matched, so line is at least *n long */
+    *n = code == HELPER_ERR ? 3 : 2;
+    return line[*n] == ' ' || line[*n] == '\0' ? code : HELPER_UNKNOWN;
+}
+
+int helper_reply_parse( char *line, int fields, struct helper_reply *reply ) {
+    size_t len = strlen( line ), n;
+    char *rest, *sp;
+
+    while ( len > 0 && ( line[len - 1] == '\n' || line[len - 1] == '\r' )) {
+        line[--len] = '\0';
+    }
+
+    reply->code = reply_code( line, &n );
+    reply->blob = NULL;
+    reply->arg = "";
+    if ( reply->code == HELPER_UNKNOWN ) {
+        return 0;
+    }
+    rest = line[n] == ' ' ? line + n + 1 : line + n;
+
+    switch ( reply->code ) {
+    case HELPER_OK:
+    case HELPER_ERR:
+    case HELPER_BH:
+        /* the rest, if any, is a message for the log */
+        reply->arg = rest;
+        return 0;
+    }
+
+    if ( fields == HELPER_FIELDS_BASIC || line[n] == '\0' ) {
+        return -1;
+    }
+    if ( fields == HELPER_FIELDS_SPNEGO ) {
+        if (( sp = strchr( rest, ' ' )) == NULL ) {
+            return -1;
+        }
+        *sp = '\0';
+        reply->blob = rest;
+        rest = sp + 1;
+    }
+    line[n] = '\0';
+    reply->arg = rest;
+    return 0;
+}
+
+int helper_channel_parse( const char *line, long *id, const char **rest ) {
+    long n = 0;
+    const char *p = line;
+
+    while ( *p >= '0' && *p <= '9' ) {
+        if ( n > ( 0x7fffffffL - 9 ) / 10 ) {
+            return -1;
+        }
+        n = n * 10 + ( *p++ - '0' );
+    }
+    if ( p == line || *p != ' ' ) {
+        return -1;
+    }
+    *id = n;
+    *rest = p + 1;
+    return 0;
+}
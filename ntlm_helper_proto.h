@@ -0,0 +1,66 @@
+/* The line protocols spoken to ntlm_auth and other Squid-style helpers,
+   kept free of httpd and APR so they can be fuzzed and benchmarked on
+   their own (see bench/).
+
+   Requests are built as iovecs pointing at the caller's strings, so
+   a token goes to the helper without being copied.  Replies are parsed
+   in place: the line is split with NULs and the parts point into it. */
+
+#ifndef NTLM_HELPER_PROTO_H
+#define NTLM_HELPER_PROTO_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+/* What a reply line starts with */
+enum {
+    HELPER_UNKNOWN = 0,
+    HELPER_TT,          /* a token for the client; the handshake goes on */
+    HELPER_AF,          /* authenticated */
+    HELPER_NA,          /* not authenticated */
+    HELPER_BH,          /* broken helper */
+    HELPER_OK,          /* Basic: the password is right */
+    HELPER_ERR          /* Basic: it isn't */
+};
+
+/* How replies are laid out: "TT blob" and "AF user" for
+   squid-2.5-ntlmssp, "TT blob *" and "AF blob user" for gss-spnego,
+   a bare "OK" or "ERR" for squid-2.5-basic */
+#define HELPER_FIELDS_BASIC     1
+#define HELPER_FIELDS_NTLMSSP   2
+#define HELPER_FIELDS_SPNEGO    3
+
+struct helper_reply {
+    int code;           /* HELPER_TT ... */
+    const char *blob;   /* SPNEGO only: token for the client, or "*" */
+    const char *arg;    /* the rest: token, user or reason; "" if none */
+};
+
+/* Longest request, in iovecs */
+#define HELPER_REQUEST_VECS 5
+
+/* Room for a channel ID and its space */
+#define HELPER_CHANNEL_ID_SIZE 16
+
+/* "YR blob\n", or "KK blob\n"; a NULL blob gives a bare "YR\n".  Returns
+   the number of iovecs used, or -1 if blob would break the line. */
+int helper_request_token( struct iovec *vec, const char *type, const char *blob );
+
+/* "user pass\n", preceded by "id " if id is not negative; id_buf must
+   hold HELPER_CHANNEL_ID_SIZE bytes and live as long as vec.  Returns
+   the number of iovecs used, or -1 if user or pass would break the
+   line. */
+int helper_request_plaintext( struct iovec *vec, char *id_buf, int id,
+                              const char *user, const char *pass );
+
+/* Split a reply of the given layout in place, dropping any trailing
+   CR and LF.  An unrecognised code comes back as HELPER_UNKNOWN with
+   the line untouched.  Returns -1 if a TT, AF or NA lacks its fields. */
+int helper_reply_parse( char *line, int fields, struct helper_reply *reply );
+
+/* Take the channel ID off the front of a concurrent helper's reply.
+   Returns -1 if there isn't one; otherwise *id is set and *rest points
+   just past the ID and its space. */
+int helper_channel_parse( const char *line, long *id, const char **rest );
+
+#endif